@@ -0,0 +1,43 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "../lib/connection.h"
+
+/* Every frame sent or received is written to the pcap file of CAPTURE_ENV, with
+   a Linux cooked header (LINKTYPE_LINUX_SLL2) for the interface and the direction.
+   The frames have no Ethernet header, so they go as the payload of CAPTURE_PROTOCOL. */
+#define CAPTURE_ENV "FLIX_CAPTURE" // Path of the capture, unset doesn't capture
+
+#define CAPTURE_MAGIC 0xA1B23C4D // Timestamps in nanoseconds
+#define CAPTURE_LINKTYPE 276 // LINKTYPE_LINUX_SLL2
+#define CAPTURE_SNAPLEN 65535
+#define CAPTURE_HEADER_SIZE 20 // Size of the cooked header
+#define CAPTURE_PROTOCOL 0x88B5 // Local experimental Ethertype
+#define CAPTURE_FLUSH_MS 1000
+
+/* Direction of a frame, like sll_pkttype */
+#define CAPTURE_INCOMING PACKET_HOST
+#define CAPTURE_OUTGOING PACKET_OUTGOING
+
+/* Frame of a capture read back */
+typedef struct capture_frame {
+    long long time_ns;
+    int ifindex;
+    int direction;
+    size_t length;
+    uint8_t wire[DATA_SIZE + 8];
+} capture_frame_t;
+
+/* Start capturing the frames of a socket, if CAPTURE_ENV is set */
+void capture_open(int socket, int ifindex);
+
+/* Write a frame of a socket to the capture */
+void capture_frame(int socket, const uint8_t *wire, size_t length, int direction);
+
+/* Read the frames of a capture, the caller frees them
+   RETURN:
+    - The quantity of frames, -1 if it isn't a capture of Flix
+*/
+long long capture_read(const char *file_name, capture_frame_t **frames);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include "../lib/connection.h"
+
+/* The catalog is the sorted list of the videos of the server, its version is a hash
+   of the names. A LIST with the version the client has in its data is conditional:
+   the ACK says if the list didn't change, or if the added and removed names follow. */
+#define CATALOG_FILE ".flix_catalog" // Last listing of the client, in the cache directory
+#define CATALOG_HISTORY 8 // Versions the server still sends a delta from
+#define CATALOG_VERSION_SIZE 8
+#define CATALOG_RESCAN_S 2 // A directory changed less than this before the last scan is read again
+
+/* Answer of a conditional LIST, first byte of the ACK, followed by the version */
+#define CATALOG_FULL 0
+#define CATALOG_DELTA 1
+#define CATALOG_NOT_MODIFIED 2
+
+/* Sequence of the SHOW_IN_SCREEN frames of a delta */
+#define CATALOG_ADDED 1
+#define CATALOG_REMOVED 2
+
+/* Answer a LIST with the videos of the directory, or only what changed since the version of the client */
+int catalog_serve(char *directory, packet_t *request, int socket);
+
+/* Fill a LIST with the version of the cached listing */
+void catalog_request(packet_t *p);
+
+/* Read the answer and the version in the ACK of a LIST, an ACK without them is a full list */
+int catalog_answer(packet_t *ack, uint64_t *version);
+
+/* Copy the cached listing if it is still the version */
+int catalog_load(uint64_t version, char (*file_names)[DATA_SIZE], int max_quantity);
+
+/* Keep the full list or apply the delta to the cached one, file_names gets the listing */
+int catalog_apply(int answer, uint64_t version, char (*file_names)[DATA_SIZE], uint8_t *changes, int quantity, int max_quantity);
+
+#endif
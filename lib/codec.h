@@ -0,0 +1,173 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "../lib/connection.h"
+
+/* Wire format of the frames, version 1:
+   start marker | size << 2 | sequence << 3 | type << 3 | data | CRC-8
+   A compact frame has only the size bytes of the data, the CRC follows them. Its size
+   byte says so in the low bits, a frame of version 1 has them at zero.
+   Everything here is a constant or an inline function, the compiler folds
+   the offsets and shifts into each caller. */
+#define CODEC_VERSION 1
+#define CODEC_DATA_SIZE DATA_SIZE
+#define CODEC_FRAME_SIZE (4 + CODEC_DATA_SIZE + 1)
+
+#define CODEC_START 0
+#define CODEC_SIZE 1
+#define CODEC_SEQUENCE 2
+#define CODEC_TYPE 3
+#define CODEC_DATA 4
+#define CODEC_CRC (CODEC_DATA + CODEC_DATA_SIZE)
+
+#define CODEC_SIZE_SHIFT 2 // Size in the upper 6 bits
+#define CODEC_COMPACT 0x01 // Low bit of the size byte, the CRC follows the data
+#define CODEC_ESCAPED 0x02 // The last byte of the data is 0x01, the flag of the escapes, out of a compact frame
+#define CODEC_COMPACT_SIZE(size) (CODEC_DATA + (size) + 1)
+#define CODEC_MIN_FRAME 60 // Compact frames are padded like Ethernet does, the raw socket refuses less than a header
+#define CODEC_SEQUENCE_SHIFT 3 // Sequence in the upper 5 bits
+#define CODEC_TYPE_SHIFT 3 // Type in the upper 5 bits
+
+/* Return codes of codec_decode */
+#define CODEC_OK 0
+#define CODEC_ERR_SHORT -1 // Less than a frame, not from the protocol
+#define CODEC_ERR_MARKER -2 // Another protocol
+#define CODEC_ERR_CRC -3 // Damaged frame, the header is decoded for the NACK
+
+/* The fields must fit in their bits and the frame in the struct, checked when compiling */
+typedef char codec_fields_fit[(MAX_DATA_SIZE >> (8 - CODEC_SIZE_SHIFT)) == 0 &&
+                              (MAX_SEQUENCE >> (8 - CODEC_SEQUENCE_SHIFT)) == 0 &&
+                              (MAX_TYPE >> (8 - CODEC_TYPE_SHIFT)) == 0 ? 1 : -1];
+typedef char codec_frame_fits[CODEC_FRAME_SIZE == sizeof(packet_t) && MAX_DATA_SIZE < CODEC_DATA_SIZE ? 1 : -1];
+
+/* CRC-8 with polynomial 0x07, one step for each byte */
+static const uint8_t codec_crc_table[256] = {
+    0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15,
+    0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+    0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65,
+    0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+    0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5,
+    0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+    0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85,
+    0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+    0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2,
+    0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+    0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2,
+    0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+    0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32,
+    0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+    0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42,
+    0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+    0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C,
+    0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+    0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC,
+    0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+    0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C,
+    0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+    0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C,
+    0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+    0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B,
+    0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+    0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B,
+    0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+    0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB,
+    0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+    0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB,
+    0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+};
+
+/* CRC of size, sequence, type and the first size bytes of data, the rest of
+   the data counts as zeros like in crc8_calc */
+static inline uint8_t codec_crc8(uint8_t size, uint8_t sequence, uint8_t type, const uint8_t *data)
+{
+    uint8_t crc = codec_crc_table[size];
+    crc = codec_crc_table[crc ^ sequence];
+    crc = codec_crc_table[crc ^ type];
+
+    uint8_t length = size < CODEC_DATA_SIZE ? size : CODEC_DATA_SIZE;
+    for(uint8_t i = 0; i < length; i++)
+        crc = codec_crc_table[crc ^ data[i]];
+    for(uint8_t i = length; i < CODEC_DATA_SIZE; i++)
+        crc = codec_crc_table[crc];
+
+    return crc;
+}
+
+/* Write the frame of a packet in wire, the packet isn't changed */
+static inline void codec_encode(const packet_t *packet, uint8_t *wire)
+{
+    wire[CODEC_START] = packet->start_marker;
+    wire[CODEC_SIZE] = packet->size << CODEC_SIZE_SHIFT;
+    wire[CODEC_SEQUENCE] = packet->sequence << CODEC_SEQUENCE_SHIFT;
+    wire[CODEC_TYPE] = packet->type << CODEC_TYPE_SHIFT;
+    memcpy(wire + CODEC_DATA, packet->data, CODEC_DATA_SIZE);
+    wire[CODEC_CRC] = packet->crc8;
+}
+
+/* Write the compact frame of a packet in wire, of at least CODEC_MIN_FRAME bytes
+   RETURN:
+    - The bytes of the frame
+*/
+static inline size_t codec_encode_compact(const packet_t *packet, uint8_t *wire)
+{
+    wire[CODEC_START] = packet->start_marker;
+    wire[CODEC_SIZE] = packet->size << CODEC_SIZE_SHIFT | CODEC_COMPACT;
+    if(packet->data[CODEC_DATA_SIZE - 1] == 0x01)
+        wire[CODEC_SIZE] |= CODEC_ESCAPED;
+    wire[CODEC_SEQUENCE] = packet->sequence << CODEC_SEQUENCE_SHIFT;
+    wire[CODEC_TYPE] = packet->type << CODEC_TYPE_SHIFT;
+    memcpy(wire + CODEC_DATA, packet->data, packet->size);
+    wire[CODEC_DATA + packet->size] = packet->crc8;
+
+    size_t length = CODEC_COMPACT_SIZE(packet->size);
+    if(length < CODEC_MIN_FRAME)
+    {
+        memset(wire + length, 0, CODEC_MIN_FRAME - length);
+        length = CODEC_MIN_FRAME;
+    }
+    return length;
+}
+
+/* Read a received frame in packet, checking the length and the marker first
+   RETURN:
+    CODEC_OK if the packet is valid
+    CODEC_ERR_SHORT or CODEC_ERR_MARKER if it isn't a frame of the protocol, packet isn't changed
+    CODEC_ERR_CRC if the CRC doesn't match
+*/
+static inline int codec_decode(const uint8_t *wire, size_t length, packet_t *packet)
+{
+    if(length < CODEC_COMPACT_SIZE(0))
+        return CODEC_ERR_SHORT;
+    if(wire[CODEC_START] != START_MARKER)
+        return CODEC_ERR_MARKER;
+
+    bool compact = wire[CODEC_SIZE] & CODEC_COMPACT;
+    uint8_t size = wire[CODEC_SIZE] >> CODEC_SIZE_SHIFT;
+    if(length < (compact ? (size_t) CODEC_COMPACT_SIZE(size) : CODEC_FRAME_SIZE))
+        return CODEC_ERR_SHORT;
+
+    packet->start_marker = wire[CODEC_START];
+    packet->size = size;
+    packet->sequence = wire[CODEC_SEQUENCE] >> CODEC_SEQUENCE_SHIFT;
+    packet->type = wire[CODEC_TYPE] >> CODEC_TYPE_SHIFT;
+    if(compact)
+    {
+        memset(packet->data, 0, CODEC_DATA_SIZE);
+        memcpy(packet->data, wire + CODEC_DATA, size);
+        if(wire[CODEC_SIZE] & CODEC_ESCAPED)
+            packet->data[CODEC_DATA_SIZE - 1] = 0x01;
+        packet->crc8 = wire[CODEC_DATA + size];
+    }
+    else
+    {
+        memcpy(packet->data, wire + CODEC_DATA, CODEC_DATA_SIZE);
+        packet->crc8 = wire[CODEC_CRC];
+    }
+
+    if(packet->crc8 != codec_crc8(packet->size, packet->sequence, packet->type, packet->data))
+        return CODEC_ERR_CRC;
+
+    return CODEC_OK;
+}
+
+#endif
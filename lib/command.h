@@ -2,17 +2,39 @@
 #define COMMAND_H
 
 #include "../lib/connection.h"
+#include "../lib/media.h"
+#include "../lib/compress.h"
 
-/* List the video files in the directory */
-int list_video_files_in_directory(char *directory, int socket);
+/* Maximum quantity of videos in one download command and in a listing */
+#define MAX_DOWNLOAD_QUEUE 64
+#define MAX_LIST_SIZE 1024
 
-/* Send a video file with sliding window */
-int send_video(char *file_name, int socket);
+/* Bytes gathered by the receiver before each write */
+#define RECEIVE_BUFFER_SIZE (64 * 1024)
+
+/* Verify if the file have a video extension */
+int is_video_file(const char *filename);
+
+/* Send a video file with sliding window, next_file_name gets the next video the client queued */
+int send_video(char *file_name, int socket, char *next_file_name);
 
 /* Make the download of the select video */
 int download_video(char *file_name, int socket);
 
-/* Receive a video file */
-int receive_video(char *file_path,  int socket, size_t file_size);
+/* Make the download of a queue of videos back to back */
+int download_videos(char (*file_names)[DATA_SIZE], int quantity, int socket);
+
+/* Get the names of the videos in the server */
+int list_remote_videos(char (*file_names)[DATA_SIZE], int max_quantity, int socket);
+
+/* Receive a video file in the order of layout, asking for next_file_name at the end if it isn't NULL */
+int receive_video(char *file_path,  int socket, size_t file_size, media_layout_t *layout, char *next_file_name);
+
+/* Receive the frames of a transfer and write them in fd from offset, following layout if it isn't NULL.
+   With decompress the frames carry a compressed stream and its writer places the bytes. */
+int receive_stream(int fd, off_t offset, char *label, size_t file_size, media_layout_t *layout, decompress_writer_t *decompress, char *next_file_name, int socket);
+
+/* Send a byte range of a video file with sliding window */
+int send_video_range(char *file_name, long long offset, long long length, int socket);
 
 #endif
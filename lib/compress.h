@@ -0,0 +1,91 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "../lib/connection.h"
+#include "../lib/media.h"
+
+/* Compression of a transfer, asked by the client in the ACK of the DESCRIPTOR when the
+   server offers it. The stream is cut in blocks, each one after a header with its size in
+   the file and in the stream. A block that doesn't shrink goes as it is. */
+#define COMPRESS_LEVEL_ENV "FLIX_COMPRESS" // Level the client asks, 0 downloads without compression
+
+#define COMPRESS_OFFSET 41 // Byte of the DESCRIPTOR with the offer, between the layout and the date
+#define COMPRESS_VERSION 1
+#define COMPRESS_REQUEST 0x5A // First byte of the DESCRIPTOR ACK, then the level
+#define COMPRESS_MAX_LEVEL 9
+
+#define COMPRESS_BLOCK (64 * 1024)
+#define COMPRESS_HEADER 8 // Size of the block in the file, then in the stream, 32 bits each
+#define COMPRESS_SAMPLES 16 // Pieces of a block read to estimate its entropy
+#define COMPRESS_SAMPLE_SIZE 256
+#define COMPRESS_MAX_ENTROPY 7.5 // Bits per byte, blocks above it are sent as they are
+
+/* Return code for compression errors */
+#define ERR_COMPRESS -10
+
+/* Result of the compression of a transfer */
+typedef struct compress_stats {
+    size_t original;
+    size_t compressed;
+    int blocks;
+    int skipped; // Blocks sent as they are, by the entropy or because they didn't shrink
+} compress_stats_t;
+
+/* Stream of a file in the order of layout, each block is compressed when the sender
+   reaches it, so the first frame doesn't wait the whole file */
+typedef struct compress_reader {
+    FILE *file;
+    size_t file_size;
+    media_layout_t *layout;
+    int level;
+    long long position; // Bytes of the file already compressed
+    uint8_t *block;
+    int32_t *head;
+    uint8_t *coded; // Header and bytes of the current block in the stream
+    size_t coded_length;
+    size_t coded_sent;
+    int error;
+    compress_stats_t stats;
+} compress_reader_t;
+
+/* Writer of a compressed stream received in pieces, each block goes to its place
+   in the file as soon as its last byte arrives */
+typedef struct decompress_writer {
+    int fd;
+    media_layout_t *layout;
+    uint8_t *coded; // Header and bytes of the block being received
+    uint8_t *block;
+    size_t have;
+    long long position; // Bytes of the file written
+    size_t received; // Bytes of the stream
+    int error;
+} decompress_writer_t;
+
+/* Start the stream of file, 0 or ERR_COMPRESS if there is no memory */
+int compress_reader_open(compress_reader_t *reader, FILE *file, size_t file_size, media_layout_t *layout, int level);
+
+/* Next bytes of the stream, up to size
+   RETURN:
+    - The bytes copied in buffer, 0 at the end or if the file couldn't be read (error is set)
+*/
+size_t compress_read(compress_reader_t *reader, uint8_t *buffer, size_t size);
+
+/* If every byte of the stream was read */
+bool compress_ended(compress_reader_t *reader);
+
+/* Release the buffers of the stream, the file stays open */
+void compress_reader_close(compress_reader_t *reader);
+
+/* Start writing a stream in fd, each byte of the file at its place in layout */
+int decompress_writer_open(decompress_writer_t *writer, int fd, media_layout_t *layout);
+
+/* Take the next bytes of the stream, 0 or ERR_COMPRESS if it is damaged or fd couldn't be written */
+int decompress_write(decompress_writer_t *writer, const uint8_t *bytes, size_t length);
+
+/* Release the buffers, 0 if the stream had the file_size bytes of the file and ended with a block */
+int decompress_writer_close(decompress_writer_t *writer, size_t file_size);
+
+/* Bits per byte of a sample of the block */
+double compress_entropy(const uint8_t *block, size_t size);
+
+#endif
@@ -19,6 +19,7 @@
 #include <netinet/ip.h> // Interface
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <asm/socket.h> // SO_TXTIME
 #include <fcntl.h>
 #include <sys/time.h>
 #include <sys/stat.h>
@@ -39,6 +40,13 @@
 #define END_TRANSMISSION 0x9
 #define ERROR 0x1F
 #define ONLINE 0x11
+#define SIGNATURE 0x0E // Block signatures for delta download
+#define DOWNLOAD_RANGE 0x13 // Byte range of a video, for striped download
+#define JOIN_GROUP 0x14 // Join the multicast transfer of a video
+#define GROUP_DATA 0x15 // Frame of a multicast transfer, with its index
+#define GROUP_NACK 0x16 // Ranges of frames missing in a client of the group
+#define GROUP_END 0x17 // End of a round of the multicast transfer
+#define GROUP_DONE 0x18 // A client of the group has the whole video
 
 /* Just for tests */
 #define SERVER_OFF 0x12
@@ -67,6 +75,7 @@
 #define ERR_BIND -3
 #define CRC_ERROR -4
 #define ERR_TIMEOUT -5
+#define ERR_ABORTED -8 // The receiver stopped the transfer with an ERROR
 #define ERR_ACTIVATION -4
 #define ERR_NACK -3
 
@@ -81,6 +90,16 @@
 /* Anothe constants */
 #define VALID_PACKET 0
 
+/* Kernel buffers of the socket, sized for the windows in flight */
+#define SOCKET_WINDOWS_ENV "FLIX_SOCKET_WINDOWS" // Windows the buffers hold, 0 keeps the system default
+#define SOCKET_WINDOWS 256 // The promiscuous socket also sees the windows of the other sessions
+#define SOCKET_FRAME_OVERHEAD 960 // Memory the kernel charges for each frame besides its bytes
+#define SOCKET_STATS_POLL_MS 100 // How often PACKET_STATISTICS is read while listening
+#define MAX_SOCKETS 64
+
+/* Busy polling, for links where the wakeup of select costs more than the frame */
+#define BUSY_POLL_ENV "FLIX_BUSY_POLL_US" // Microseconds spinning on recv before blocking, 0 always blocks
+
 
 
 /* Struct to represent the protocol packet based on Kermit */
@@ -94,12 +113,24 @@ typedef struct packet {
 } packet_t;
 
 
+/* Frames lost by a socket, kept apart by cause */
+typedef struct socket_stats {
+    unsigned long long frames; // Frames the kernel had for the socket
+    unsigned long long kernel_drops; // Dropped because the receive buffer was full
+    unsigned long long crc_failures;
+    unsigned long long timeouts;
+} socket_stats_t;
+
+
 /* Create and bind a socket to the selected device */
 int create_socket(char *device);
 
 /* Send a packet */
 int send_packet(packet_t *p, int socket);
 
+/* Send a packet at a given time, with SO_TXTIME */
+int send_packet_at(packet_t *packet, int socket, uint64_t txtime);
+
 /* Send a packet and wait for receive - Stop and Wait */
 int send_packet_stop_wait(packet_t *packet, packet_t *response, int timeout, int socket);
 
@@ -109,6 +140,12 @@ int is_a_valid_packet(packet_t *p);
 /* Listen for a packet */
 int listen_for_packet(packet_t *buffer, int timeout, int socket);
 
+/* Listen for a packet, with the timeout in milliseconds */
+int listen_for_packet_ms(packet_t *buffer, long long timeout_ms, int socket);
+
+/* Take a packet already waiting in the socket, without blocking */
+int receive_packet(packet_t *buffer, int socket);
+
 /* Free the memory for the packet */
 void destroy_packet(packet_t *p);
 
@@ -118,4 +155,16 @@ packet_t *create_or_modify_packet(packet_t *packet, uint8_t size, uint8_t sequen
 /* Print based of the type of the reply, ACK, NACK or ERROR */
 void response_reply(packet_t *p);
 
+/* Calculate the CRC8 of size, sequence, type and data */
+uint8_t crc8_calc(packet_t *packet);
+
+/* Losses of a socket until now, with the drops of the kernel up to date */
+void get_socket_stats(int socket, socket_stats_t *stats);
+
+/* Send the DATA frames of a socket compact, or back in version 1 */
+void set_compact_frames(int socket, bool compact);
+
+/* Print the losses of a socket */
+void print_socket_stats(int socket);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "../lib/connection.h"
+
+/* First byte of the DESCRIPTOR ACK when the client asks for a delta */
+#define DELTA_REQUEST 0x44
+
+/* Block size limits, the block size grows with sqrt(file size) */
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (1 << 17)
+
+/* Signatures the server keeps, the blocks of a file of DELTA_MAX_BLOCK blocks where the
+   block stops growing. An old copy with more of them gets the whole file in the delta. */
+#define DELTA_MAX_SIGNATURES DELTA_MAX_BLOCK
+
+/* Signatures that fit in one SIGNATURE packet (12 bytes each) */
+#define SIGNATURES_PER_PACKET 5
+#define SIGNATURE_SIZE 12
+
+/* Instructions of the delta stream */
+#define DELTA_MAGIC "FXD1"
+#define DELTA_COPY 'C'
+#define DELTA_LITERAL 'L'
+
+/* Return code for delta errors */
+#define ERR_DELTA -6
+
+/* Signature of one block of the old copy, rsync style */
+typedef struct block_signature {
+    uint32_t weak; // Rolling checksum
+    uint64_t strong; // FNV-1a 64 bits
+} block_signature_t;
+
+/* Choose the block size for a file */
+uint32_t delta_block_size(size_t file_size);
+
+/* Rolling checksum of a block */
+uint32_t delta_weak_checksum(const uint8_t *buffer, size_t length);
+
+/* Strong checksum of a block */
+uint64_t delta_strong_checksum(const uint8_t *buffer, size_t length);
+
+/* Compute the signatures of every full block of a file */
+block_signature_t *delta_signatures(char *file_name, uint32_t block_size, size_t *count);
+
+/* Write the signatures in a packet payload and read them back */
+void delta_pack_signatures(uint8_t *data, block_signature_t *signatures, size_t count);
+void delta_unpack_signatures(uint8_t *data, block_signature_t *signatures, size_t count);
+
+/* Write in delta the instructions to rebuild file_name from the blocks of the old copy */
+int delta_generate(char *file_name, block_signature_t *signatures, size_t count, uint32_t block_size, FILE *delta);
+
+/* Rebuild new_file_name from the old copy and the delta stream */
+int delta_apply(char *old_file_name, FILE *delta, char *new_file_name);
+
+#endif
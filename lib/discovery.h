@@ -0,0 +1,53 @@
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include "../lib/connection.h"
+
+/* The client sends an ONLINE probe on every candidate interface, again after 1, 2, 4... ms,
+   and keeps the first interface that answers. The sequence of a probe is its round, the ACK
+   has it and the capabilities of the server. A server without them answers an ACK without data. */
+#define DISCOVERY_TIMEOUT_ENV "FLIX_DISCOVERY_MS" // Time the client looks for a server
+
+#define DISCOVERY_TIMEOUT_MS 3000
+#define DISCOVERY_FIRST_WAIT_MS 1 // Wait after the first probe, doubled each round
+#define DISCOVERY_MAX_WAIT_MS 256
+#define DISCOVERY_SETTLE_MS 1 // Time for late answers to the last probe, besides the round trip
+#define MAX_DISCOVERY_INTERFACES 16
+#define DISCOVERY_VERSION 1
+
+/* Offsets of the capabilities in the data of the probe and of its ACK */
+#define DISCOVERY_VERSION_OFFSET 0
+#define DISCOVERY_WINDOW_OFFSET 1
+#define DISCOVERY_DATA_SIZE_OFFSET 2
+#define DISCOVERY_SEQUENCE_OFFSET 3
+#define DISCOVERY_FEATURES_OFFSET 4 // 4 bytes, little endian
+#define DISCOVERY_SIZE 8
+
+/* Features of a server */
+#define FEATURE_DELTA (1 << 0) // SIGNATURE and delta downloads
+#define FEATURE_RANGE (1 << 1) // DOWNLOAD_RANGE, for striped downloads
+#define FEATURE_GROUP (1 << 2) // JOIN_GROUP multicast transfers
+#define FEATURE_QUEUE (1 << 3) // Next video in the ACK of END_TRANSMISSION
+#define FEATURE_CATALOG (1 << 4) // Conditional LIST
+#define FEATURE_LAYOUT (1 << 5) // Media layout in the DESCRIPTOR
+#define FEATURE_COMPRESS (1 << 6) // Compressed stream asked in the ACK of the DESCRIPTOR
+#define DISCOVERY_FEATURES (FEATURE_DELTA | FEATURE_RANGE | FEATURE_GROUP | FEATURE_QUEUE | FEATURE_CATALOG | FEATURE_LAYOUT | FEATURE_COMPRESS)
+
+/* Server found by the client */
+typedef struct server_info {
+    char interface[IFNAMSIZ];
+    int version; // 0 is a server without capabilities
+    int window;
+    int max_data_size;
+    int max_sequence;
+    uint32_t features;
+    double elapsed_ms; // Time until the answer
+} server_info_t;
+
+/* Look for the server on the interfaces, or on every interface that is up if there are none */
+int discover_server(char **interfaces, int quantity, server_info_t *info);
+
+/* Answer an ONLINE, with the capabilities if it is a probe */
+void discovery_answer(packet_t *request, packet_t *answer);
+
+#endif
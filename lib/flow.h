@@ -0,0 +1,50 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include "../lib/connection.h"
+#include "../lib/pipeline.h"
+#include "../lib/media.h"
+#include "../lib/compress.h"
+#include <pthread.h>
+
+/* Settings of the flow control, read from the environment */
+#define RECEIVE_BACKLOG_ENV "FLIX_RECEIVE_BACKLOG_KB" // Bytes waiting the disk before the window closes
+
+#define RECEIVE_BACKLOG_KB 1024
+#define WINDOW_PROBE_MS 100 // First wait of the sender before probing a zero window, doubled up to TIMEOUT
+#define WINDOW_UPDATE_MS 20 // How often a receiver with a zero window checks the disk
+
+/* Receiver side: the received bytes are written by another thread, the
+   window advertised in the ACKs shrinks while the disk is behind */
+typedef struct flow_writer {
+    int fd;
+    media_layout_t *layout; // Offsets are positions in the stream, NULL is the file order
+    decompress_writer_t *decompress; // The stream is compressed, its blocks go to their place
+    spsc_ring_t queue; // Buffers waiting to be written
+    pthread_t thread;
+    size_t backlog; // Bytes queued and not written yet
+    size_t written; // Bytes of the file on disk, in the order of the stream
+    size_t limit;
+    int finished;
+    int error;
+} flow_writer_t;
+
+/* Start the writer thread of a file, decompress NULL writes the bytes as they are */
+int flow_writer_start(flow_writer_t *writer, int fd, media_layout_t *layout, decompress_writer_t *decompress);
+
+/* Queue a buffer to be written at offset, the writer frees it */
+int flow_writer_submit(flow_writer_t *writer, uint8_t *buffer, size_t length, off_t offset);
+
+/* Wait every queued buffer to be written and stop the thread */
+int flow_writer_finish(flow_writer_t *writer);
+
+/* Bytes of the file on disk, in the order of the stream */
+size_t flow_written(flow_writer_t *writer);
+
+/* Frames the receiver can take now, buffered bytes aren't queued yet */
+uint8_t flow_window(flow_writer_t *writer, size_t buffered);
+
+/* Window advertised in an ACK, the whole window if the receiver didn't send one */
+int flow_ack_window(packet_t *ack);
+
+#endif
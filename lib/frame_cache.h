@@ -0,0 +1,32 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include "../lib/connection.h"
+
+/* Settings of the send cache, read from the environment by the server */
+#define FRAME_CACHE_DIR_ENV "FLIX_CACHE_DIR"
+#define FRAME_CACHE_SIZE_ENV "FLIX_SEND_CACHE_MB" // 0 disables the cache
+#define FRAME_CACHE_DEFAULT_DIR "/tmp/flix_cache"
+#define MAX_CACHE_ENTRIES 256
+#define MAX_CACHE_PATH 256
+
+/* Video already split in wire ready frames, mapped from the cache */
+typedef struct cached_video {
+    packet_t *frames; // Frames with sequence 0
+    size_t quantity;
+    size_t map_size;
+} cached_video_t;
+
+/* Start the cache in the directory, with a budget in bytes */
+int frame_cache_init(const char *directory, size_t budget);
+
+/* Map the frames of a video, a miss packetizes it in the background for the next sends */
+int frame_cache_get(char *file_name, cached_video_t *video);
+
+/* Unmap the frames of a video */
+void frame_cache_release(cached_video_t *video);
+
+/* Create a packet from a cached frame with the given sequence, NULL past the frames cached */
+packet_t *frame_cache_packet(cached_video_t *video, long long index, uint8_t sequence);
+
+#endif
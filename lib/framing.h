@@ -0,0 +1,48 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include "../lib/connection.h"
+#include "../lib/codec.h"
+
+/* Size of the payload of the DATA frames, chosen by the sender from the frames lost.
+   The server offers it in the DESCRIPTOR and the client takes it in the ACK, then
+   the frames go compact and a smaller payload is a shorter frame on the wire. Each
+   frame says its size, the receiver writes the bytes one after the other.
+   The size goes in 6 bits, so the payload is at most MAX_DATA_SIZE, and a compact
+   frame is padded to CODEC_MIN_FRAME, so a payload under FRAMES_MIN_SIZE saves nothing
+   on the wire: the sizes go from 55 to 63 bytes. */
+#define FRAMES_ENV "FLIX_ADAPTIVE_FRAMES" // 0 sends every frame with MAX_DATA_SIZE bytes
+
+#define FRAMES_OFFSET 42 // Byte of the DESCRIPTOR with the smallest payload of the server, 0 doesn't adapt
+#define FRAMES_ACCEPT_OFFSET 62 // Byte of the ACK of the DESCRIPTOR with the smallest payload of the client
+#define FRAMES_MIN_SIZE (CODEC_MIN_FRAME - CODEC_COMPACT_SIZE(0)) // The payload of the smallest compact frame without padding
+#define FRAMES_EPOCH 64 // Frames sent between two choices of the size
+#define FRAMES_SMOOTHING 0.25 // Weight of the last epoch in the rate of lost frames
+#define FRAMES_MAX_RATE 0.99
+
+/* Offer the adaptive frames in the data of a DESCRIPTOR */
+void frames_offer(uint8_t *descriptor);
+
+/* Take the adaptive frames in the data of the ACK of the DESCRIPTOR, RETURN the size of the ACK */
+uint8_t frames_accept(uint8_t *data);
+
+/* Smallest payload both ends take, 0 if the client didn't take the frames */
+int frames_negotiate(packet_t *ack);
+
+/* Start the frames of a transfer with the payload from min_size to MAX_DATA_SIZE,
+   0 keeps MAX_DATA_SIZE */
+void frames_start(int socket, int min_size);
+
+/* Payload of the next frame of the socket */
+int frames_size(int socket);
+
+/* Frames given to the socket, the new ones and the ones sent again */
+void frames_sent(int socket, int quantity);
+
+/* A NACK or a timeout of the socket */
+void frames_lost(int socket);
+
+/* End the frames of the transfer, printing the sizes used */
+void frames_stop(int socket);
+
+#endif
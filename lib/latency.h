@@ -0,0 +1,57 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "../lib/connection.h"
+
+/* With SO_TIMESTAMPING the kernel says when a frame entered the qdisc, when the driver
+   took it and when an answer arrived, and the NIC too if it has a clock. Each frame
+   answered with an ACK or a NACK gives the time of its stages:
+    - kernel: from the send of the process to the qdisc
+    - queueing: in the qdisc, where the paced frames wait
+    - wire: from the driver, or the NIC, to the arrival of the answer, the other end included
+    - processing: from the arrival of the answer to the process taking it
+   A frame sent again doesn't count, its answer could be of any of the copies. */
+#define LATENCY_ENV "FLIX_LATENCY" // 1 takes the timestamps of the frames
+#define LATENCY_LOG_ENV "FLIX_LATENCY_LOG" // Path of the stages of each frame, unset doesn't write them
+
+#define LATENCY_CONTROL_SIZE 512 // Control messages of a frame
+
+/* Stages of the frames answered since the last report, in nanoseconds */
+typedef struct latency_stats {
+    unsigned long long frames;
+    bool hardware; // Wire measured by the clock of the NIC
+    long long kernel_ns;
+    long long queueing_ns;
+    long long wire_ns;
+    long long processing_ns;
+    long long max_wire_ns;
+} latency_stats_t;
+
+/* Ask the timestamps for the socket of the device, if LATENCY_ENV is set */
+void latency_open(int socket, char *device);
+
+/* If the socket has timestamps */
+bool latency_enabled(int socket);
+
+/* Keep the time a frame is given to the kernel */
+void latency_sent(int socket, packet_t *packet);
+
+/* Read the timestamps of the frames sent, waiting in the error queue */
+void latency_poll(int socket);
+
+/* Receive a frame with its timestamp, after reading the error queue
+   RETURN:
+    - The bytes of the frame, -1 if nothing came or an error occurred
+*/
+ssize_t latency_receive(int socket, uint8_t *wire, size_t size, int flags, struct sockaddr_ll *from);
+
+/* A frame of the protocol was taken, if it answers a frame sent its stages are added */
+void latency_answer(int socket, packet_t *packet);
+
+/* Stages since the last report, they start again */
+void latency_take(int socket, latency_stats_t *stats);
+
+/* Print the average of the stages since the last report */
+void latency_report(int socket, char *label);
+
+#endif
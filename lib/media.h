@@ -0,0 +1,36 @@
+#ifndef MEDIA_H
+#define MEDIA_H
+
+#include "../lib/connection.h"
+
+/* The index of the container (MP4 moov, MKV cues) is sent before the media
+   data, so the start of the file can be played before the end arrives.
+   The layout travels in the DESCRIPTOR, after the file size. */
+#define MAX_LAYOUT_SEGMENTS 4
+#define LAYOUT_OFFSET 8 // Quantity of segments, then offset and length of each, 32 bits
+#define MAX_LAYOUT_CACHE 64
+
+/* Byte ranges of a file in the order they are sent, no segments is the file order */
+typedef struct media_layout {
+    int quantity;
+    uint32_t offset[MAX_LAYOUT_SEGMENTS];
+    uint32_t length[MAX_LAYOUT_SEGMENTS];
+} media_layout_t;
+
+/* Layout of a video in playback order, parsed once for each version of the file */
+void media_layout(char *file_name, media_layout_t *layout);
+
+/* Put the layout in the data of a DESCRIPTOR, or take it from there */
+void media_pack_layout(uint8_t *data, media_layout_t *layout);
+void media_unpack_layout(uint8_t *data, media_layout_t *layout);
+
+/* Read the bytes of the stream from position, following the layout */
+size_t media_read(FILE *file, media_layout_t *layout, long long position, uint8_t *buffer, size_t size);
+
+/* Write the bytes of the stream from position at their offsets in the file */
+ssize_t media_pwrite(int fd, media_layout_t *layout, uint8_t *buffer, size_t size, long long position);
+
+/* Bytes of the stream before the media data, 0 in the file order */
+size_t media_index_bytes(media_layout_t *layout);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include "../lib/connection.h"
+
+/* Settings of the multicast transfer, read from the environment */
+#define GROUP_WAIT_ENV "FLIX_GROUP_WAIT_MS" // Time the server gathers clients before sending
+#define NACK_BACKOFF_ENV "FLIX_NACK_BACKOFF_MS" // Longest random wait of a client before its NACK
+
+#define GROUP_WAIT_MS 500
+#define NACK_BACKOFF_MS 200
+#define GROUP_ROUND_MS 1000 // NACKs gathered by the server after each GROUP_END
+#define MAX_QUIET_ROUNDS 5 // Rounds without NACK or GROUP_DONE before the server gives up
+#define GROUP_LINGER_MS (3 * GROUP_ROUND_MS) // A client done answers GROUP_END until its ACK, at most this long
+#define MAX_GROUP_MEMBERS 64
+
+/* GROUP_DATA carries the index of the frame before the bytes of the video */
+#define GROUP_INDEX_SIZE 4
+#define GROUP_PAYLOAD_SIZE (MAX_DATA_SIZE - GROUP_INDEX_SIZE)
+
+/* GROUP_NACK carries ranges of missing frames, first index and quantity */
+#define NACK_RANGE_SIZE 8
+#define MAX_NACK_RANGES (MAX_DATA_SIZE / NACK_RANGE_SIZE)
+
+/* JOIN_GROUP carries a nonce of the client before the name, so it finds its ACK */
+#define GROUP_NONCE_SIZE 4
+#define MAX_GROUP_NAME_SIZE (MAX_DATA_SIZE - GROUP_NONCE_SIZE)
+
+/* Return code for multicast errors */
+#define ERR_GROUP -8
+
+/* Send a video once to every client that joined, repairing losses with selective retransmission */
+int serve_group(packet_t *join, int socket);
+
+/* Join the multicast transfer of a video and receive it */
+int join_group(char *file_name, int socket);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include "../lib/connection.h"
+
+/* Settings of the pacing, read from the environment. The file of PACE_CONFIG_ENV
+   may set pace_rate_kb= and server_rate_kb= and is read again when it changes. */
+#define PACE_RATE_ENV "FLIX_PACE_RATE_KB" // KB/s of each transfer, 0 doesn't pace
+#define SERVER_RATE_ENV "FLIX_SERVER_RATE_KB" // KB/s of all the transfers of the server, 0 has no cap
+#define PACE_TXTIME_ENV "FLIX_PACE_TXTIME" // 1 lets the qdisc (fq) space the frames with SO_TXTIME
+#define PACE_CONFIG_ENV "FLIX_PACE_CONFIG"
+
+#define PACE_BURST_US 1000 // Traffic a bucket can save, frames leave in bursts of at most this
+#define PACE_HORIZON_US 10000 // Frames are given to SO_TXTIME at most this early
+
+/* Token bucket, in bytes */
+typedef struct token_bucket {
+    double rate; // Bytes per second, 0 is unlimited
+    double burst;
+    double tokens; // Negative while frames wait for their time
+    long long last_ns;
+} token_bucket_t;
+
+/* Pacing of one transfer */
+typedef struct pacer {
+    token_bucket_t session;
+    bool txtime;
+    int socket;
+} pacer_t;
+
+/* Start the pacing of a transfer with the current settings */
+void pacer_init(pacer_t *pacer, int socket);
+
+/* Send a frame at the pace of the transfer and of the server */
+int pacer_send(pacer_t *pacer, packet_t *packet);
+
+/* Take the bytes of a frame from the rate of the server, in seconds to wait */
+double pacing_server_wait(size_t bytes);
+
+#endif
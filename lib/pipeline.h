@@ -0,0 +1,43 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "../lib/connection.h"
+#include "../lib/frame_cache.h"
+#include "../lib/media.h"
+#include "../lib/compress.h"
+
+/* Settings of the sender pipeline, read from the environment */
+#define PIPELINE_ENV "FLIX_PIPELINE" // 0 sends in one thread, as before
+#define PIPELINE_CPUS_ENV "FLIX_PIPELINE_CPUS" // CPUs of the reader, framer, transmitter and ACK stages, like 0,1,2,3
+#define PIPELINE_RING_ENV "FLIX_PIPELINE_RING" // Slots of each stage queue, rounded up to a power of two
+
+#define PIPELINE_RING_SIZE 256
+#define PIPELINE_STAGES 4
+
+/* Bounded queue between two stages: one thread pushes and one thread pops, no locks */
+typedef struct spsc_ring {
+    void **slots;
+    size_t mask;
+    size_t head; // Next slot to pop, written only by the consumer
+    char padding[64 - sizeof(size_t)]; // Head and tail in different cache lines
+    size_t tail; // Next slot to push, written only by the producer
+} spsc_ring_t;
+
+/* Allocate a ring with at least capacity slots */
+int spsc_ring_init(spsc_ring_t *ring, size_t capacity);
+
+/* Release the slots of a ring */
+void spsc_ring_destroy(spsc_ring_t *ring);
+
+/* Put an item in the ring, false if it is full */
+bool spsc_ring_push(spsc_ring_t *ring, void *item);
+
+/* Take an item from the ring, NULL if it is empty */
+void *spsc_ring_pop(spsc_ring_t *ring);
+
+/* Send the bytes of an open file, or its cached frames, with the sliding window
+   split in reader, framer, transmitter and ACK threads. With compress the reader
+   compresses the blocks of the file as it goes. */
+int pipeline_send(FILE *file, size_t file_size, char *file_name, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, int socket);
+
+#endif
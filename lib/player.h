@@ -0,0 +1,26 @@
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include "../lib/connection.h"
+#include "../lib/media.h"
+
+/* The player of a download starts while the video still comes, once the index of the
+   container and the start of the media data are on disk. The index goes first in the
+   stream, so the player finds it at its place in the file. */
+#define PLAYER_EARLY_ENV "FLIX_PLAY_EARLY_KB" // Media bytes on disk before the player starts, 0 plays after the download
+#define PLAYER_EARLY_KB 1024
+#define PLAYER_COMMAND "mplayer"
+
+/* The next download of the video starts the player when its start is on disk */
+void player_arm(const char *file_name);
+
+/* Bytes of the stream of a file on disk, in order, it starts the armed player when enough came */
+void player_progress(const char *file_name, media_layout_t *layout, size_t file_size, size_t written);
+
+/* Play a video until the player ends, the one started by its download is only waited */
+void player_play(const char *file_name);
+
+/* Stop the player of a download that failed */
+void player_cancel();
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "../lib/connection.h"
+
+/* Settings of the prefetch, read from the environment */
+#define PREFETCH_ENV "FLIX_PREFETCH" // 0 disables the prefetch
+#define PREFETCH_SIZE_ENV "FLIX_PREFETCH_MB" // Smaller videos are prefetched whole, bigger ones only this start
+#define PREFETCH_NEXT_ENV "FLIX_PREFETCH_NEXT" // Videos after the watched one, by name
+#define PREFETCH_POPULAR_ENV "FLIX_PREFETCH_POPULAR" // Most watched videos that aren't in the disk
+
+#define PREFETCH_SIZE_MB 8
+#define PREFETCH_NEXT 1
+#define PREFETCH_POPULAR 1
+#define PREFETCH_CHUNK (256 * 1024) // Range between the checks for a foreground command
+#define PREFETCH_HISTORY ".flix_history"
+#define PREFETCH_SUFFIX ".prefetch" // Start of a video that isn't complete
+#define MAX_HISTORY_ENTRIES 256
+
+/* Times a video was watched, for the popular ones, one line of the history with the name last */
+typedef struct watch_entry {
+    char name[DATA_SIZE];
+    int plays;
+    time_t last;
+} watch_entry_t;
+
+/* Start the thread of the prefetch, the client begins in the foreground */
+void prefetch_start(int socket);
+
+/* Take the socket for a foreground command, waiting the range being prefetched */
+void prefetch_pause();
+
+/* Give the socket back to the prefetch while the client is idle */
+void prefetch_resume();
+
+/* Count a watched video and prefetch the ones likely to come next */
+void prefetch_watched(const char *name);
+
+/* Path of the prefetched start of a video in base, the old copy of its delta. It keeps
+   its name until the video is rebuilt, a failed download can't leave it as the video.
+   RETURN:
+    - If the start of the video was prefetched
+*/
+bool prefetch_base(const char *name, char *base, size_t size);
+
+#endif
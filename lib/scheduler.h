@@ -0,0 +1,59 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "../lib/connection.h"
+#include <pthread.h>
+
+/* Settings of the scheduler, read from the environment */
+#define SCHED_ENV "FLIX_SCHED" // 1 schedules even a server with one interface
+#define SCHED_WEIGHTS_ENV "FLIX_SCHED_WEIGHTS" // interface=weight,... the default weight is 1
+#define SCHED_QUEUE_ENV "FLIX_SCHED_QUEUE" // Frames queued per session before the sender waits
+#define SCHED_STATS_ENV "FLIX_SCHED_STATS_S" // Seconds between the metrics, 0 doesn't print them
+
+#define SCHED_MAX_SOCKETS 64 // Sessions are indexed by the socket, like the AF_XDP sockets
+#define SCHED_QUEUE 256
+#define SCHED_QUANTUM (4 * sizeof(packet_t)) // Bytes a session of weight 1 sends per round
+#define SCHED_STATS_S 10
+
+/* Frame waiting in a queue of the scheduler */
+typedef struct sched_item {
+    packet_t packet;
+    long long queued_ns;
+} sched_item_t;
+
+/* Frames of a session in order, the sender and the dispatcher share it */
+typedef struct sched_queue {
+    sched_item_t *items;
+    size_t mask;
+    size_t head, tail;
+} sched_queue_t;
+
+/* Metrics of a session since the last report */
+typedef struct sched_stats {
+    unsigned long long control, bulk; // Frames sent
+    size_t max_depth; // Largest bulk queue
+    long long control_wait_ns, max_control_wait_ns; // Time control frames spent queued
+} sched_stats_t;
+
+/* One interface of the server: control frames go before the bulk of every session,
+   bulk frames share the link in deficit round-robin by the weight */
+typedef struct sched_session {
+    char name[IFNAMSIZ];
+    int socket;
+    int weight;
+    size_t deficit;
+    sched_queue_t control, bulk;
+    pthread_mutex_t lock;
+    sched_stats_t stats;
+} sched_session_t;
+
+/* Put the socket of an interface in the scheduler, starting the dispatcher */
+int sched_register(int socket, const char *name);
+
+/* Queue a frame of a registered socket, called by send_packet */
+int sched_enqueue(packet_t *packet, int socket);
+
+/* If the frames of the socket go through the scheduler */
+bool sched_active(int socket);
+
+#endif
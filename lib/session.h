@@ -0,0 +1,92 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "../lib/connection.h"
+#include "../lib/media.h"
+
+/* Sessions of the client that don't block: each one is a state machine over its socket,
+   the frames and the timeouts move it, and a callback says when its request ended.
+   The frames carry no address, so a session has a link of its own. One loop, in one
+   thread, drives all of them. */
+#define SESSION_EVENTS 256 // Events taken from epoll at once
+#define SESSION_TIMEOUT_MS (TIMEOUT * 1000)
+#define ERR_SESSION_BUSY -9 // The session already has a request
+
+/* State of a session */
+#define SESSION_IDLE 0
+#define SESSION_ONLINE 1 // ONLINE sent, waiting the ACK
+#define SESSION_LIST 2 // LIST sent, waiting the ACK
+#define SESSION_NAMES 3 // Receiving the names of the list
+#define SESSION_DOWNLOAD 4 // DOWNLOAD sent, waiting the ACK or the DESCRIPTOR
+#define SESSION_DESCRIPTOR 5 // Waiting the DESCRIPTOR
+#define SESSION_DATA 6 // Receiving the frames of the video
+
+typedef struct session session_t;
+
+/* End of the request of a session. result is 0, or the quantity of names of a list,
+   or a negative error. Another request of the session can start in the callback. */
+typedef void (*session_callback_t)(session_t *session, int result, void *context);
+
+/* Sessions of one thread */
+typedef struct session_loop {
+    int epoll_fd;
+    session_t **sessions;
+    int quantity;
+    int size;
+    int busy; // Sessions with a request
+} session_loop_t;
+
+struct session {
+    session_loop_t *loop;
+    int socket;
+    int state;
+    int try;
+    long long deadline; // Of the ACK, or of the next frame
+    packet_t request; // Sent again when the deadline expires, in ONLINE, LIST and DOWNLOAD
+    session_callback_t callback;
+    void *context;
+
+    /* LIST */
+    char (*file_names)[DATA_SIZE]; // Of the caller
+    int max_quantity;
+    char (*names)[DATA_SIZE]; // Names or changes received
+    uint8_t *changes;
+    int quantity;
+    int answer;
+    uint64_t version;
+
+    /* DOWNLOAD */
+    int fd;
+    size_t file_size;
+    media_layout_t layout;
+    uint8_t *buffer;
+    size_t buffered;
+    long long offset; // Position of the buffer in the stream
+    long long frames;
+};
+
+/* Start a loop without sessions */
+int session_loop_init(session_loop_t *loop);
+
+/* Close the sessions and the loop */
+void session_loop_destroy(session_loop_t *loop);
+
+/* Wait at most timeout_ms for frames and move the sessions, RETURN the sessions still busy */
+int session_loop_poll(session_loop_t *loop, long long timeout_ms);
+
+/* Move the sessions until none has a request */
+void session_loop_run(session_loop_t *loop);
+
+/* Put a socket in the loop, the session closes it */
+session_t *session_open(session_loop_t *loop, int socket);
+
+/* Ask if the server is online */
+int session_online(session_t *session, session_callback_t callback, void *context);
+
+/* Ask for the list of videos, with the catalog cache of list_remote_videos */
+int session_list(session_t *session, char (*file_names)[DATA_SIZE], int max_quantity, session_callback_t callback, void *context);
+
+/* Download a video, its bytes are written in fd in the order of the file */
+int session_download(session_t *session, char *file_name, int fd, session_callback_t callback, void *context);
+
+#endif
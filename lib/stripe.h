@@ -0,0 +1,21 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include "../lib/connection.h"
+
+/* Byte ranges handed to each path, a slow path gets smaller ranges */
+#define STRIPE_CHUNK_SIZE (4 * 1024 * 1024)
+#define STRIPE_MIN_CHUNK (256 * 1024)
+
+/* Limits of a striped download */
+#define MAX_STRIPE_PATHS 8
+#define MAX_PATH_FAILURES 2 // Failed ranges in a row before a path is retired
+#define MAX_RANGE_NAME_SIZE (MAX_DATA_SIZE - 16) // Offset and length go before the name
+
+/* Download a video split in byte ranges served over many interfaces at the same time */
+int download_striped(char *file_name, char **interfaces, int quantity);
+
+/* Ask a byte range of a video, the ACK brings the size of the file */
+int request_range(char *file_name, long long offset, long long length, long long *file_size, int socket);
+
+#endif
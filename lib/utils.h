@@ -24,8 +24,8 @@ int show_packet_data(packet_t *p);
 /* Print the progress of the download in a bar */
 void print_progress(size_t total_size, size_t received_packets, size_t packet_size);
 
-/* Get the date of a file */
-struct tm *get_file_date(char *file_name);
+/* Get the date of a file in date, NULL if it couldn't be read */
+struct tm *get_file_date(char *file_name, struct tm *date);
 
 /* Set the date of a file */
 int set_file_date(char *file_name, struct tm *new_date);
@@ -42,6 +42,12 @@ time_t convert_to_time_t(char* date_str);
 /* Replace the bytes in the buffer, for client */
 void replace_bytes_client(uint8_t *buffer, size_t size, uint8_t byte1, uint8_t byte2, uint8_t new_byte1, uint8_t new_byte2);
 
+/* Read a numeric setting from the environment, or the default value */
+long long get_env_number(const char *name, long long default_value);
+
+/* Milliseconds of a monotonic clock, for timeouts */
+long long get_time_ms();
+
 /* Replace the bytes in the buffer, for server */
 void replace_bytes_server(uint8_t *buffer, size_t size, uint8_t byte1, uint8_t byte2, uint8_t new_byte1, uint8_t new_byte2);
 
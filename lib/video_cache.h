@@ -0,0 +1,47 @@
+#ifndef VIDEO_CACHE_H
+#define VIDEO_CACHE_H
+
+#include "../lib/connection.h"
+
+/* Settings of the client cache, read from the environment */
+#define VIDEO_CACHE_DIR_ENV "FLIX_VIDEO_CACHE_DIR" // Directory of the downloads, the current one by default
+#define VIDEO_CACHE_SIZE_ENV "FLIX_VIDEO_CACHE_MB" // Quota of the cached videos, 0 is only limited by the disk
+#define VIDEO_CACHE_TTL_ENV "FLIX_VIDEO_CACHE_TTL_S" // Seconds a video is played without asking the server
+
+#define VIDEO_CACHE_INDEX ".flix_index"
+#define VIDEO_CACHE_TTL_S 3600
+#define MAX_VIDEO_CACHE_ENTRIES 1024
+
+/* Downloaded video, one line of the index: the numbers, then the name up to the end
+   of the line, so it may have spaces */
+typedef struct video_entry {
+    char name[DATA_SIZE];
+    size_t size;
+    time_t mtime;
+    uint64_t hash; // Checked when the size or the date changed
+    time_t last_played;
+    time_t checked; // Last time the server confirmed the copy
+} video_entry_t;
+
+/* Move to the cache directory and read its index */
+int video_cache_init();
+
+/* If the local copy of a video can be used without the network */
+bool video_cache_hit(const char *name);
+
+/* Evict the least recently played videos until size bytes fit */
+int video_cache_reserve(size_t size, const char *name);
+
+/* Put a video that was downloaded or confirmed by the server in the index */
+void video_cache_add(const char *name);
+
+/* Mark a video as played now */
+void video_cache_played(const char *name);
+
+/* Keep a video out of the evictions while it plays, NULL releases it */
+void video_cache_pin(const char *name);
+
+/* Delete a video and its entry */
+void video_cache_remove(const char *name);
+
+#endif
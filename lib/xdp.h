@@ -0,0 +1,38 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include "../lib/connection.h"
+
+/* Settings of the AF_XDP transport, read from the environment */
+#define XDP_ENV "FLIX_XDP" // 1 sends DATA frames and receives through AF_XDP
+#define XDP_QUEUE_ENV "FLIX_XDP_QUEUE" // Queue of the interface, 0 by default
+
+/* UMEM: the first half of the frames is for receive, the second for transmit */
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAMES 4096
+#define XDP_RING_SIZE 2048
+#define XDP_TX_BATCH 32 // Frames queued before waking up the kernel
+#define XDP_MAX_SOCKETS 64
+
+/* Return code for AF_XDP errors */
+#define ERR_XDP -7
+
+/* Attach an AF_XDP socket to the interface of a raw socket */
+int xdp_attach(int socket, char *device);
+
+/* Release the AF_XDP socket of a raw socket */
+void xdp_detach(int socket);
+
+/* AF_XDP socket file descriptor of a raw socket, -1 if there is none */
+int xdp_fd(int socket);
+
+/* Queue a frame in the TX ring */
+int xdp_send(int socket, const void *frame, size_t length);
+
+/* Wake up the kernel to send the queued frames */
+void xdp_flush(int socket);
+
+/* Take a frame from the RX ring, without waiting */
+ssize_t xdp_receive(int socket, void *buffer, size_t length);
+
+#endif
@@ -0,0 +1,303 @@
+#include "../lib/connection.h"
+#include "../lib/codec.h"
+#include "../lib/utils.h"
+
+/* Microbenchmarks of the connection layer, each case runs until BENCH_MIN_MS
+   and reports ns/op, items/s (frames or names) and bytes/s
+   Usage: bench [--json file] [filter]
+*/
+#define BENCH_MIN_ENV "FLIX_BENCH_MIN_MS"
+#define BENCH_MIN_MS 200
+
+/* Defined in command.c */
+int is_video_file(const char *filename);
+
+/* One case: a loop of iterations over the same frame */
+typedef struct bench_case {
+    const char *name;
+    void (*run)(long long iterations);
+    int items; // Frames, or names, handled by one iteration
+    int bytes; // Bytes handled by one iteration
+} bench_case_t;
+
+/* Result of a case */
+typedef struct bench_result {
+    long long iterations;
+    double ns_per_op;
+    double items_per_second;
+    double bytes_per_second;
+} bench_result_t;
+
+/* Keeps the compiler from removing the loops */
+volatile uint8_t bench_sink;
+
+uint8_t bench_data[DATA_SIZE];
+packet_t bench_packet;
+uint8_t bench_wire[CODEC_FRAME_SIZE];
+
+/* Monotonic time in seconds */
+double bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* *** Previous framing, kept as the reference of the replacements *** */
+
+/* The CRC as it was computed before the codec, bit by bit */
+uint8_t legacy_crc8(packet_t *packet)
+{
+    uint8_t data[3 + DATA_SIZE];
+    data[0] = packet->size;
+    data[1] = packet->sequence;
+    data[2] = packet->type;
+    memset(data + 3, 0, DATA_SIZE);
+    if(packet->size > 0)
+        memcpy(data + 3, packet->data, packet->size);
+
+    uint8_t crc = 0x00;
+    for(size_t j = 0; j < sizeof(data); j++)
+    {
+        crc ^= data[j];
+        for(int i = 0; i < 8; i++)
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+/* The fields shifted in the packet itself, like send_packet did */
+void shift_bits(packet_t *packet)
+{
+    packet->size = packet->size << CODEC_SIZE_SHIFT;
+    packet->sequence = packet->sequence << CODEC_SEQUENCE_SHIFT;
+    packet->type = packet->type << CODEC_TYPE_SHIFT;
+}
+
+void unshift_bits(packet_t *packet)
+{
+    packet->size = packet->size >> CODEC_SIZE_SHIFT;
+    packet->sequence = packet->sequence >> CODEC_SEQUENCE_SHIFT;
+    packet->type = packet->type >> CODEC_TYPE_SHIFT;
+}
+
+/* *** Cases *** */
+
+void bench_legacy_crc8(long long iterations)
+{
+    for(long long i = 0; i < iterations; i++)
+    {
+        bench_packet.data[0] = i;
+        bench_sink = legacy_crc8(&bench_packet);
+    }
+}
+
+void bench_crc8_calc(long long iterations)
+{
+    for(long long i = 0; i < iterations; i++)
+    {
+        bench_packet.data[0] = i;
+        bench_sink = crc8_calc(&bench_packet);
+    }
+}
+
+void bench_create_or_modify_packet(long long iterations)
+{
+    for(long long i = 0; i < iterations; i++)
+    {
+        bench_data[0] = i;
+        create_or_modify_packet(&bench_packet, MAX_DATA_SIZE, i % (MAX_SEQUENCE + 1), DATA, bench_data);
+        bench_sink = bench_packet.crc8;
+    }
+}
+
+/* Shift, copy to the wire and unshift, then the receiver copy and unshift */
+void bench_shift_bits(long long iterations)
+{
+    packet_t received;
+    for(long long i = 0; i < iterations; i++)
+    {
+        bench_packet.sequence = i % (MAX_SEQUENCE + 1);
+        shift_bits(&bench_packet);
+        memcpy(bench_wire, &bench_packet, sizeof(packet_t));
+        unshift_bits(&bench_packet);
+        memcpy(&received, bench_wire, sizeof(packet_t));
+        unshift_bits(&received);
+        bench_sink = received.sequence;
+    }
+}
+
+void bench_codec_encode(long long iterations)
+{
+    for(long long i = 0; i < iterations; i++)
+    {
+        bench_packet.sequence = i % (MAX_SEQUENCE + 1);
+        codec_encode(&bench_packet, bench_wire);
+        bench_sink = bench_wire[CODEC_SEQUENCE];
+    }
+}
+
+void bench_codec_decode(long long iterations)
+{
+    packet_t received;
+    codec_encode(&bench_packet, bench_wire);
+    for(long long i = 0; i < iterations; i++)
+        bench_sink = codec_decode(bench_wire, sizeof(bench_wire), &received);
+}
+
+/* Escape on the server and unescape on the client, like each DATA frame */
+void bench_replace_bytes(long long iterations)
+{
+    uint8_t buffer[DATA_SIZE];
+    for(long long i = 0; i < iterations; i++)
+    {
+        memcpy(buffer, bench_data, DATA_SIZE);
+        buffer[8] = (i & 1) ? 0x88 : 0x81;
+        buffer[9] = (i & 1) ? 0xA8 : 0x00;
+        replace_bytes_server(buffer, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+        replace_bytes_server(buffer, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+        replace_bytes_client(buffer, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+        replace_bytes_client(buffer, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+        bench_sink = buffer[8];
+    }
+}
+
+void bench_is_video_file(long long iterations)
+{
+    const char *names[] = { "holiday_2023.mkv", "notes.txt", "a.mp4", "archive.tar.gz" };
+    for(long long i = 0; i < iterations; i++)
+        bench_sink = is_video_file(names[i & 3]);
+}
+
+void bench_convert_to_string(long long iterations)
+{
+    for(long long i = 0; i < iterations; i++)
+    {
+        char *name = convert_to_string(bench_data, MAX_FILE_NAME_SIZE);
+        bench_sink = name[0];
+        free(name);
+    }
+}
+
+/* New cases go here, next to the ones they replace */
+bench_case_t bench_cases[] = {
+    { "legacy_crc8", bench_legacy_crc8, 1, sizeof(packet_t) },
+    { "crc8_calc", bench_crc8_calc, 1, sizeof(packet_t) },
+    { "create_or_modify_packet", bench_create_or_modify_packet, 1, sizeof(packet_t) },
+    { "shift_bits/unshift_bits", bench_shift_bits, 1, sizeof(packet_t) },
+    { "codec_encode", bench_codec_encode, 1, CODEC_FRAME_SIZE },
+    { "codec_decode", bench_codec_decode, 1, CODEC_FRAME_SIZE },
+    { "replace_bytes_server/client", bench_replace_bytes, 1, DATA_SIZE },
+    { "is_video_file", bench_is_video_file, 1, 0 },
+    { "convert_to_string", bench_convert_to_string, 1, MAX_FILE_NAME_SIZE },
+};
+
+/* Double the iterations until the case runs for the minimum time */
+bench_result_t run_case(bench_case_t *bench_case, double min_seconds)
+{
+    bench_result_t result = { 0, 0, 0, 0 };
+    double elapsed = 0;
+
+    for(long long iterations = 1; ; iterations *= 2)
+    {
+        double start = bench_now();
+        bench_case->run(iterations);
+        elapsed = bench_now() - start;
+        result.iterations = iterations;
+        if(elapsed >= min_seconds || iterations > (1LL << 40))
+            break;
+    }
+
+    result.ns_per_op = elapsed * 1e9 / result.iterations;
+    result.items_per_second = bench_case->items * result.iterations / elapsed;
+    result.bytes_per_second = (double) bench_case->bytes * result.iterations / elapsed;
+    return result;
+}
+
+/* Same fields as the JSON of Google Benchmark, so the usual compare tools read it */
+void write_json(FILE *file, bench_result_t *results, bool *ran, int quantity)
+{
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(file, "{\n  \"context\": {\n    \"date\": \"%s\",\n    \"executable\": \"bench\",\n", date);
+    fprintf(file, "    \"codec_version\": %d,\n    \"frame_size\": %d\n  },\n  \"benchmarks\": [", CODEC_VERSION, CODEC_FRAME_SIZE);
+
+    bool first = true;
+    for(int i = 0; i < quantity; i++)
+    {
+        if(!ran[i])
+            continue;
+        fprintf(file, "%s\n    {\n      \"name\": \"%s\",\n      \"run_type\": \"iteration\",\n", first ? "" : ",", bench_cases[i].name);
+        fprintf(file, "      \"iterations\": %lld,\n      \"real_time\": %.3f,\n      \"cpu_time\": %.3f,\n      \"time_unit\": \"ns\",\n",
+                results[i].iterations, results[i].ns_per_op, results[i].ns_per_op);
+        fprintf(file, "      \"items_per_second\": %.0f,\n      \"bytes_per_second\": %.0f\n    }",
+                results[i].items_per_second, results[i].bytes_per_second);
+        first = false;
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    char *json_name = NULL, *filter = NULL;
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json_name = argv[++i];
+        else if(argv[i][0] != '-' && filter == NULL)
+            filter = argv[i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--json file] [filter]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(bench_data, 0x5A, DATA_SIZE);
+    memcpy(bench_data, "holiday_2023.mkv", 16);
+    bench_data[DATA_SIZE - 1] = 0;
+    create_or_modify_packet(&bench_packet, MAX_DATA_SIZE, 0, DATA, bench_data);
+
+    /* The replacements must give the same frame as the previous framing */
+    codec_encode(&bench_packet, bench_wire);
+    packet_t legacy = bench_packet;
+    legacy.crc8 = legacy_crc8(&legacy);
+    shift_bits(&legacy);
+    if(memcmp(bench_wire, &legacy, sizeof(packet_t)) != 0)
+    {
+        fprintf(stderr, "ERROR: the codec doesn't match the previous framing!\n");
+        return 1;
+    }
+
+    int quantity = sizeof(bench_cases) / sizeof(bench_case_t);
+    bench_result_t results[sizeof(bench_cases) / sizeof(bench_case_t)];
+    bool ran[sizeof(bench_cases) / sizeof(bench_case_t)];
+    double min_seconds = get_env_number(BENCH_MIN_ENV, BENCH_MIN_MS) / 1000.0;
+
+    printf("%-28s %14s %12s %14s %14s\n", "benchmark", "iterations", "ns/op", "items/s", "MB/s");
+    for(int i = 0; i < quantity; i++)
+    {
+        ran[i] = filter == NULL || strstr(bench_cases[i].name, filter) != NULL;
+        if(!ran[i])
+            continue;
+        results[i] = run_case(&bench_cases[i], min_seconds);
+        printf("%-28s %14lld %12.1f %14.0f %14.1f\n", bench_cases[i].name, results[i].iterations, results[i].ns_per_op,
+               results[i].items_per_second, results[i].bytes_per_second / 1e6);
+    }
+
+    if(json_name != NULL)
+    {
+        FILE *file = fopen(json_name, "w");
+        if(file == NULL)
+        {
+            fprintf(stderr, "ERROR: couldn't write %s!\n", json_name);
+            return 1;
+        }
+        write_json(file, results, ran, quantity);
+        fclose(file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include "../lib/connection.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+#include <sys/resource.h>
+
+/* ACK round trip with select against busy polling, between the two ends of a veth pair
+   Usage: busy_poll_bench <interface> <echo interface> [round trips] [budget us]
+*/
+
+/* Echo side of one run */
+typedef struct bench_echo {
+    int socket;
+    long long round_trips;
+} bench_echo_t;
+
+/* Monotonic time in nanoseconds */
+long long bench_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* CPU time of the process, both ends, in microseconds */
+long long bench_cpu_us()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int compare_ns(const void *a, const void *b)
+{
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/* Answer each DATA frame with an ACK of its sequence */
+void *echo_frames(void *arg)
+{
+    bench_echo_t *echo = arg;
+    packet_t buffer, ack;
+    long long answered = 0;
+
+    while(answered < echo->round_trips)
+    {
+        if(listen_for_packet(&buffer, 2, echo->socket) != 0)
+            break;
+        if(buffer.type != DATA) // The socket also sees its own ACKs
+            continue;
+        create_or_modify_packet(&ack, 0, buffer.sequence, ACK, NULL);
+        send_packet(&ack, echo->socket);
+        answered++;
+    }
+
+    return NULL;
+}
+
+/* Send DATA frames one at a time and time each ACK */
+void run_bench(char *device, char *echo_device, long long round_trips, long long budget_us)
+{
+    char budget[32];
+    snprintf(budget, sizeof(budget), "%lld", budget_us);
+    setenv(BUSY_POLL_ENV, budget, 1); // Read by create_socket
+
+    int sock = create_socket(device);
+    int echo_sock = create_socket(echo_device);
+    if(sock < 0 || echo_sock < 0)
+        return;
+
+    long long *rtt = malloc(round_trips * sizeof(long long));
+    bench_echo_t echo = { echo_sock, round_trips };
+    pthread_t thread;
+    pthread_create(&thread, NULL, echo_frames, &echo);
+    nanosleep(&(struct timespec){ 0, 100000000 }, NULL); // The echo is waiting
+
+    uint8_t data[DATA_SIZE];
+    memset(data, 0x5A, DATA_SIZE);
+    data[DATA_SIZE - 1] = 0;
+    packet_t packet, response;
+    long long done = 0, cpu_start = bench_cpu_us(), start = bench_now_ns();
+
+    for(long long i = 0; i < round_trips && rtt != NULL; i++)
+    {
+        uint8_t sequence = i % (MAX_SEQUENCE + 1);
+        create_or_modify_packet(&packet, MAX_DATA_SIZE, sequence, DATA, data);
+
+        long long sent = bench_now_ns();
+        send_packet(&packet, sock);
+        int listen;
+        while((listen = listen_for_packet(&response, 2, sock)) == 0 && (response.type != ACK || response.sequence != sequence));
+        if(listen != 0)
+            break;
+        rtt[done++] = bench_now_ns() - sent;
+    }
+
+    double elapsed = (bench_now_ns() - start) / 1e9;
+    long long cpu = bench_cpu_us() - cpu_start;
+    pthread_join(thread, NULL);
+
+    if(done > 0)
+    {
+        qsort(rtt, done, sizeof(long long), compare_ns);
+        printf("%-22s rtt p50 %7.1f us  p99 %7.1f us  max %8.1f us   cpu %6.1f us/rt (%3.0f%% of %0.2f s)   %lld/%lld\n",
+               budget_us > 0 ? "busy poll" : "select", rtt[done / 2] / 1e3, rtt[done * 99 / 100] / 1e3, rtt[done - 1] / 1e3,
+               (double) cpu / done, 100.0 * cpu / 1e6 / elapsed, elapsed, done, round_trips);
+    }
+
+    free(rtt);
+    close(sock);
+    close(echo_sock);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <interface> <echo interface> [round trips] [budget us]\n", argv[0]);
+        return 1;
+    }
+
+    long long round_trips = argc > 3 ? atoll(argv[3]) : 20000;
+    long long budget_us = argc > 4 ? atoll(argv[4]) : 50;
+
+    run_bench(argv[1], argv[2], round_trips, 0);
+    run_bench(argv[1], argv[2], round_trips, budget_us);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#include "../lib/capture.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+#include <net/if_arp.h>
+
+/* File of the capture, the sockets of every interface share it */
+FILE *capture_file = NULL;
+bool capture_failed = false;
+int capture_ifindex[MAX_SOCKETS];
+long long capture_flushed = 0;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Auxiliary Functions */
+void capture_close();
+void put_u16(uint8_t *buffer, uint16_t value);
+void put_u32(uint8_t *buffer, uint32_t value);
+uint32_t get_u32(const uint8_t *buffer);
+
+
+/* *** Main Functions *** */
+
+/* Open the capture at the first socket, writing the pcap header */
+void capture_open(int socket, int ifindex)
+{
+    char *file_name = getenv(CAPTURE_ENV);
+    if(file_name == NULL || *file_name == '\0' || socket < 0 || socket >= MAX_SOCKETS)
+        return;
+
+    pthread_mutex_lock(&capture_lock);
+    capture_ifindex[socket] = ifindex;
+    if(capture_file == NULL && !capture_failed)
+    {
+        capture_file = fopen(file_name, "wb");
+        if(capture_file == NULL)
+        {
+            fprintf(stderr, "ERROR: couldn't create the capture %s!\n", file_name);
+            capture_failed = true;
+        }
+        else
+        {
+            uint32_t header[6] = { CAPTURE_MAGIC, 2 | (4 << 16), 0, 0, CAPTURE_SNAPLEN, CAPTURE_LINKTYPE };
+            fwrite(header, sizeof(header), 1, capture_file); // In the byte order of the host, like the readers expect
+            atexit(capture_close);
+        }
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* Write a frame with its time, interface and direction */
+void capture_frame(int socket, const uint8_t *wire, size_t length, int direction)
+{
+    if(__atomic_load_n(&capture_file, __ATOMIC_ACQUIRE) == NULL || socket < 0 || socket >= MAX_SOCKETS)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    uint32_t record[4] = { now.tv_sec, now.tv_nsec, length + CAPTURE_HEADER_SIZE, length + CAPTURE_HEADER_SIZE };
+    uint8_t cooked[CAPTURE_HEADER_SIZE] = {0};
+    put_u16(cooked, CAPTURE_PROTOCOL);
+    put_u32(cooked + 4, capture_ifindex[socket]);
+    put_u16(cooked + 8, ARPHRD_ETHER);
+    cooked[10] = direction;
+
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file == NULL) // Closed at the exit
+    {
+        pthread_mutex_unlock(&capture_lock);
+        return;
+    }
+    fwrite(record, sizeof(record), 1, capture_file);
+    fwrite(cooked, sizeof(cooked), 1, capture_file);
+    fwrite(wire, 1, length, capture_file);
+
+    /* A server is stopped by a signal, so the capture can't wait for the exit */
+    long long now_ms = get_time_ms();
+    if(now_ms - capture_flushed >= CAPTURE_FLUSH_MS)
+    {
+        fflush(capture_file);
+        capture_flushed = now_ms;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* Read the frames of a capture, the caller frees them
+   RETURN:
+    - The quantity of frames, -1 if it isn't a capture of Flix
+*/
+long long capture_read(const char *file_name, capture_frame_t **frames)
+{
+    uint32_t header[6], record[4];
+    uint8_t cooked[CAPTURE_HEADER_SIZE];
+    long long quantity = 0, size = 1024;
+
+    *frames = NULL;
+    FILE *file = fopen(file_name, "rb");
+    if(file == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't open the capture %s!\n", file_name);
+        return -1;
+    }
+    if(fread(header, sizeof(header), 1, file) != 1 || header[0] != CAPTURE_MAGIC || header[5] != CAPTURE_LINKTYPE)
+    {
+        fprintf(stderr, "ERROR: %s isn't a capture of Flix!\n", file_name);
+        fclose(file);
+        return -1;
+    }
+
+    *frames = malloc(size * sizeof(capture_frame_t));
+    while(*frames != NULL && fread(record, sizeof(record), 1, file) == 1)
+    {
+        if(record[2] < CAPTURE_HEADER_SIZE || fread(cooked, sizeof(cooked), 1, file) != 1)
+            break;
+
+        size_t length = record[2] - CAPTURE_HEADER_SIZE;
+        if(quantity == size)
+        {
+            capture_frame_t *bigger = realloc(*frames, 2 * size * sizeof(capture_frame_t));
+            if(bigger == NULL)
+                break;
+            *frames = bigger;
+            size *= 2;
+        }
+
+        capture_frame_t *frame = &(*frames)[quantity];
+        frame->time_ns = record[0] * 1000000000LL + record[1];
+        frame->ifindex = get_u32(cooked + 4);
+        frame->direction = cooked[10];
+        frame->length = length < sizeof(frame->wire) ? length : sizeof(frame->wire);
+        if(fread(frame->wire, 1, frame->length, file) != frame->length ||
+           fseek(file, length - frame->length, SEEK_CUR) != 0)
+            break; // The capture ends in the middle of a frame
+        quantity++;
+    }
+
+    fclose(file);
+    return quantity;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Write the frames still in the buffer */
+void capture_close()
+{
+    pthread_mutex_lock(&capture_lock);
+    if(capture_file != NULL)
+        fclose(capture_file);
+    capture_file = NULL;
+    pthread_mutex_unlock(&capture_lock);
+}
+
+/* The cooked header is in network byte order */
+void put_u16(uint8_t *buffer, uint16_t value)
+{
+    buffer[0] = value >> 8;
+    buffer[1] = value;
+}
+
+void put_u32(uint8_t *buffer, uint32_t value)
+{
+    put_u16(buffer, value >> 16);
+    put_u16(buffer + 2, value);
+}
+
+uint32_t get_u32(const uint8_t *buffer)
+{
+    return ((uint32_t) buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+}
@@ -0,0 +1,396 @@
+#include "../lib/catalog.h"
+#include "../lib/command.h"
+#include "../lib/delta.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+
+#define DT_REG 8
+
+/* Version of the catalog with its sorted names */
+typedef struct catalog_version {
+    uint64_t version;
+    char (*names)[DATA_SIZE];
+    int quantity;
+} catalog_version_t;
+
+/* Server: the last versions, the newest first, and the directory they came from */
+catalog_version_t catalog_versions[CATALOG_HISTORY];
+int catalog_version_quantity = 0;
+struct timespec catalog_mtime;
+time_t catalog_scanned = 0;
+
+/* Client: the last listing received */
+catalog_version_t catalog_cached;
+bool catalog_loaded = false;
+
+pthread_mutex_t catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Auxiliary Functions */
+int catalog_refresh(char *directory);
+int catalog_scan(char *directory, char (*names)[DATA_SIZE]);
+int catalog_diff(catalog_version_t *old, catalog_version_t *current, char (*names)[DATA_SIZE], uint8_t *changes);
+int send_catalog_names(char (*names)[DATA_SIZE], uint8_t *changes, int quantity, int socket);
+void load_cached_catalog();
+void save_cached_catalog();
+int compare_catalog_names(const void *a, const void *b);
+
+
+/* *** Main Functions *** */
+
+/* The answer goes in the ACK of the LIST. A client without a version gets the
+   full list in an ACK without data, like before the catalog had versions.
+   RETURN:
+    - 0 if the client received the answer
+    - -1 if an error occurred
+*/
+int catalog_serve(char *directory, packet_t *request, int socket)
+{
+    uint64_t known = 0;
+    bool conditional = request->size == CATALOG_VERSION_SIZE;
+    if(conditional)
+        memcpy(&known, request->data, CATALOG_VERSION_SIZE);
+
+    pthread_mutex_lock(&catalog_lock);
+    if(catalog_refresh(directory) != 0)
+    {
+        pthread_mutex_unlock(&catalog_lock);
+        packet_t *packet = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+        send_packet(packet, socket);
+        create_or_modify_packet(packet, 0, 0, END_TRANSMISSION, NULL);
+        send_packet_stop_wait(packet, packet, TIMEOUT, socket);
+        destroy_packet(packet);
+        return -1;
+    }
+
+    /* The names are copied, the other interfaces list while this one sends */
+    catalog_version_t *current = &catalog_versions[0];
+    int answer = CATALOG_FULL, old = 1, quantity = 0;
+    while(old < catalog_version_quantity && catalog_versions[old].version != known)
+        old++;
+    if(conditional && known == current->version)
+        answer = CATALOG_NOT_MODIFIED;
+    else if(conditional && old < catalog_version_quantity)
+        answer = CATALOG_DELTA;
+
+    uint64_t version = current->version;
+    int size = current->quantity + (answer == CATALOG_DELTA ? catalog_versions[old].quantity : 0);
+    char (*names)[DATA_SIZE] = calloc(size + 1, DATA_SIZE);
+    uint8_t *changes = calloc(size + 1, 1);
+    if(names != NULL && changes != NULL && answer == CATALOG_DELTA)
+        quantity = catalog_diff(&catalog_versions[old], current, names, changes);
+    else if(names != NULL && changes != NULL && answer == CATALOG_FULL)
+    {
+        memcpy(names, current->names, current->quantity * DATA_SIZE);
+        quantity = current->quantity;
+    }
+    pthread_mutex_unlock(&catalog_lock);
+
+    if(names == NULL || changes == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't allocate the catalog!\n");
+        free(names);
+        free(changes);
+        return -1;
+    }
+
+    uint8_t data[DATA_SIZE] = { answer };
+    memcpy(data + 1, &version, CATALOG_VERSION_SIZE);
+    packet_t *packet = create_or_modify_packet(NULL, conditional ? 1 + CATALOG_VERSION_SIZE : 0, 0, ACK, data);
+    send_packet(packet, socket);
+    destroy_packet(packet);
+
+    int result = 0;
+    if(answer != CATALOG_NOT_MODIFIED)
+        result = send_catalog_names(names, changes, quantity, socket);
+
+    free(names);
+    free(changes);
+    return result;
+}
+
+/* Fill a LIST with the version of the cached listing, 0 if there is none */
+void catalog_request(packet_t *p)
+{
+    uint8_t data[DATA_SIZE] = {0};
+
+    pthread_mutex_lock(&catalog_lock);
+    load_cached_catalog();
+    uint64_t version = catalog_cached.version;
+    pthread_mutex_unlock(&catalog_lock);
+
+    memcpy(data, &version, CATALOG_VERSION_SIZE);
+    create_or_modify_packet(p, CATALOG_VERSION_SIZE, 0, LIST, data);
+}
+
+/* Read the answer of the server in the ACK of a LIST
+   RETURN:
+    - CATALOG_FULL, CATALOG_DELTA or CATALOG_NOT_MODIFIED
+    - version is 0 if the server didn't send one
+*/
+int catalog_answer(packet_t *ack, uint64_t *version)
+{
+    *version = 0;
+    if(ack->size != 1 + CATALOG_VERSION_SIZE || ack->data[0] > CATALOG_NOT_MODIFIED)
+        return CATALOG_FULL;
+
+    memcpy(version, ack->data + 1, CATALOG_VERSION_SIZE);
+    return ack->data[0];
+}
+
+/* Copy the cached listing, for a LIST that wasn't modified
+   RETURN:
+    - The quantity of names
+    - -1 if the cache isn't that version anymore
+*/
+int catalog_load(uint64_t version, char (*file_names)[DATA_SIZE], int max_quantity)
+{
+    int quantity = -1;
+
+    pthread_mutex_lock(&catalog_lock);
+    if(catalog_cached.version == version && version != 0)
+    {
+        quantity = catalog_cached.quantity < max_quantity ? catalog_cached.quantity : max_quantity;
+        memcpy(file_names, catalog_cached.names, quantity * DATA_SIZE);
+    }
+    pthread_mutex_unlock(&catalog_lock);
+
+    return quantity;
+}
+
+/* A full list replaces the cached one, a delta is merged into it and must give the
+   version of the server. The changes of a full list aren't read.
+   RETURN:
+    - The quantity of names in file_names
+    - -1 if the delta doesn't fit the cache, which is dropped, and the LIST goes again without a version
+*/
+int catalog_apply(int answer, uint64_t version, char (*file_names)[DATA_SIZE], uint8_t *changes, int quantity, int max_quantity)
+{
+    pthread_mutex_lock(&catalog_lock);
+    load_cached_catalog();
+    if(catalog_cached.names == NULL)
+    {
+        pthread_mutex_unlock(&catalog_lock);
+        return answer == CATALOG_DELTA ? -1 : quantity;
+    }
+
+    if(answer == CATALOG_DELTA)
+    {
+        char (*merged)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+        int total = 0, i = 0;
+        for(int j = 0; merged != NULL && (i < catalog_cached.quantity || j < quantity); )
+        {
+            int order = i == catalog_cached.quantity ? 1 : j == quantity ? -1 : strcmp(catalog_cached.names[i], file_names[j]);
+            bool kept = order < 0 || (order == 0 && changes[j] == CATALOG_ADDED);
+            if(kept && total < MAX_LIST_SIZE)
+                memcpy(merged[total++], catalog_cached.names[i], DATA_SIZE);
+            else if(order > 0 && changes[j] == CATALOG_ADDED && total < MAX_LIST_SIZE)
+                memcpy(merged[total++], file_names[j], DATA_SIZE);
+            i += order <= 0;
+            j += order >= 0;
+        }
+
+        if(merged == NULL || delta_strong_checksum((uint8_t *) merged, total * DATA_SIZE) != version)
+        {
+            print_log("The catalog delta doesn't match the cached listing!");
+            catalog_cached.version = 0;
+            catalog_cached.quantity = 0;
+            save_cached_catalog();
+            pthread_mutex_unlock(&catalog_lock);
+            free(merged);
+            return -1;
+        }
+        memcpy(catalog_cached.names, merged, total * DATA_SIZE);
+        catalog_cached.quantity = total;
+        free(merged);
+    }
+    else
+    {
+        catalog_cached.quantity = quantity < MAX_LIST_SIZE ? quantity : MAX_LIST_SIZE;
+        memcpy(catalog_cached.names, file_names, catalog_cached.quantity * DATA_SIZE);
+    }
+    catalog_cached.version = version;
+    save_cached_catalog();
+
+    quantity = catalog_cached.quantity < max_quantity ? catalog_cached.quantity : max_quantity;
+    memcpy(file_names, catalog_cached.names, quantity * DATA_SIZE);
+    pthread_mutex_unlock(&catalog_lock);
+
+    return quantity;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Read the directory again if it changed since the last scan, keeping a new version
+   when the names are different
+   RETURN:
+    - 0 if catalog_versions[0] is the directory
+    - -1 if the directory can't be read
+*/
+int catalog_refresh(char *directory)
+{
+    struct stat directory_stat;
+    if(stat(directory, &directory_stat) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't read the directory %s!\n", directory);
+        return -1;
+    }
+
+    /* A change after the scan moves the date of the directory */
+    if(catalog_version_quantity > 0 &&
+       directory_stat.st_mtim.tv_sec == catalog_mtime.tv_sec && directory_stat.st_mtim.tv_nsec == catalog_mtime.tv_nsec &&
+       catalog_scanned - catalog_mtime.tv_sec >= CATALOG_RESCAN_S)
+        return 0;
+
+    char (*names)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+    if(names == NULL)
+        return -1;
+    int quantity = catalog_scan(directory, names);
+    if(quantity < 0)
+    {
+        free(names);
+        return -1;
+    }
+    catalog_mtime = directory_stat.st_mtim;
+    catalog_scanned = time(NULL);
+
+    uint64_t version = delta_strong_checksum((uint8_t *) names, quantity * DATA_SIZE);
+    if(catalog_version_quantity > 0 && catalog_versions[0].version == version)
+    {
+        free(names);
+        return 0;
+    }
+
+    if(catalog_version_quantity == CATALOG_HISTORY)
+        free(catalog_versions[--catalog_version_quantity].names);
+    memmove(&catalog_versions[1], &catalog_versions[0], catalog_version_quantity * sizeof(catalog_version_t));
+    catalog_versions[0] = (catalog_version_t) { version, names, quantity };
+    catalog_version_quantity++;
+
+    return 0;
+}
+
+/* Sorted names of the videos in the directory
+   RETURN:
+    - The quantity of names
+    - -1 if the directory can't be opened
+*/
+int catalog_scan(char *directory, char (*names)[DATA_SIZE])
+{
+    DIR *d = opendir(directory);
+    if(d == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't open the directory %s!\n", directory);
+        return -1;
+    }
+
+    struct dirent *dir;
+    int quantity = 0;
+    while((dir = readdir(d)) != NULL && quantity < MAX_LIST_SIZE)
+        if(dir->d_type == DT_REG && is_video_file(dir->d_name) && strlen(dir->d_name) <= MAX_FILE_NAME_SIZE)
+            memcpy(names[quantity++], dir->d_name, strlen(dir->d_name));
+    closedir(d);
+
+    qsort(names, quantity, DATA_SIZE, compare_catalog_names);
+    return quantity;
+}
+
+/* Names added and removed from an old version to the current one, in order
+   RETURN:
+    - The quantity of changes
+*/
+int catalog_diff(catalog_version_t *old, catalog_version_t *current, char (*names)[DATA_SIZE], uint8_t *changes)
+{
+    int quantity = 0, i = 0, j = 0;
+
+    while(i < old->quantity || j < current->quantity)
+    {
+        int order = i == old->quantity ? 1 : j == current->quantity ? -1 : strcmp(old->names[i], current->names[j]);
+        if(order < 0)
+        {
+            memcpy(names[quantity], old->names[i++], DATA_SIZE);
+            changes[quantity++] = CATALOG_REMOVED;
+        }
+        else if(order > 0)
+        {
+            memcpy(names[quantity], current->names[j++], DATA_SIZE);
+            changes[quantity++] = CATALOG_ADDED;
+        }
+        else
+        {
+            i++;
+            j++;
+        }
+    }
+
+    return quantity;
+}
+
+/* Send the names with stop and wait, the change in the sequence, then END_TRANSMISSION */
+int send_catalog_names(char (*names)[DATA_SIZE], uint8_t *changes, int quantity, int socket)
+{
+    packet_t response_packet;
+    packet_t *packet = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+
+    for(int i = 0; i < quantity; i++)
+    {
+        create_or_modify_packet(packet, strlen(names[i]), changes[i], SHOW_IN_SCREEN, names[i]);
+        if(send_packet_stop_wait(packet, &response_packet, TIMEOUT, socket) != 0 || response_packet.type == ERROR)
+        {
+            print_log("Error while sending file list to client!");
+            destroy_packet(packet);
+            return -1;
+        }
+    }
+
+    create_or_modify_packet(packet, 0, 0, END_TRANSMISSION, NULL);
+    send_packet_stop_wait(packet, &response_packet, TIMEOUT, socket);
+    destroy_packet(packet);
+    return 0;
+}
+
+/* Read the listing of CATALOG_FILE once, a missing or damaged file is an empty cache without version */
+void load_cached_catalog()
+{
+    if(catalog_loaded)
+        return;
+    catalog_loaded = true;
+    catalog_cached.names = calloc(MAX_LIST_SIZE, DATA_SIZE);
+    catalog_cached.version = 0;
+    catalog_cached.quantity = 0;
+
+    FILE *file = fopen(CATALOG_FILE, "r");
+    if(file == NULL || catalog_cached.names == NULL)
+    {
+        if(file != NULL)
+            fclose(file);
+        return;
+    }
+
+    unsigned long long version;
+    if(fscanf(file, "%llx", &version) == 1)
+    {
+        while(catalog_cached.quantity < MAX_LIST_SIZE && fscanf(file, "%63s", catalog_cached.names[catalog_cached.quantity]) == 1)
+            catalog_cached.quantity++;
+        if(delta_strong_checksum((uint8_t *) catalog_cached.names, catalog_cached.quantity * DATA_SIZE) == version)
+            catalog_cached.version = version;
+    }
+    fclose(file);
+}
+
+/* Write the listing, the version first, then one name per line */
+void save_cached_catalog()
+{
+    FILE *file = fopen(CATALOG_FILE, "w");
+    if(file == NULL)
+        return;
+
+    fprintf(file, "%llx\n", (unsigned long long) catalog_cached.version);
+    for(int i = 0; i < catalog_cached.quantity; i++)
+        fprintf(file, "%s\n", catalog_cached.names[i]);
+    fclose(file);
+}
+
+int compare_catalog_names(const void *a, const void *b)
+{
+    return strcmp(a, b);
+}
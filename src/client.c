@@ -1,37 +1,47 @@
 #include "../lib/connection.h"
 #include "../lib/command.h"
 #include "../lib/utils.h"
+#include "../lib/stripe.h"
+#include "../lib/multicast.h"
+#include "../lib/video_cache.h"
+#include "../lib/prefetch.h"
+#include "../lib/discovery.h"
+#include "../lib/player.h"
+#include <fnmatch.h>
 
 // Auxiliary functions
 int process_command(char *token, const char delimiter[], int type_flag, int sockfd); // To process what command will execute
 void play_video(const char *file_name); // To play the downloaded video
 void print_commands(); // To print the available commands
 void remove_video(const char *file_name); // To remove the downloaded video after play
+int queue_videos(char *token, const char delimiter[], char (*video_names)[DATA_SIZE], int sockfd); // To expand the names and patterns of download
+int compare_names(const void *a, const void *b); // To sort the videos of a pattern
+void print_catalog(int sockfd); // To show the videos of the server
 
 
-int main()
+int main(int argc, char *argv[])
 {
-  	int sockfd = create_socket("enp1s0f1"); // interface
+    server_info_t server;
     char *token;
-    char input[100]; // buffer for commands
-    char *file_name = NULL;
-    char *error = NULL;
+    char input[1024]; // buffer for commands
     const char delimiter[] = " \n";
-    packet_t buffer; // packet buffer
+
+    video_cache_init(); // Downloads go to the cache directory
     
     system("clear");
     printf("\n\n");
     printFlix();
 
     printf("\nEstabilishing connection...\n");
-    // Verify if the server is online
-    packet_t *packet = create_or_modify_packet(NULL, 0, 0, ONLINE, NULL);
-    if((send_packet_stop_wait(packet, packet, TIMEOUT, sockfd)) != 0)
+    // Look for the server on the interfaces of the command line, or on all of them
+    int sockfd = discover_server(argv + 1, argc - 1, &server);
+    if(sockfd < 0)
     {
         printf("Server is offline, please try again later.\n");
-        destroy_packet(packet);
         return 0;
     }
+    packet_t *packet = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    prefetch_start(sockfd); // Likely next videos come while the client is idle
 
     system("clear");
     printf("\n\n");
@@ -39,28 +49,65 @@ int main()
     printf("\n\n");
     print_commands();
     printf("\n");
+    printf("Server found on %s in %.1f ms (window %d, frames of %d bytes)\n",
+           server.interface, server.elapsed_ms, server.window, server.max_data_size);
 
 
     while (1) 
     {
         printf("\nFLIX => ");
+        fflush(stdout);
+        prefetch_resume();
         fgets(input, sizeof(input), stdin);
+        prefetch_pause(); // The command has the socket alone
 
         token = strtok(input, delimiter);
 
         if(token == NULL) continue;
 
         if(strcmp(token, "list") == 0)
-        {    
-            if((process_command(token, delimiter, LIST, sockfd)) != 0)
-                continue; // In case of error continue
-            buffer.type = LIST; 
-        }    
+        {
+            print_catalog(sockfd);
+            continue;
+        }
         else if(strcmp(token, "download") == 0)
         {
-            if((process_command(token, delimiter, DOWNLOAD,sockfd)) != 0 )
-                continue; // In case of error continue
-            buffer.type = END_TRANSMISSION; // To no enter in the while loop
+            process_command(token, delimiter, DOWNLOAD,sockfd);
+            continue;
+        }
+        else if(strcmp(token, "stripe") == 0) // stripe <name> <interface> [interface ...]
+        {
+            char *stripe_name = strtok(NULL, delimiter);
+            char *interfaces[MAX_STRIPE_PATHS];
+            int quantity = 0;
+            while(quantity < MAX_STRIPE_PATHS && (token = strtok(NULL, delimiter)) != NULL)
+                interfaces[quantity++] = token;
+            if(stripe_name == NULL || quantity == 0)
+                printf("Please, type the name of a video and the interfaces to use.\n");
+            else if(download_striped(stripe_name, interfaces, quantity) == 0)
+                video_cache_add(stripe_name);
+            continue;
+        }
+        else if(strcmp(token, "join") == 0) // Receive with the other clients that want the same video
+        {
+            token = strtok(NULL, delimiter);
+            if(token == NULL)
+                printf("Please, type the name of a video.\n");
+            else if(join_group(token, sockfd) == 0)
+            {
+                video_cache_add(token);
+                play_video(token);
+            }
+            continue;
+        }
+        else if(strcmp(token, "play") == 0)
+        {
+            token = strtok(NULL, delimiter);
+            if(token == NULL || access(token, F_OK) != 0)
+                printf("Please, type the name of a downloaded video to play.\n");
+            else
+                play_video(token);
+            continue;
         }
         else if(strcmp(token, "help") == 0)
         {
@@ -70,6 +117,7 @@ int main()
         else if(strcmp(token, "exit") == 0)
         {
             destroy_packet(packet);
+            print_socket_stats(sockfd);
             printf("Bye, hope you enjoy it!\n");
             sleep(1);
             system("clear");
@@ -93,60 +141,6 @@ int main()
             print_commands();
             continue;
         }
-
-        // Loop for list the packets
-        while(buffer.type != END_TRANSMISSION)
-        {
-
-           listen_for_packet(&buffer, 9999, sockfd);
-            switch(buffer.type)  
-            {
-            case ACK:
-                #ifdef DEBUG
-                print_log("ACK received!");
-                #endif
-                break;
-
-            case NACK:
-                #ifdef DEBUG
-                print_log("NACK received!");
-                #endif
-                break;
-
-            case SHOW_IN_SCREEN:
-                #ifdef DEBUG
-                print_log("SHOW_IN_SCREEN received!");
-                #endif
-                file_name = convert_to_string(buffer.data, buffer.size);
-                printf("%s\n", file_name);
-                create_or_modify_packet(packet, 0, 0, ACK, NULL);
-                send_packet(packet, sockfd);
-                free(file_name);
-                break;
-
-            case ERROR:
-                #ifdef DEBUG
-                print_log("ERROR received!");
-                #endif
-                error = convert_to_string(buffer.data, buffer.size);
-                printf("%s\n", error);
-                create_or_modify_packet(packet, 0, 0, ACK, NULL);
-                send_packet(packet, sockfd);
-                break;
-
-            case END_TRANSMISSION:
-                #ifdef DEBUG
-                print_log("END_OF_TRANSMISSION received!");
-                #endif
-                create_or_modify_packet(packet, 0, 0, ACK, NULL);
-                send_packet(packet, sockfd);
-                break;
-            }
-        }
-        
-        // Reset the buffer
-        buffer.start_marker = 0;
-        buffer.type = 0;
     }
 
     close(sockfd);
@@ -160,40 +154,93 @@ int process_command(char *token, const char delimiter[], int type_flag, int sock
     packet_t *packet = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
 
 
-    if(type_flag == LIST)
+    if(type_flag == DOWNLOAD)
     {
-        create_or_modify_packet(packet, 0, 0, LIST, NULL);
-        if((send_packet_stop_wait(packet, packet, TIMEOUT, sockfd)) != 0)
+        char (*video_names)[DATA_SIZE] = calloc(MAX_DOWNLOAD_QUEUE, DATA_SIZE);
+        int quantity = queue_videos(token, delimiter, video_names, sockfd);
+        destroy_packet(packet);
+        if(quantity <= 0)
         {
-            printf("Error while sending list packet!\n");
-            destroy_packet(packet);
+            printf("Please, type the command again with the name of a video to download.\n");
+            free(video_names);
             return -1;
         }
-        destroy_packet(packet);
-        printf("Available videos to watch:\n");
+
+        if(quantity == 1)
+        {
+            printf("Downloading: %s\n", video_names[0]);
+            player_arm(video_names[0]); // It starts once the index and the first media bytes are on disk
+            if((download_video(video_names[0], sockfd)) != 0)
+            {
+                player_cancel();
+                free(video_names);
+                return -1;
+            }
+            printf("--> Playing video\n");
+            // system("clear");
+            play_video(video_names[0]);
+            // remove_video(token);
+        }
+        else // Many videos are downloaded back to back, without playing
+        {
+            int downloaded = download_videos(video_names, quantity, sockfd);
+            printf("%d of %d videos downloaded, use play <name> to watch.\n", downloaded, quantity);
+        }
+        free(video_names);
     }
-    else if(type_flag == DOWNLOAD)
+    return 0;
+}
+
+/* Put in video_names the names of the command, patterns like ep*.mp4 are matched with the server list */
+int queue_videos(char *token, const char delimiter[], char (*video_names)[DATA_SIZE], int sockfd)
+{
+    char (*server_videos)[DATA_SIZE] = NULL;
+    int quantity = 0, server_quantity = -1;
+
+    while((token = strtok(NULL, delimiter)) != NULL && quantity < MAX_DOWNLOAD_QUEUE)
     {
-        token = strtok(NULL, delimiter);
-        if(token == NULL)
+        if(strpbrk(token, "*?[") == NULL)
         {
-            printf("Please, type the command again with the name of a video to download.\n");
-            return -1;
+            strncpy(video_names[quantity++], token, MAX_FILE_NAME_SIZE);
+            continue;
         }
-        char video_name[DATA_SIZE];
-        memset(video_name, 0, DATA_SIZE);
-        strncpy(video_name, token, DATA_SIZE);
-        printf("Downloading: %s\n", token);
-        if((download_video(video_name, sockfd)) != 0)
-            return -1;
-        destroy_packet(packet);
-        printf("--> Playing video\n");
-        // system("clear");
-        play_video(video_name);
-        // remove_video(token);
-        
+
+        if(server_quantity < 0) // Ask for the list only once
+        {
+            server_videos = calloc(MAX_LIST_SIZE, DATA_SIZE);
+            server_quantity = list_remote_videos(server_videos, MAX_LIST_SIZE, sockfd);
+            qsort(server_videos, server_quantity > 0 ? server_quantity : 0, DATA_SIZE, compare_names);
+        }
+
+        for(int i = 0; i < server_quantity && quantity < MAX_DOWNLOAD_QUEUE; i++)
+            if(fnmatch(token, server_videos[i], 0) == 0)
+                memcpy(video_names[quantity++], server_videos[i], DATA_SIZE);
     }
-    return 0;
+
+    free(server_videos);
+    return quantity;
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp((const char *) a, (const char *) b);
+}
+
+/* Print the videos of the server, the cached listing when it didn't change */
+void print_catalog(int sockfd)
+{
+    char (*video_names)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+    int quantity = video_names != NULL ? list_remote_videos(video_names, MAX_LIST_SIZE, sockfd) : -1;
+
+    if(quantity < 0)
+        printf("Error while sending list packet!\n");
+    else
+    {
+        printf("Available videos to watch:\n");
+        for(int i = 0; i < quantity; i++)
+            printf("%s\n", video_names[i]);
+    }
+    free(video_names);
 }
 
 void print_commands()
@@ -201,36 +248,27 @@ void print_commands()
     printf("Available commands:\n");
     printf("- list : Show a list of the available videos.\n");
     printf("- download <name> : Download and play the selected video.\n");
+    printf("- download <name|pattern> ... : Download many videos back to back, like ep*.mp4\n");
+    printf("- stripe <name> <interface> ... : Download a video over many interfaces at once.\n");
+    printf("- join <name> : Download and play a video sent once to every client that asks for it.\n");
+    printf("- play <name> : Play a downloaded video.\n");
     printf("- help: Show this message\n");
     printf("- exit: Exit the program.\n");
 }
 
 void play_video(const char *file_name)
 {
-    char command[256];
-    
-    snprintf(command, sizeof(command), "mplayer %s > /dev/null 2>&1", file_name);
+    video_cache_played(file_name); // The last one to be evicted
+    prefetch_watched(file_name);
     
-    int result = system(command);
-    
-    if (result == -1) {
-        fprintf(stderr,"Error trying to execute the video");
-    } else {
-        return;
-    }
+    video_cache_pin(file_name); // The prefetch can't evict it while it plays
+    prefetch_resume(); // The next video comes while this one plays
+    player_play(file_name); // The player of the download may be running already
+    prefetch_pause();
+    video_cache_pin(NULL);
 }
 
 void remove_video(const char *file_name)
 {
-    char command[256];
-    
-    snprintf(command, sizeof(command), "rm -f %s", file_name);
-    
-    int result = system(command);
-    
-    if (result == -1) {
-        fprintf(stderr, "Error trying to remove the video");
-    } else {
-        return;
-    }
+    video_cache_remove(file_name); // The cache index forgets it too
 }
\ No newline at end of file
@@ -1,10 +1,43 @@
 #include "../lib/utils.h"
 #include "../lib/command.h"
+#include "../lib/delta.h"
+#include "../lib/frame_cache.h"
+#include "../lib/pipeline.h"
+#include "../lib/flow.h"
+#include "../lib/pacing.h"
+#include "../lib/video_cache.h"
+#include "../lib/prefetch.h"
+#include "../lib/media.h"
+#include "../lib/catalog.h"
+#include "../lib/compress.h"
+#include "../lib/latency.h"
+#include "../lib/framing.h"
+#include "../lib/player.h"
 
-#define DT_REG 8
 
-/* Verify if the file have a video extension */
-int is_video_file(const char *filename);
+/* Send the bytes of an open file, or its cached frames, with sliding window */
+int send_file_window(FILE *file, size_t file_size, char *file_name, packet_t *p, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, char *next_file_name, int socket);
+
+/* Sliding window of send_file_window in one thread */
+int send_window(FILE *file, size_t file_size, char *file_name, packet_t *p, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, int socket);
+
+/* Receive the signatures of the client and build the delta for the file */
+FILE *create_delta(char *file_name, packet_t *p, int socket);
+
+/* Send the signatures of the local copy and rebuild the file from the delta */
+int download_delta(char *file_name, char *base_name, packet_t *p, int socket, size_t file_size, char *next_file_name);
+
+/* Ask for the stream compressed and write it in the file */
+int download_compressed(char *file_name, packet_t *p, int socket, size_t file_size, media_layout_t *layout, int level, char *next_file_name);
+
+/* Download one video of a queue */
+int fetch_video(char *file_name, char *next_file_name, bool *requested, int socket);
+
+/* Wait the answer for a DOWNLOAD that went in the ACK of END_TRANSMISSION */
+int wait_queued_request(packet_t *p, char *file_name, int socket);
+
+/* Send the ACK of END_TRANSMISSION, with the next video of the queue if there is one */
+void acknowledge_end(packet_t *response, char *next_file_name, int socket);
 
 /* Verify if the file have a video extension */
 int is_video_file(const char *filename)
@@ -23,54 +56,95 @@ int is_video_file(const char *filename)
     return 0;
 }
 
-/* List the videos in a directory and return for the client */
-int list_video_files_in_directory(char *directory, int socket)
+/* Ask the server for the list of videos, keeping the names. The LIST carries the version
+   of the cached listing, so the server only sends what changed, or nothing.
+   RETURN:
+    - The quantity of names received
+    - -1 if an error occurred
+*/
+int list_remote_videos(char (*file_names)[DATA_SIZE], int max_quantity, int socket)
 {
-    DIR *d;
-    struct dirent *dir;
-    d = opendir(directory);
-    if (d == NULL) 
+    packet_t *packet = create_or_modify_packet(NULL, 0, 0, LIST, NULL);
+    catalog_request(packet);
+    if(send_packet_stop_wait(packet, packet, TIMEOUT, socket) != 0)
     {
-        fprintf(stderr,"opendir");
+        destroy_packet(packet);
         return -1;
     }
 
-    char file_list[DATA_SIZE];
-    memset(file_list, 0, DATA_SIZE);
-    packet_t response_packet;
-    packet_t *packet= create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    uint64_t version;
+    int answer = catalog_answer(packet, &version);
+    if(answer == CATALOG_NOT_MODIFIED)
+    {
+        destroy_packet(packet);
+        int quantity = catalog_load(version, file_names, max_quantity);
+        return quantity >= 0 ? quantity : list_remote_videos(file_names, max_quantity, socket);
+    }
+
+    /* The whole list is kept for the cache, even if the caller wants less */
+    char (*names)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+    uint8_t *changes = calloc(MAX_LIST_SIZE, 1);
+    packet_t buffer;
+    int quantity = 0, listen, try = 0;
 
-    while ((dir = readdir(d)) != NULL) 
+    while(names != NULL && changes != NULL)
     {
-        if (dir->d_type == DT_REG && is_video_file(dir->d_name))
+        listen = listen_for_packet(&buffer, TIMEOUT, socket);
+        if(listen != 0)
+        {
+            try++;
+            if(try > MAX_TRY)
+                break;
+            continue;
+        }
+        try = 0;
+
+        if(buffer.type == SHOW_IN_SCREEN)
         {
-            size_t name_len = strlen(dir->d_name); 
-            if (name_len <= MAX_FILE_NAME_SIZE)  
+            char name[DATA_SIZE] = {0};
+            memcpy(name, buffer.data, buffer.size);
+            // The name is sent again when the ACK is lost
+            if(quantity < MAX_LIST_SIZE && (quantity == 0 || strcmp(names[quantity - 1], name) != 0))
             {
-                memcpy(file_list, dir->d_name, name_len);
-                create_or_modify_packet(packet, name_len, 0, SHOW_IN_SCREEN, file_list);
-                send_packet_stop_wait(packet, &response_packet, TIMEOUT, socket);
-                if(response_packet.type == ERROR)
-                {
-                    print_log("Error while sending file list to client!");
-                    destroy_packet(packet);
-                    return -1;
-                }
-                 memset(file_list, 0, MAX_FILE_NAME_SIZE);
+                changes[quantity] = buffer.sequence;
+                memcpy(names[quantity++], name, DATA_SIZE);
             }
+            create_or_modify_packet(packet, 0, 0, ACK, NULL);
+            send_packet(packet, socket);
+        }
+        else if(buffer.type == END_TRANSMISSION)
+        {
+            create_or_modify_packet(packet, 0, 0, ACK, NULL);
+            send_packet(packet, socket);
+            break;
         }
     }
-    closedir(d);
-
-    create_or_modify_packet(packet, 0, 0, END_TRANSMISSION, NULL);
-    send_packet_stop_wait(packet, &response_packet, TIMEOUT, socket);
     destroy_packet(packet);
-    return 0;
+
+    if(names == NULL || changes == NULL || try > MAX_TRY)
+    {
+        free(names);
+        free(changes);
+        return -1;
+    }
+
+    quantity = catalog_apply(answer, version, names, changes, quantity, MAX_LIST_SIZE);
+    if(quantity > max_quantity)
+        quantity = max_quantity;
+    if(quantity >= 0)
+        memcpy(file_names, names, quantity * DATA_SIZE);
+    free(names);
+    free(changes);
+
+    /* A delta that doesn't fit the cache dropped it, the next LIST is a full one */
+    return quantity >= 0 ? quantity : list_remote_videos(file_names, max_quantity, socket);
 }
 
 /* Send a video file with sliding window */
-int send_video(char *file_name, int socket)
+int send_video(char *file_name, int socket, char *next_file_name)
 {
+    next_file_name[0] = '\0';
+
     if(file_name == NULL)
     {
         fprintf(stderr, "Path is NULL!");
@@ -89,8 +163,16 @@ int send_video(char *file_name, int socket)
     uint8_t data_buffer[DATA_SIZE] = {0};
     size_t file_size = get_file_size(file_name);
     memcpy(data_buffer, &file_size, sizeof(file_size));
+
+    /* The index of the container goes first, the client writes each byte at its offset */
+    media_layout_t layout;
+    media_layout(file_name, &layout);
+    media_pack_layout(data_buffer, &layout);
+    data_buffer[COMPRESS_OFFSET] = COMPRESS_VERSION;
+    frames_offer(data_buffer);
     
-    struct tm *time_info = get_file_date(file_name);
+    struct tm date;
+    struct tm *time_info = get_file_date(file_name, &date);
     snprintf((char*)(data_buffer+43), 20, "%04u-%02u-%02u %02u:%02u:%02u", 
             time_info->tm_year + 1900, time_info->tm_mon + 1, time_info->tm_mday,
             time_info->tm_hour, time_info->tm_min, time_info->tm_sec);
@@ -115,141 +197,470 @@ int send_video(char *file_name, int socket)
         return ERROR;
     }
 
+    /* The frames of the transfer adapt their size if the client takes them */
+    frames_start(socket, frames_negotiate(p));
+
+    /* The client has an old copy and asked only for the changed blocks */
+    if(p->size > 0 && p->data[0] == DELTA_REQUEST)
+    {
+        fclose(file);
+        file = create_delta(file_name, p, socket);
+        if(file == NULL)
+        {
+            frames_stop(socket);
+            destroy_packet(p);
+            return ERR_DELTA;
+        }
+        file_size = ftell(file);
+        rewind(file);
+        printf("Sending delta of %zu bytes\n", file_size);
+        return send_file_window(file, file_size, file_name, p, NULL, NULL, NULL, next_file_name, socket);
+    }
+
+    /* The client asked for the stream compressed, with the level in the second byte */
+    if(p->size > 1 && p->data[0] == COMPRESS_REQUEST)
+    {
+        compress_reader_t compress;
+        if(compress_reader_open(&compress, file, file_size, &layout, p->data[1]) != 0)
+        {
+            fclose(file);
+            frames_stop(socket);
+            create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "COMPRESSION FAILED!");
+            send_packet_stop_wait(p, p, TIMEOUT, socket);
+            destroy_packet(p);
+            return ERR_COMPRESS;
+        }
+        int result = send_file_window(file, file_size, file_name, p, NULL, NULL, &compress, next_file_name, socket);
+        printf("Sent %zu of %zu bytes compressed (ratio %.2f, %d of %d blocks as they are)\n",
+               compress.stats.compressed, compress.stats.original,
+               compress.stats.compressed ? (double) compress.stats.original / compress.stats.compressed : 1.0,
+               compress.stats.skipped, compress.stats.blocks);
+        compress_reader_close(&compress);
+        return result;
+    }
+
+    /* Hot videos are sent from the frames already packetized, in the file order */
+    cached_video_t cached;
+    if(layout.quantity == 0 && frame_cache_get(file_name, &cached) == 0)
+    {
+        int result = send_file_window(file, file_size, file_name, p, &cached, NULL, NULL, next_file_name, socket);
+        frame_cache_release(&cached);
+        return result;
+    }
+
+    return send_file_window(file, file_size, file_name, p, NULL, &layout, NULL, next_file_name, socket);
+}
+
+/* Send the bytes of an open file with sliding window and finish with END_TRANSMISSION.
+   If cached isn't NULL the frames come from the send cache instead of the file,
+   otherwise the bytes are read in the order of layout (NULL is the file order),
+   compressed block by block if compress isn't NULL.
+   The client may ask for its next video in the ACK of END_TRANSMISSION, it goes in next_file_name. */
+int send_file_window(FILE *file, size_t file_size, char *file_name, packet_t *p, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, char *next_file_name, int socket)
+{
     struct packet p_buffer;
-    bool inRange;
+    int result;
+
+    if(get_env_number(PIPELINE_ENV, 1))
+        result = pipeline_send(file, file_size, file_name, cached, layout, compress, socket);
+    else
+        result = send_window(file, file_size, file_name, p, cached, layout, compress, socket);
+
+    printf("\n");
+    fclose(file);
+    latency_report(socket, file_name);
+    frames_stop(socket);
+
+    if(result != 0)
+    {
+        if(result == ERR_ABORTED)
+            print_log("Transfer aborted by the client");
+        if(result == ERR_COMPRESS) // The client would wait the rest of the stream
+        {
+            create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "COMPRESSION FAILED!");
+            send_packet_stop_wait(p, p, TIMEOUT, socket);
+        }
+        destroy_packet(p);
+        return result;
+    }
+
+    /* Send end transmission packet. */
+    create_or_modify_packet(p, 0, 0, END_TRANSMISSION, NULL);
+    if (send_packet_stop_wait(p, &p_buffer, TIMEOUT, socket) != 0)
+    {
+        destroy_packet(p);
+        return -1;
+    }
+
+    print_log("File sent successfully!");
+
+    if(p_buffer.type == ACK && p_buffer.size > 0) // Next video of the client queue
+    {
+        memcpy(next_file_name, p_buffer.data, p_buffer.size);
+        next_file_name[p_buffer.size] = '\0';
+    }
+
+    destroy_packet(p);
+
+    return 0;
+}
+
+/* Send the frames in the calling thread, alternating the window and the ACKs
+   RETURN:
+    0 if every frame was acknowledged
+    ERR_TIMEOUT_EXPIRED if the client stopped answering
+    ERR_ABORTED if the client gave up the transfer
+    ERR_COMPRESS if the file couldn't be read to compress it
+    ERR_FILE if the file couldn't be read past the frames cached
+*/
+int send_window(FILE *file, size_t file_size, char *file_name, packet_t *p, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, int socket)
+{
+    uint8_t data_buffer[DATA_SIZE] = {0};
     size_t file_read_bytes;
-    long long packets_quantity = ceil((double) file_size / (double)(MAX_DATA_SIZE));
-    long long int next_seq = 0, base = 0;
+    long long packets_quantity = ceil((double) file_size / (double)(MAX_DATA_SIZE)); // Of the cache, the size of the others adapts
+    long long int next_seq = 0, base = 0, acked, position = 0;
+    bool read_all = cached != NULL ? packets_quantity == 0 : (compress != NULL ? compress_ended(compress) : file_size == 0);
     int listen, try = 0;
+    int advertised = WINDOW_SIZE; // Frames the receiver can take
+    long long probe_ms = WINDOW_PROBE_MS;
+    pacer_t pacer;
+    pacer_init(&pacer, socket);
 
     struct packet **window = (struct packet **) malloc(WINDOW_SIZE * sizeof(struct packet *));
     memset(window,0, WINDOW_SIZE * sizeof(struct packet*));
 
-    int window_start = base % WINDOW_SIZE;
-    int window_end = (base + WINDOW_SIZE - 1) % WINDOW_SIZE;
-
     while(1)
     {
-        while(next_seq < base + WINDOW_SIZE && next_seq < packets_quantity)
+        while(next_seq < base + advertised && !read_all)
         {
-            file_read_bytes = fread(data_buffer, 1, MAX_DATA_SIZE, file);
+            if(cached != NULL)
+            {
+                window[next_seq % WINDOW_SIZE] = frame_cache_packet(cached, next_seq, next_seq % (MAX_SEQUENCE + 1));
+                if(window[next_seq % WINDOW_SIZE] == NULL) // The cache is shorter than the file, the rest is read from it
+                {
+                    cached = NULL;
+                    if(fseek(file, position, SEEK_SET) != 0)
+                    {
+                        for(int i = 0; i < WINDOW_SIZE; i++)
+                            free(window[i]);
+                        free(window);
+                        return ERR_FILE;
+                    }
+                    continue;
+                }
+                pacer_send(&pacer, window[next_seq % WINDOW_SIZE]);
+                position += window[next_seq % WINDOW_SIZE]->size;
+                next_seq++;
+                read_all = next_seq == packets_quantity;
+                continue;
+            }
+
+            size_t remaining = file_size - position, size = frames_size(socket); // The file may be a range
+            if(compress != NULL)
+                file_read_bytes = compress_read(compress, data_buffer, size);
+            else
+                file_read_bytes = media_read(file, layout, position, data_buffer, remaining < size ? remaining : size);
+            if(compress != NULL && file_read_bytes == 0) // The file couldn't be read
+            {
+                for(int i = 0; i < WINDOW_SIZE; i++)
+                    free(window[i]);
+                free(window);
+                return ERR_COMPRESS;
+            }
             replace_bytes_server(data_buffer, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
             replace_bytes_server(data_buffer, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
             long long int seq = next_seq % (MAX_SEQUENCE + 1);
             int index = next_seq % WINDOW_SIZE;
             window[index] = create_or_modify_packet(NULL, file_read_bytes, seq , DATA, data_buffer);
-            send_packet(window[index], socket);
+            pacer_send(&pacer, window[index]);
+            frames_sent(socket, 1);
+            position += compress != NULL ? file_read_bytes : (remaining < size ? remaining : size);
+            read_all = compress != NULL ? compress_ended(compress) : position >= (long long) file_size;
             next_seq++;
             memset(data_buffer, 0, DATA_SIZE);
         }
 
-        listen = listen_for_packet(p, TIMEOUT, socket) ;
+        bool zero_window = advertised == 0 && next_seq == base; // Nothing in flight to bring an ACK
+        listen = listen_for_packet_ms(p, zero_window ? probe_ms : TIMEOUT * 1000, socket);
 
         if(listen != 0)
         {
             try++;
             if(try > MAX_TRY)
+            {
+                for(int i = 0; i < WINDOW_SIZE; i++)
+                    free(window[i]);
+                free(window);
                 return ERR_TIMEOUT_EXPIRED;
+            }
         }
         if(listen == 0)
         {
             try = 0;
             if(p->type == ACK)
             { 
-                if(window_start <= window_end)  
-                    inRange = ((p->sequence % WINDOW_SIZE) >= window_start) && ((p->sequence % WINDOW_SIZE) <= (window_end));
-                else
-                    inRange = ((p->sequence % WINDOW_SIZE) >= window_start) || ((p->sequence % WINDOW_SIZE) <= (window_end));
+                advertised = flow_ack_window(p);
+                probe_ms = WINDOW_PROBE_MS;
 
-                if(inRange)
+                /* The ACK is cumulative, a repeated one only updates the window */
+                acked = base + (p->sequence - base % (MAX_SEQUENCE + 1) + MAX_SEQUENCE + 1) % (MAX_SEQUENCE + 1);
+                while(acked < next_seq && base <= acked)
                 {
-                    while((base % (MAX_SEQUENCE + 1)) != p->sequence)
-                    {
-                        free(window[base % WINDOW_SIZE]);
-                        base++;
-                    }
                     free(window[base % WINDOW_SIZE]);
+                    window[base % WINDOW_SIZE] = NULL;
                     base++;
-                    window_start = base % WINDOW_SIZE;
-                    window_end = (base + WINDOW_SIZE - 1) % WINDOW_SIZE;
-                }   
+                }
             }
             else if(p->type == NACK)
             {
                 printf("Resend window\n");
+                frames_lost(socket);
+                for(int i = 0; i < WINDOW_SIZE; i++)
+                    if(window[i] != NULL)
+                    {
+                        pacer_send(&pacer, window[i]);
+                        frames_sent(socket, 1);
+                    }
+            }
+            else if(p->type == ERROR) // The client gave up
+            {
                 for(int i = 0; i < WINDOW_SIZE; i++)
-                    send_packet(window[i], socket);   
+                    free(window[i]);
+                free(window);
+                return ERR_ABORTED;
             }
         }      
+        else if(listen == ERR_TIMEOUT_EXPIRED && zero_window) // Probe with one frame
+        {
+            advertised = 1;
+            probe_ms = probe_ms * 2 < TIMEOUT * 1000 ? probe_ms * 2 : TIMEOUT * 1000;
+        }
         else if(listen == ERR_TIMEOUT_EXPIRED)
         {
             printf("Resend window\n");
+            frames_lost(socket);
             for(int i = 0; i < WINDOW_SIZE; i++)
-                send_packet(window[i], socket);
+                if(window[i] != NULL)
+                {
+                    pacer_send(&pacer, window[i]);
+                    frames_sent(socket, 1);
+                }
         }
 
         printf("\r%s: ", file_name);
         fflush(stdout);
-        print_progress(file_size, next_seq, sizeof(data_buffer));
+        print_progress(file_size, compress != NULL ? (size_t) compress->position : (size_t) position, 1);
         
-        if(base == packets_quantity)
+        if(base == next_seq && read_all)
         {
             free(window);
             break;
         }
 
     }
-    printf("\n");
-    fclose(file);
 
-    /* Send end transmission packet. */
-    create_or_modify_packet(p, 0, 0, END_TRANSMISSION, NULL);
-    if (send_packet_stop_wait(p, &p_buffer, TIMEOUT, socket) != 0)
+    return 0;
+}
+
+/* Send a byte range of a video, for striped downloads. The ACK of the request
+   was already sent with the size of the file. */
+int send_video_range(char *file_name, long long offset, long long length, int socket)
+{
+    char next_file_name[DATA_SIZE];
+    FILE *file = fopen(file_name, "rb");
+
+    if(file == NULL || fseek(file, offset, SEEK_SET) != 0)
     {
-        destroy_packet(p);
-        return -1;
+        fprintf(stderr, "Could not open file!");
+        if(file != NULL)
+            fclose(file);
+        return ERR_FILE;
     }
 
-    print_log("File sent successfully!");
+    packet_t *p = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    return send_file_window(file, length, file_name, p, NULL, NULL, NULL, next_file_name, socket);
+}
 
-    destroy_packet(p);
+/* Receive the signatures of the old copy from the client and write the delta in a temporary file
+   RETURN:
+    - The delta file, at its end
+    - NULL if an error occurred
+*/
+FILE *create_delta(char *file_name, packet_t *p, int socket)
+{
+    uint32_t block_size, count;
+    memcpy(&block_size, p->data + 1, sizeof(uint32_t));
+    memcpy(&count, p->data + 5, sizeof(uint32_t));
 
-    return 0;
+    if(block_size < DELTA_MIN_BLOCK || block_size > DELTA_MAX_BLOCK)
+    {
+        fprintf(stderr, "ERROR: invalid signatures for delta!\n");
+        create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "INVALID DELTA!");
+        send_packet(p, socket);
+        return NULL;
+    }
+
+    /* count comes from the wire and describes the old copy, not the file. Past the limit
+       the signatures are only acknowledged and the delta has the whole file. */
+    if(count > DELTA_MAX_SIGNATURES)
+    {
+        printf("%u signatures of %s are too many, sending the whole file\n", count, file_name);
+        count = 0;
+    }
+
+    block_signature_t *signatures = calloc((size_t) count + 1, sizeof(block_signature_t));
+    if(signatures == NULL)
+    {
+        fprintf(stderr, "ERROR: memory allocation failed!\n");
+        return NULL;
+    }
+
+    packet_t *response = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    size_t received = 0;
+    int expected_seq = 0, listen, try = 0;
+
+    while(1)
+    {
+        listen = listen_for_packet(p, TIMEOUT, socket);
+        if(listen != 0)
+        {
+            try++;
+            if(try > MAX_TRY)
+            {
+                free(signatures);
+                destroy_packet(response);
+                return NULL;
+            }
+            continue;
+        }
+        try = 0;
+
+        if(p->type == SIGNATURE)
+        {
+            if(p->sequence == expected_seq) // Repeated packets are only acknowledged
+            {
+                size_t quantity = p->size / SIGNATURE_SIZE;
+                if(quantity > count - received)
+                    quantity = count - received;
+                delta_unpack_signatures(p->data, signatures + received, quantity);
+                received += quantity;
+                expected_seq = (expected_seq + 1) % (MAX_SEQUENCE + 1);
+            }
+            create_or_modify_packet(response, 0, p->sequence, ACK, NULL);
+            send_packet(response, socket);
+        }
+        else if(p->type == END_TRANSMISSION)
+        {
+            create_or_modify_packet(response, 0, 0, ACK, NULL);
+            send_packet(response, socket);
+            break;
+        }
+    }
+    destroy_packet(response);
+
+    FILE *delta = tmpfile();
+    if(delta == NULL || delta_generate(file_name, signatures, received, block_size, delta) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't create the delta!\n");
+        if(delta)
+            fclose(delta);
+        free(signatures);
+        return NULL;
+    }
+
+    free(signatures);
+    return delta;
 }
 
 /* Receive a video */
-int receive_video(char *file_name, int socket, size_t file_size)
+int receive_video(char *file_name, int socket, size_t file_size, media_layout_t *layout, char *next_file_name)
 {
-    FILE *file = fopen(file_name, "wb");
-    if (file == NULL)
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
     {
         fprintf(stderr,"Error opening the file");
         return -1;
     }
 
+    int result = receive_stream(fd, 0, file_name, file_size, layout, NULL, next_file_name, socket);
+    close(fd);
+
+    if(result == 0)
+        printf("%s downloaded!\n", file_name);
+
+    return result;
+}
+
+/* Receive the DATA frames of a transfer, writing them in fd from offset.
+   Frames are gathered in a buffer and written with pwrite by a writer thread, so ranges
+   of the same file can be received at the same time. Each ACK advertises the frames
+   the receiver can take while the disk is behind. label NULL hides the progress.
+   With a layout, offset counts the bytes of the stream and they go to their place in the file.
+   RETURN:
+    0 if END_TRANSMISSION was received
+    ERR_TIMEOUT_EXPIRED if the server stopped sending
+    ERR_ABORTED if the server gave up the transfer with an ERROR
+    -1 if the file couldn't be written
+*/
+int receive_stream(int fd, off_t offset, char *label, size_t file_size, media_layout_t *layout, decompress_writer_t *decompress, char *next_file_name, int socket)
+{
+    uint8_t *write_buffer = malloc(RECEIVE_BUFFER_SIZE);
+    uint8_t ack_data[DATA_SIZE] = {0}; // Advertised window
     packet_t *packet_buffer = create_or_modify_packet(NULL,0,0,ACK,NULL);
     packet_t *response = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
     long long int packets_received = 0;
-    int expected_seq = 0, seq = 0, listen, try = 0;
-    
+    size_t buffered = 0, received_bytes = 0;
+    int expected_seq = 0, seq = 0, listen, try = 0, result = 0;
+    bool window_closed = false;
+    flow_writer_t writer;
+
+    if(write_buffer == NULL || flow_writer_start(&writer, fd, layout, decompress) != 0)
+    {
+        fprintf(stderr, "ERROR: memory allocation failed!\n");
+        free(write_buffer);
+        destroy_packet(packet_buffer);
+        destroy_packet(response);
+        return -1;
+    }
+
     while (1)  
     {   
         
-        /* Show download progress bar */
-        printf("\r%s: ", file_name);
-        print_progress(file_size, packets_received, sizeof(packet_buffer->data));
-        fflush(stdout);
+        /* Show download progress bar, the player may start on the part already written */
+        if(label != NULL)
+        {
+            player_progress(label, decompress != NULL ? decompress->layout : layout, file_size, flow_written(&writer));
+            printf("\r%s: ", label);
+            print_progress(file_size, decompress != NULL ? flow_written(&writer) : received_bytes, 1); // A compressed stream counts the bytes of the video
+            fflush(stdout);
+        }
 
         /* Listen for packets */
         memset(packet_buffer, 0, sizeof(packet_t));
-        listen = listen_for_packet(packet_buffer, TIMEOUT, socket);
+        listen = listen_for_packet_ms(packet_buffer, window_closed ? WINDOW_UPDATE_MS : TIMEOUT * 1000, socket);
+
+        if (listen != 0 && window_closed) // The sender waits for the window to open
+        {
+            ack_data[0] = flow_window(&writer, buffered);
+            if(ack_data[0] > 0)
+            {
+                create_or_modify_packet(response, 1, (packets_received - 1) % (MAX_SEQUENCE + 1), ACK, ack_data);
+                send_packet(response, socket);
+                window_closed = false;
+            }
+            continue;
+        }
 
         if (listen != 0) 
         {
             try++;
             if(try > MAX_TRY) // Try until MAX_TRY
-                return ERR_TIMEOUT_EXPIRED;
-            printf("Waiting server...\n");
+            {
+                result = ERR_TIMEOUT_EXPIRED;
+                break;
+            }
+            if(label != NULL)
+                printf("Waiting server...\n");
             continue;
         }
 
@@ -257,6 +668,16 @@ int receive_video(char *file_name, int socket, size_t file_size)
         {
             break;
         }
+        else if (packet_buffer->type == ERROR) // The server couldn't go on
+        {
+            char *error_msg = convert_to_string(packet_buffer->data, packet_buffer->size);
+            fprintf(stderr, "ERROR: %s\n", error_msg);
+            free(error_msg);
+            create_or_modify_packet(response, 0, 0, ACK, NULL);
+            send_packet(response, socket);
+            result = ERR_ABORTED;
+            break;
+        }
         else if (packet_buffer->type == DATA) // Packets
         {
             try = 0;
@@ -266,35 +687,126 @@ int receive_video(char *file_name, int socket, size_t file_size)
             expected_seq = packets_received % (MAX_SEQUENCE + 1);
             if(seq == expected_seq) // If the packet is the expected one
             {   
-                fwrite(packet_buffer->data, 1, packet_buffer->size, file);
-                create_or_modify_packet(response, 0, expected_seq, ACK, NULL);
+                if(buffered + packet_buffer->size > RECEIVE_BUFFER_SIZE)
+                {
+                    if(flow_writer_submit(&writer, write_buffer, buffered, offset) != 0)
+                    {
+                        write_buffer = NULL;
+                        result = -1;
+                        break;
+                    }
+                    offset += buffered;
+                    buffered = 0;
+                    write_buffer = malloc(RECEIVE_BUFFER_SIZE);
+                    if(write_buffer == NULL)
+                    {
+                        result = -1;
+                        break;
+                    }
+                }
+                memcpy(write_buffer + buffered, packet_buffer->data, packet_buffer->size);
+                buffered += packet_buffer->size;
+                ack_data[0] = flow_window(&writer, buffered);
+                window_closed = ack_data[0] == 0;
+                create_or_modify_packet(response, 1, expected_seq, ACK, ack_data);
                 send_packet(response, socket);
                 packets_received++;
+                received_bytes += packet_buffer->size;
             }
         }
     }
 
-    printf("\n");
-    fclose(file);
+    if(label != NULL)
+        printf("\n");
 
-    /* Send ACK for end transmision packet */
-    create_or_modify_packet(response, 0, 0, ACK, NULL);
-    send_packet(response, socket);
+    if(result == 0 && buffered > 0) // The writer has the rest, a compressed stream goes in order
+    {
+        if(flow_writer_submit(&writer, write_buffer, buffered, offset) != 0)
+            result = -1;
+        write_buffer = NULL;
+    }
+    if(flow_writer_finish(&writer) != 0)
+        result = -1;
 
-    printf("%s downloaded!\n", file_name);
+    /* Send ACK for end transmision packet */
+    if(result == 0)
+        acknowledge_end(response, next_file_name, socket);
+    else
+        fprintf(stderr, "ERROR: couldn't receive the data!\n");
 
+    free(write_buffer);
     destroy_packet(response);
     destroy_packet(packet_buffer);
 
-    return 0;
+    return result;
 }
 
 /* Make the download of the select video */
 int download_video(char *file_name, int socket)
+{
+    bool requested = false;
+
+    if(video_cache_hit(file_name))
+    {
+        printf("%s is in the cache\n", file_name);
+        return 0;
+    }
+
+    return fetch_video(file_name, NULL, &requested, socket);
+}
+
+/* Download the videos one after the other. The DOWNLOAD of the next video goes
+   in the ACK of END_TRANSMISSION, so the server starts it without a new handshake.
+   RETURN:
+    - The quantity of videos downloaded
+*/
+int download_videos(char (*file_names)[DATA_SIZE], int quantity, int socket)
+{
+    bool requested = false;
+    int downloaded = 0;
+
+    /* Cached videos don't go to the server, the others keep their order */
+    int missing = 0;
+    for(int i = 0; i < quantity; i++)
+    {
+        if(video_cache_hit(file_names[i]))
+        {
+            printf("%s is in the cache\n", file_names[i]);
+            downloaded++;
+        }
+        else
+        {
+            memmove(file_names[missing++], file_names[i], DATA_SIZE);
+        }
+    }
+    quantity = missing;
+
+    for(int i = 0; i < quantity; i++)
+    {
+        char *next_file_name = (i + 1 < quantity) ? file_names[i + 1] : NULL;
+        printf("Downloading (%d/%d): %s\n", i + 1, quantity, file_names[i]);
+
+        if(fetch_video(file_names[i], next_file_name, &requested, socket) == 0)
+            downloaded++;
+    }
+
+    return downloaded;
+}
+
+/* Download one video of a queue.
+   requested says if the DOWNLOAD already went in the last ACK of END_TRANSMISSION,
+   and it's updated for next_file_name at the end.
+*/
+int fetch_video(char *file_name, char *next_file_name, bool *requested, int socket)
 {
     packet_t *p = create_or_modify_packet(NULL, MAX_FILE_NAME_SIZE, 0, DOWNLOAD, file_name);
+    int response;
 
-    int response = send_packet_stop_wait(p, p, TIMEOUT, socket);
+    if(*requested)
+        response = wait_queued_request(p, file_name, socket);
+    else
+        response = send_packet_stop_wait(p, p, TIMEOUT, socket);
+    *requested = false;
 
     /* Send packet for start to download file */
     if(response == ERR_LISTEN)
@@ -321,8 +833,8 @@ int download_video(char *file_name, int socket)
         return ERROR;
     }
 
-    /* Listen for descriptor packet */
-    if (listen_for_packet(p, TIMEOUT, socket) != 0)
+    /* Listen for descriptor packet, unless it came in place of the ACK */
+    if (p->type != DESCRIPTOR && listen_for_packet(p, TIMEOUT, socket) != 0)
     {
         fprintf(stderr, "ERROR: couldn't listen for descriptor packet!");
         destroy_packet(p);
@@ -333,6 +845,8 @@ int download_video(char *file_name, int socket)
     size_t extracted_size = 0;
     for (size_t i = 0; i < 4; ++i)
         extracted_size |= ((size_t)p->data[i]) << (i * 8);
+    media_layout_t layout;
+    media_unpack_layout(p->data, &layout);
 
     char data_str[20];
     memcpy(data_str, p->data + 43, 20);
@@ -343,7 +857,8 @@ int download_video(char *file_name, int socket)
     {
         char file_date_str[21]; 
         file_date_str[21] = '\0';
-        struct tm *time_info = get_file_date(file_name);
+        struct tm date;
+        struct tm *time_info = get_file_date(file_name, &date);
         snprintf((char*)(file_date_str), 20, "%04u-%02u-%02u %02u:%02u:%02u", 
             time_info->tm_year + 1900, time_info->tm_mon + 1, time_info->tm_mday,
             time_info->tm_hour, time_info->tm_min, time_info->tm_sec);
@@ -352,14 +867,15 @@ int download_video(char *file_name, int socket)
             create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "File already exists!");
             send_packet_stop_wait(p, p, TIMEOUT, socket);
             printf("File %s already exists!\n", file_name);
+            video_cache_add(file_name);
             destroy_packet(p);
             return 0;
         }
     }
 
 
-    /* Verify if the file can be downloaded */
-    if(can_download_file(extracted_size) == 0)
+    /* Verify if the file can be downloaded, evicting old videos of the cache */
+    if(video_cache_reserve(extracted_size, file_name) != 0)
     {
         create_or_modify_packet(p, MAX_DATA_SIZE,0, ERROR, "DISK FULL!");
 
@@ -369,23 +885,234 @@ int download_video(char *file_name, int socket)
         return ERR_DISK_FULL;
     }
 
-    create_or_modify_packet(p, 0, 0, ACK, NULL);
-    send_packet(p, socket);
+    /* An older copy exists, or the start the prefetch brought, download only the changed blocks */
+    int result = ERR_FILE;
+    char base[DATA_SIZE + sizeof(PREFETCH_SUFFIX)];
+    if(access(file_name, F_OK) == 0)
+        result = download_delta(file_name, file_name, p, socket, extracted_size, next_file_name);
+    else if(prefetch_base(file_name, base, sizeof(base)))
+        result = download_delta(file_name, base, p, socket, extracted_size, next_file_name);
+
+    /* Servers that offer compression send the stream compressed if the client wants it */
+    int level = get_env_number(COMPRESS_LEVEL_ENV, 0);
+    if(result == ERR_FILE && level > 0 && p->data[COMPRESS_OFFSET] == COMPRESS_VERSION)
+        result = download_compressed(file_name, p, socket, extracted_size, &layout, level, next_file_name);
 
-    if(receive_video(file_name, socket, extracted_size) != 0)
+    if(result == ERR_FILE) // No local copy to reuse
+    {
+        uint8_t ack_data[DATA_SIZE] = {0};
+        create_or_modify_packet(p, frames_accept(ack_data), 0, ACK, ack_data);
+        send_packet(p, socket);
+        result = receive_video(file_name, socket, extracted_size, &layout, next_file_name);
+    }
+
+    if(result != 0)
     {
         fprintf(stderr,"ERROR: couldn't download the video, please try again!\n");
         destroy_packet(p);
+        *requested = (result == ERR_DELTA && next_file_name != NULL); // Delta received but not applied
         return ERR_RECEIVE;
     }
 
 
     /* Setting the file date */
-    struct tm *file_date = get_file_date(file_name);
-    convert_to_tm_struct(data_str, file_date);
-    set_file_date(file_name, file_date);
+    struct tm file_date;
+    get_file_date(file_name, &file_date);
+    convert_to_tm_struct(data_str, &file_date);
+    set_file_date(file_name, &file_date);
+    video_cache_add(file_name);
 
     destroy_packet(p);
+    *requested = (next_file_name != NULL);
 
     return 0;
 }
+
+/* Wait the answer for a DOWNLOAD that went in the ACK of END_TRANSMISSION.
+   If the END_TRANSMISSION comes again the ACK was lost and it's sent again.
+   RETURN:
+    0 if ACK, ERROR or DESCRIPTOR was received in p
+    -1 if an error occurred
+    -2 if the timeout expired
+*/
+int wait_queued_request(packet_t *p, char *file_name, int socket)
+{
+    int listen, try = 0;
+
+    while(1)
+    {
+        listen = listen_for_packet(p, TIMEOUT, socket);
+        if(listen == ERR_LISTEN)
+            return ERR_LISTEN;
+        if(listen != 0)
+        {
+            try++;
+            if(try > MAX_TRY)
+                return ERR_TIMEOUT_EXPIRED;
+            continue;
+        }
+
+        if(p->type == ACK || p->type == ERROR || p->type == DESCRIPTOR)
+            return 0;
+
+        if(p->type == END_TRANSMISSION)
+        {
+            packet_t *response = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+            acknowledge_end(response, file_name, socket);
+            destroy_packet(response);
+        }
+    }
+}
+
+/* Send the ACK of END_TRANSMISSION, with the name of the next video to download */
+void acknowledge_end(packet_t *response, char *next_file_name, int socket)
+{
+    if(next_file_name == NULL)
+    {
+        create_or_modify_packet(response, 0, 0, ACK, NULL);
+    }
+    else
+    {
+        char name[DATA_SIZE] = {0};
+        strncpy(name, next_file_name, MAX_FILE_NAME_SIZE);
+        create_or_modify_packet(response, strlen(name), 0, ACK, name);
+    }
+
+    send_packet(response, socket);
+}
+
+/* Send the signatures of the local copy in base_name, receive the delta and rebuild
+   file_name. A base other than the file is removed once the file is rebuilt.
+   RETURN:
+    0 if the file was updated
+    ERR_FILE if the local copy can't be read, nothing was sent
+    ERR_RECEIVE if the delta couldn't be received
+    ERR_DELTA if the delta was received but couldn't be applied
+*/
+int download_delta(char *file_name, char *base_name, packet_t *p, int socket, size_t file_size, char *next_file_name)
+{
+    uint32_t block_size = delta_block_size(file_size);
+    size_t count;
+    block_signature_t *signatures = delta_signatures(base_name, block_size, &count);
+    if(signatures == NULL)
+        return ERR_FILE;
+
+    /* Ask for the delta in the ACK of the descriptor */
+    uint8_t data_buffer[DATA_SIZE] = {0};
+    uint32_t signatures_quantity = count;
+    data_buffer[0] = DELTA_REQUEST;
+    memcpy(data_buffer + 1, &block_size, sizeof(uint32_t));
+    memcpy(data_buffer + 5, &signatures_quantity, sizeof(uint32_t));
+    create_or_modify_packet(p, frames_accept(data_buffer), 0, ACK, data_buffer);
+    send_packet(p, socket);
+
+    printf("Sending %zu signatures of %s\n", count, file_name);
+    packet_t *response = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    int seq = 0, try;
+    for(size_t i = 0; i < count; i += SIGNATURES_PER_PACKET)
+    {
+        size_t quantity = count - i < SIGNATURES_PER_PACKET ? count - i : SIGNATURES_PER_PACKET;
+        memset(data_buffer, 0, DATA_SIZE);
+        delta_pack_signatures(data_buffer, signatures + i, quantity);
+        create_or_modify_packet(p, quantity * SIGNATURE_SIZE, seq, SIGNATURE, data_buffer);
+
+        /* Wait for the ACK of this sequence, old ACKs are ignored */
+        try = 0;
+        do
+        {
+            if(send_packet_stop_wait(p, response, TIMEOUT, socket) != 0 || ++try > MAX_TRY || response->type == ERROR)
+            {
+                if(response->type == ERROR)
+                {
+                    char *error_msg = convert_to_string(response->data, response->size);
+                    fprintf(stderr, "ERROR: %s\n", error_msg);
+                    free(error_msg);
+                }
+                free(signatures);
+                destroy_packet(response);
+                return ERR_RECEIVE;
+            }
+        } while(response->type != ACK || response->sequence != seq);
+
+        seq = (seq + 1) % (MAX_SEQUENCE + 1);
+    }
+    free(signatures);
+
+    create_or_modify_packet(p, 0, 0, END_TRANSMISSION, NULL);
+    int sent = send_packet_stop_wait(p, response, TIMEOUT, socket);
+    destroy_packet(response);
+    if(sent != 0)
+        return ERR_RECEIVE;
+
+    char delta_name[DATA_SIZE + 8], part_name[DATA_SIZE + 8];
+    snprintf(delta_name, sizeof(delta_name), "%s.delta", file_name);
+    snprintf(part_name, sizeof(part_name), "%s.part", file_name);
+
+    if(receive_video(delta_name, socket, file_size, NULL, next_file_name) != 0)
+    {
+        remove(delta_name);
+        return ERR_RECEIVE;
+    }
+
+    FILE *delta = fopen(delta_name, "rb");
+    int result = delta == NULL ? ERR_DELTA : delta_apply(base_name, delta, part_name);
+    if(delta != NULL)
+        fclose(delta);
+    remove(delta_name);
+
+    if(result != 0 || rename(part_name, file_name) != 0)
+    {
+        remove(part_name);
+        return ERR_DELTA;
+    }
+    if(strcmp(base_name, file_name) != 0)
+        remove(base_name);
+
+    return 0;
+}
+
+/* Receive the compressed stream, each block is written at its place in the file when it arrives
+   RETURN:
+    0 if the file was written
+    ERR_FILE if the file can't be written, nothing was sent
+    ERR_RECEIVE if the stream couldn't be received
+    ERR_DELTA if it was received but couldn't be decompressed, like a delta
+*/
+int download_compressed(char *file_name, packet_t *p, int socket, size_t file_size, media_layout_t *layout, int level, char *next_file_name)
+{
+    decompress_writer_t decompress;
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1 || decompress_writer_open(&decompress, fd, layout) != 0)
+    {
+        fprintf(stderr, "Error opening the file");
+        if(fd != -1)
+        {
+            close(fd);
+            remove(file_name);
+        }
+        return ERR_FILE;
+    }
+
+    uint8_t data_buffer[DATA_SIZE] = {0};
+    data_buffer[0] = COMPRESS_REQUEST;
+    data_buffer[1] = level < COMPRESS_MAX_LEVEL ? level : COMPRESS_MAX_LEVEL;
+    create_or_modify_packet(p, frames_accept(data_buffer), 0, ACK, data_buffer);
+    send_packet(p, socket);
+
+    int received = receive_stream(fd, 0, file_name, file_size, NULL, &decompress, next_file_name, socket);
+    int result = decompress_writer_close(&decompress, file_size);
+    close(fd);
+
+    if(received == 0 && result == 0)
+    {
+        printf("%s: %zu bytes received for %zu (ratio %.2f)\n", file_name, decompress.received, file_size,
+               decompress.received > 0 ? (double) file_size / decompress.received : 1.0);
+        printf("%s downloaded!\n", file_name);
+        return 0;
+    }
+
+    if(received == 0)
+        fprintf(stderr, "ERROR: the stream of %s ended before the video!\n", file_name);
+    remove(file_name); // A part of the video would look like the whole one
+    return received != 0 ? ERR_RECEIVE : ERR_DELTA;
+}
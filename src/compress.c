@@ -0,0 +1,402 @@
+#include "../lib/compress.h"
+#include "../lib/utils.h"
+
+/* Blocks are coded in sequences like the ones of LZ4: a token with the size of the
+   literals and of the match, the literals, the distance of the match in 16 bits.
+   The level is the depth of the search for a match, level 1 only looks at the last
+   position with the same hash. */
+#define MIN_MATCH 4
+#define HASH_BITS 14
+#define NO_POSITION -1
+
+/* Auxiliary Functions */
+bool next_block(compress_reader_t *reader);
+size_t compress_block(const uint8_t *input, size_t size, uint8_t *output, int level, int32_t *head);
+long long decompress_block(const uint8_t *input, size_t size, uint8_t *output, size_t capacity);
+uint8_t *put_length(uint8_t *output, uint8_t *end, size_t length);
+uint32_t hash_position(const uint8_t *input);
+void put_header(uint8_t *header, uint32_t original, uint32_t stored);
+
+
+/* *** Main Functions *** */
+
+/* RETURN:
+    0 if the stream can be read
+    ERR_COMPRESS if there is no memory
+*/
+int compress_reader_open(compress_reader_t *reader, FILE *file, size_t file_size, media_layout_t *layout, int level)
+{
+    memset(reader, 0, sizeof(compress_reader_t));
+    reader->file = file;
+    reader->file_size = file_size;
+    reader->layout = layout;
+    reader->level = level < 1 ? 1 : (level > COMPRESS_MAX_LEVEL ? COMPRESS_MAX_LEVEL : level);
+    reader->block = malloc(COMPRESS_BLOCK);
+    reader->coded = malloc(COMPRESS_HEADER + COMPRESS_BLOCK);
+    reader->head = malloc(((1 << HASH_BITS) + COMPRESS_BLOCK) * sizeof(int32_t));
+
+    if(reader->block == NULL || reader->coded == NULL || reader->head == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't start the compression!\n");
+        compress_reader_close(reader);
+        return ERR_COMPRESS;
+    }
+
+    return 0;
+}
+
+size_t compress_read(compress_reader_t *reader, uint8_t *buffer, size_t size)
+{
+    size_t copied = 0;
+
+    while(copied < size)
+    {
+        if(reader->coded_sent == reader->coded_length && !next_block(reader))
+            break;
+
+        size_t left = reader->coded_length - reader->coded_sent;
+        size_t length = left < size - copied ? left : size - copied;
+        memcpy(buffer + copied, reader->coded + reader->coded_sent, length);
+        reader->coded_sent += length;
+        copied += length;
+    }
+
+    return copied;
+}
+
+bool compress_ended(compress_reader_t *reader)
+{
+    return reader->coded_sent == reader->coded_length && reader->position >= (long long) reader->file_size;
+}
+
+void compress_reader_close(compress_reader_t *reader)
+{
+    free(reader->block);
+    free(reader->coded);
+    free(reader->head);
+    reader->block = reader->coded = NULL;
+    reader->head = NULL;
+}
+
+/* RETURN:
+    0 if the buffers were allocated
+    ERR_COMPRESS if there is no memory
+*/
+int decompress_writer_open(decompress_writer_t *writer, int fd, media_layout_t *layout)
+{
+    memset(writer, 0, sizeof(decompress_writer_t));
+    writer->fd = fd;
+    writer->layout = layout;
+    writer->coded = malloc(COMPRESS_HEADER + COMPRESS_BLOCK);
+    writer->block = malloc(COMPRESS_BLOCK);
+
+    if(writer->coded == NULL || writer->block == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't start the decompression!\n");
+        free(writer->coded);
+        free(writer->block);
+        writer->coded = writer->block = NULL;
+        return ERR_COMPRESS;
+    }
+
+    return 0;
+}
+
+/* The bytes come in the order of the stream, a block is gathered with its header */
+int decompress_write(decompress_writer_t *writer, const uint8_t *bytes, size_t length)
+{
+    writer->received += length;
+
+    while(length > 0 && writer->error == 0)
+    {
+        uint32_t original, stored;
+        memcpy(&original, writer->coded, sizeof(uint32_t));
+        memcpy(&stored, writer->coded + 4, sizeof(uint32_t));
+        size_t needed = writer->have < COMPRESS_HEADER ? COMPRESS_HEADER : COMPRESS_HEADER + stored;
+
+        size_t take = needed - writer->have < length ? needed - writer->have : length;
+        memcpy(writer->coded + writer->have, bytes, take);
+        writer->have += take;
+        bytes += take;
+        length -= take;
+
+        if(writer->have == COMPRESS_HEADER)
+        {
+            memcpy(&original, writer->coded, sizeof(uint32_t));
+            memcpy(&stored, writer->coded + 4, sizeof(uint32_t));
+            if(original == 0 || original > COMPRESS_BLOCK || stored == 0 || stored > original)
+                writer->error = ERR_COMPRESS;
+        }
+        else if(writer->have == needed) // The whole block
+        {
+            uint8_t *block = writer->coded + COMPRESS_HEADER;
+            if(stored < original)
+            {
+                if(decompress_block(block, stored, writer->block, original) != original)
+                    writer->error = ERR_COMPRESS;
+                block = writer->block;
+            }
+
+            if(writer->error == 0 && media_pwrite(writer->fd, writer->layout, block, original, writer->position) != (ssize_t) original)
+                writer->error = ERR_COMPRESS;
+            writer->position += original;
+            writer->have = 0;
+        }
+    }
+
+    if(writer->error != 0)
+        fprintf(stderr, "ERROR: couldn't decompress the video!\n");
+
+    return writer->error;
+}
+
+/* RETURN:
+    0 if every byte of the file was written
+    ERR_COMPRESS if the stream is damaged, incomplete or the file couldn't be written
+*/
+int decompress_writer_close(decompress_writer_t *writer, size_t file_size)
+{
+    int result = writer->error;
+    if(writer->have != 0 || writer->position != (long long) file_size)
+        result = ERR_COMPRESS;
+
+    free(writer->coded);
+    free(writer->block);
+    writer->coded = writer->block = NULL;
+
+    return result;
+}
+
+/* Shannon entropy of the bytes of COMPRESS_SAMPLES pieces spread over the block,
+   encoded video is near 8 bits per byte */
+double compress_entropy(const uint8_t *block, size_t size)
+{
+    uint32_t count[256] = {0};
+    size_t total = 0;
+
+    if(size <= COMPRESS_SAMPLES * COMPRESS_SAMPLE_SIZE)
+    {
+        for(size_t i = 0; i < size; i++)
+            count[block[i]]++;
+        total = size;
+    }
+    else
+    {
+        size_t step = (size - COMPRESS_SAMPLE_SIZE) / (COMPRESS_SAMPLES - 1);
+        for(int s = 0; s < COMPRESS_SAMPLES; s++)
+            for(size_t i = s * step; i < s * step + COMPRESS_SAMPLE_SIZE; i++)
+                count[block[i]]++;
+        total = COMPRESS_SAMPLES * COMPRESS_SAMPLE_SIZE;
+    }
+
+    double entropy = 0;
+    for(int i = 0; i < 256; i++)
+        if(count[i] > 0)
+        {
+            double probability = (double) count[i] / total;
+            entropy -= probability * log2(probability);
+        }
+
+    return entropy;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Compress the next block of the file, the CPU goes only to the blocks that look like they shrink
+   RETURN:
+    - false at the end of the file or if it couldn't be read
+*/
+bool next_block(compress_reader_t *reader)
+{
+    if(reader->error != 0 || reader->position >= (long long) reader->file_size)
+        return false;
+
+    size_t left = reader->file_size - reader->position;
+    size_t length = left < COMPRESS_BLOCK ? left : COMPRESS_BLOCK;
+    if(media_read(reader->file, reader->layout, reader->position, reader->block, length) != length)
+    {
+        fprintf(stderr, "ERROR: couldn't read the file to compress!\n");
+        reader->error = ERR_COMPRESS;
+        return false;
+    }
+
+    size_t stored = 0;
+    if(compress_entropy(reader->block, length) <= COMPRESS_MAX_ENTROPY)
+        stored = compress_block(reader->block, length, reader->coded + COMPRESS_HEADER, reader->level, reader->head);
+    if(stored == 0)
+    {
+        memcpy(reader->coded + COMPRESS_HEADER, reader->block, length);
+        reader->stats.skipped++;
+    }
+    put_header(reader->coded, length, stored ? stored : length);
+
+    reader->coded_length = COMPRESS_HEADER + (stored ? stored : length);
+    reader->coded_sent = 0;
+    reader->position += length;
+    reader->stats.blocks++;
+    reader->stats.original += length;
+    reader->stats.compressed += reader->coded_length;
+
+    return true;
+}
+
+/* Code a block in output, of COMPRESS_BLOCK bytes. head has the hash table and the chains.
+   RETURN:
+    - The size of the coded block
+    - 0 if it isn't smaller than the block
+*/
+size_t compress_block(const uint8_t *input, size_t size, uint8_t *output, int level, int32_t *head)
+{
+    int32_t *previous = head + (1 << HASH_BITS); // Last position with the same hash
+    uint8_t *out = output, *end = output + size - 1; // The coded block must be smaller
+    int depth = 1 << (level - 1);
+    size_t anchor = 0, i = 0;
+
+    for(int h = 0; h < (1 << HASH_BITS); h++)
+        head[h] = NO_POSITION;
+
+    while(size >= MIN_MATCH && i <= size - MIN_MATCH)
+    {
+        /* Longest match of the chain of this hash, closer ones first */
+        uint32_t hash = hash_position(input + i);
+        size_t best_length = 0, best_distance = 0;
+        int32_t candidate = head[hash];
+        for(int d = 0; d < depth && candidate != NO_POSITION && i - candidate <= 0xFFFF; d++)
+        {
+            size_t length = 0;
+            while(i + length < size && input[candidate + length] == input[i + length])
+                length++;
+            if(length > best_length)
+            {
+                best_length = length;
+                best_distance = i - candidate;
+            }
+            candidate = previous[candidate];
+        }
+        previous[i] = head[hash];
+        head[hash] = i;
+
+        if(best_length < MIN_MATCH)
+        {
+            i++;
+            continue;
+        }
+
+        /* Sequence: token, literals, distance and the rest of the match length */
+        size_t literals = i - anchor;
+        if(out + 1 + literals / 255 + 1 + literals + 2 + best_length / 255 + 1 > end)
+            return 0;
+        uint8_t *token = out++;
+        *token = (literals < 15 ? literals : 15) << 4;
+        if(literals >= 15)
+            out = put_length(out, end, literals - 15);
+        memcpy(out, input + anchor, literals);
+        out += literals;
+        *out++ = best_distance & 0xFF;
+        *out++ = best_distance >> 8;
+        size_t extra = best_length - MIN_MATCH;
+        *token |= extra < 15 ? extra : 15;
+        if(extra >= 15)
+            out = put_length(out, end, extra - 15);
+
+        /* The deeper levels find matches inside this one later */
+        for(size_t j = i + 1; level > 1 && j < i + best_length && j <= size - MIN_MATCH; j++)
+        {
+            uint32_t inner = hash_position(input + j);
+            previous[j] = head[inner];
+            head[inner] = j;
+        }
+        i += best_length;
+        anchor = i;
+    }
+
+    /* The last sequence has only literals */
+    size_t literals = size - anchor;
+    if(out + 1 + literals / 255 + 1 + literals > end)
+        return 0;
+    uint8_t *token = out++;
+    *token = (literals < 15 ? literals : 15) << 4;
+    if(literals >= 15)
+        out = put_length(out, end, literals - 15);
+    memcpy(out, input + anchor, literals);
+    out += literals;
+
+    return out - output;
+}
+
+/* RETURN:
+    - The size of the block
+    - -1 if the coded block goes out of input or of output
+*/
+long long decompress_block(const uint8_t *input, size_t size, uint8_t *output, size_t capacity)
+{
+    const uint8_t *in = input, *in_end = input + size;
+    uint8_t *out = output, *out_end = output + capacity;
+
+    while(in < in_end)
+    {
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if(literals == 15)
+            do
+            {
+                if(in >= in_end)
+                    return -1;
+                literals += *in;
+            } while(*in++ == 255);
+
+        if(literals > (size_t) (in_end - in) || literals > (size_t) (out_end - out))
+            return -1;
+        memcpy(out, in, literals);
+        in += literals;
+        out += literals;
+        if(in == in_end) // Last sequence
+            break;
+
+        if(in_end - in < 2)
+            return -1;
+        size_t distance = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = (token & 0x0F) + MIN_MATCH;
+        if((token & 0x0F) == 15)
+            do
+            {
+                if(in >= in_end)
+                    return -1;
+                length += *in;
+            } while(*in++ == 255);
+
+        if(distance == 0 || distance > (size_t) (out - output) || length > (size_t) (out_end - out))
+            return -1;
+        for(size_t i = 0; i < length; i++) // The match can overlap the bytes it writes
+            out[i] = out[i - distance];
+        out += length;
+    }
+
+    return out - output;
+}
+
+/* Lengths above the token go in bytes of 255 and the rest */
+uint8_t *put_length(uint8_t *output, uint8_t *end, size_t length)
+{
+    for(; length >= 255 && output < end; length -= 255)
+        *output++ = 255;
+    if(output < end)
+        *output++ = length;
+    return output;
+}
+
+/* Hash of the MIN_MATCH bytes at the position */
+uint32_t hash_position(const uint8_t *input)
+{
+    uint32_t bytes;
+    memcpy(&bytes, input, sizeof(uint32_t));
+    return (bytes * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/* Size of the block in the file and in the stream, little endian like the DESCRIPTOR */
+void put_header(uint8_t *header, uint32_t original, uint32_t stored)
+{
+    memcpy(header, &original, sizeof(uint32_t));
+    memcpy(header + 4, &stored, sizeof(uint32_t));
+}
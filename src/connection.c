@@ -1,15 +1,32 @@
 #include "../lib/utils.h"
 #include "../lib/connection.h"
-
+#include "../lib/xdp.h"
+#include "../lib/scheduler.h"
+#include "../lib/codec.h"
+#include "../lib/capture.h"
+#include "../lib/latency.h"
+#include <sched.h>
+#include <errno.h>
+
+
+/* Losses of each socket, the name is its interface */
+socket_stats_t socket_stats[MAX_SOCKETS];
+char socket_names[MAX_SOCKETS][IFNAMSIZ];
+long long socket_next_poll[MAX_SOCKETS];
+long long socket_busy_poll_ns[MAX_SOCKETS]; // Spin budget of each wait
+bool socket_compact[MAX_SOCKETS]; // DATA frames go compact, the receiver reads them
 
 /* Auxiliary Functions */
-uint8_t crc8_calc(packet_t *packet);
-double diff_time(clock_t start, clock_t end);
-int start_marker_verification(packet_t *p);
 int packet_verification(uint8_t size, uint8_t sequence, uint8_t type);
-int crc8_verification(packet_t *p);
-void shift_bits(packet_t *packet);
-void unshift_bits(packet_t* p);
+void size_socket_buffers(int socket);
+int set_buffer(int socket, int option, int force_option, int size);
+void poll_kernel_drops(int socket);
+socket_stats_t *stats_of(int socket);
+void enable_busy_poll(int socket, long long busy_poll_us);
+ssize_t spin_receive(int socket, uint8_t *wire, long long deadline_ms);
+ssize_t receive_frame(int socket, uint8_t *wire, int flags, bool *outgoing);
+void answer_damaged(packet_t *buffer, int socket);
+size_t encode_frame(packet_t *packet, uint8_t *wire, int socket);
 
 
 /* *** Main Functions *** */
@@ -32,7 +49,7 @@ int create_socket(char *device)
 
   /* Interface */
   memset(&ir, 0, sizeof(struct ifreq));
-  memcpy(ir.ifr_name, device, sizeof(&device));
+  strncpy(ir.ifr_name, device, IFNAMSIZ - 1);
   if (ioctl(sock, SIOCGIFINDEX, &ir) == -1)
   {
     printf("ERROR: device not found, please try again with a valid device!\n");
@@ -61,6 +78,21 @@ int create_socket(char *device)
     return ERR_ACTIVATION;
   }
 
+  size_socket_buffers(sock);
+  capture_open(sock, ir.ifr_ifindex);
+  latency_open(sock, device);
+  enable_busy_poll(sock, get_env_number(BUSY_POLL_ENV, 0));
+  if (stats_of(sock) != NULL)
+  {
+    strncpy(socket_names[sock], device, IFNAMSIZ - 1);
+    poll_kernel_drops(sock); // Frames before the bind don't count
+    memset(&socket_stats[sock], 0, sizeof(socket_stats_t));
+  }
+
+  /* Optional AF_XDP socket for the bulk of the frames */
+  if (get_env_number(XDP_ENV, 0) && xdp_attach(sock, device) != 0)
+    fprintf(stderr, "AF_XDP unavailable, using only the raw socket\n");
+
   return sock;
 }
 
@@ -97,10 +129,9 @@ packet_t *create_or_modify_packet(packet_t *packet, uint8_t size, uint8_t sequen
     if (size > 0)
     {
         uint8_t *data_bytes = (uint8_t *)data; 
-        if(data_bytes[DATA_SIZE-1] == 0x01)
-            memcpy(&packet->data, data, size+1);
-        else
-            memcpy(&packet->data, data, size);
+        memcpy(&packet->data, data, size);
+        if(data_bytes[DATA_SIZE-1] == 0x01) // Flag of the escapes, frames of any size keep it
+            packet->data[DATA_SIZE-1] = 0x01;
     }
 
     packet->crc8 = crc8_calc(packet);
@@ -115,21 +146,66 @@ packet_t *create_or_modify_packet(packet_t *packet, uint8_t size, uint8_t sequen
 */
 int send_packet(packet_t *packet, int socket)
 {
+    uint8_t wire[CODEC_FRAME_SIZE];
+
+    /* The dispatcher of the scheduler sends it later */
+    if(sched_enqueue(packet, socket) == 0)
+        return 0;
+
+    size_t length = encode_frame(packet, wire, socket);
+    capture_frame(socket, wire, length, CAPTURE_OUTGOING);
 
-    shift_bits(packet);
+    /* DATA frames go through AF_XDP when it's active */
+    if(packet->type == DATA && xdp_send(socket, wire, length) == 0)
+        return 0;
 
-    if(send(socket, packet, sizeof(packet_t), 0) == -1) 
+    latency_sent(socket, packet);
+    if(send(socket, wire, length, 0) == -1) 
     {
         fprintf(stderr, "ERROR: couldn't send packet!\n");
         close(socket);
         exit(EXIT_FAILURE);
     }
-
-    unshift_bits(packet);
+    latency_poll(socket); // The timestamps would fill the receive buffer
 
     return 0;
 }
 
+/* Sends a packet that leaves the interface at txtime, in nanoseconds of CLOCK_MONOTONIC.
+   The socket needs SO_TXTIME and the interface a qdisc that honors it, like fq.
+   RETURN:
+    0 if the packet was queued
+   -1 if the kernel refused it, the caller can send it with send_packet
+*/
+int send_packet_at(packet_t *packet, int socket, uint64_t txtime)
+{
+    char control[CMSG_SPACE(sizeof(uint64_t))];
+    uint8_t wire[CODEC_FRAME_SIZE];
+    struct iovec iov = { wire, 0 };
+    struct msghdr msg;
+
+    memset(control, 0, sizeof(control));
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg), &txtime, sizeof(uint64_t));
+
+    iov.iov_len = encode_frame(packet, wire, socket);
+    latency_sent(socket, packet);
+    ssize_t sent = sendmsg(socket, &msg, 0);
+    if(sent != -1)
+        capture_frame(socket, wire, iov.iov_len, CAPTURE_OUTGOING);
+
+    return sent == -1 ? -1 : 0;
+}
+
 /* 
    Sends a packet and waits for a response, ACK or ERROR. 
    If the response is a NACK, the packet is sent again.
@@ -182,61 +258,122 @@ int send_packet_stop_wait(packet_t *packet, packet_t *response, int timeout, int
    -2 if the timeout expired. 
 */
 int listen_for_packet(packet_t *buffer, int timeout, int socket)
+{
+    return listen_for_packet_ms(buffer, timeout * 1000LL, socket);
+}
+
+/* Listens for a valid packet, the timeout is in milliseconds of the real clock
+    Type of return:
+    0 if the packet was received with success.
+   -1 if an error occurred. 
+   -2 if the timeout expired. 
+*/
+int listen_for_packet_ms(packet_t *buffer, long long timeout_ms, int socket)
 {
     fd_set rfds;
     struct timeval t_out;
+    uint8_t wire[CODEC_FRAME_SIZE];
+    int xsk = xdp_fd(socket); // Frames of the protocol arrive here with AF_XDP
+    socket_stats_t *stats = stats_of(socket);
+    bool nonblocking = xsk != -1 || latency_enabled(socket); // The timestamps of sent frames also wake select
 
-    /* Set the socket to listen */
-    FD_ZERO(&rfds);
-    FD_SET(socket, &rfds);
+    xdp_flush(socket); // Frames queued for AF_XDP go before waiting
 
-    /* Timeout and start, now time */
-    t_out.tv_usec = 0;
-    clock_t start = clock();
-    clock_t now = clock();
+    /* Deadline and now time */
+    long long now = get_time_ms();
+    long long deadline = now + timeout_ms;
 
     /* While the timeout is not expired */
-    while(diff_time(start, now) < timeout)
+    while(now < deadline)
     {
-        memset(buffer, 0, sizeof(packet_t)); // Reset the buffer
+        if(stats != NULL && now >= __atomic_load_n(&socket_next_poll[socket], __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&socket_next_poll[socket], now + SOCKET_STATS_POLL_MS, __ATOMIC_RELAXED);
+            poll_kernel_drops(socket);
+        }
 
-        t_out.tv_sec = timeout - diff_time(start, now); // If the timeout is not expired, update the time
+        memset(buffer, 0, sizeof(packet_t)); // Reset the buffer
 
-        int ready = select(socket + 1, &rfds, NULL, NULL, &t_out);
-        
-        if (ready == ERR_LISTEN) 
-            return ERR_LISTEN; // Error 
-        else if (ready == 0) 
-        {
-            return ERR_TIMEOUT_EXPIRED; // Timeout expired
-        } 
-        else 
+        /* A frame found while spinning skips the wait */
+        ssize_t bytes_received = spin_receive(socket, wire, deadline);
+        if(bytes_received < 0)
         {
+            t_out.tv_sec = (deadline - now) / 1000; // If the timeout is not expired, update the time
+            t_out.tv_usec = ((deadline - now) % 1000) * 1000;
 
-            ssize_t bytes_received = recv(socket, buffer, sizeof(packet_t), 0);
-            unshift_bits(buffer);
+            /* Set the socket to listen */
+            FD_ZERO(&rfds);
+            FD_SET(socket, &rfds);
+            if(xsk != -1)
+                FD_SET(xsk, &rfds);
 
-            if(bytes_received == ERR_LISTEN) 
-                return ERR_LISTEN;
-            
-            /* Checks if the packet is from client and if it's crc8 is right  */ 
-            if(start_marker_verification(buffer) )
+            int ready = select((xsk > socket ? xsk : socket) + 1, &rfds, NULL, NULL, &t_out);
+
+            if (ready == ERR_LISTEN) 
+                return ERR_LISTEN; // Error 
+            else if (ready == 0) 
+                break; // Timeout expired
+
+            bytes_received = receive_frame(socket, wire, nonblocking ? MSG_DONTWAIT : 0, NULL);
+            if(bytes_received == -1 && nonblocking && (xsk != -1 || errno == EAGAIN)) // The ready one was the other socket, or the error queue
             {
-                if (crc8_verification(buffer) == 0) // Verify CRC8
-                {   
-                    packet_t *nack = create_or_modify_packet(NULL, 0, buffer->sequence, NACK, NULL);
-                    send_packet(nack, socket);
-                    destroy_packet(nack);
-                }
-                else // The pacet is valid
-                    return VALID_PACKET;
+                now = get_time_ms();
+                continue;
             }
+
+            if(bytes_received == ERR_LISTEN) 
+                return ERR_LISTEN;
+        }
+
+        /* Only frames of the protocol are decoded, a wrong CRC asks for the frame again */ 
+        int decoded = codec_decode(wire, bytes_received, buffer);
+        if(decoded == CODEC_OK)
+        {
+            latency_answer(socket, buffer);
+            return VALID_PACKET;
         }
-        now = clock(); // Update the time
+        if(decoded == CODEC_ERR_CRC)
+            answer_damaged(buffer, socket);
+        now = get_time_ms(); // Update the time
     }
+
+    /* A drop of the kernel looks like a timeout here, its count tells them apart */
+    poll_kernel_drops(socket);
+    if(stats != NULL)
+        __atomic_add_fetch(&stats->timeouts, 1, __ATOMIC_RELAXED);
     return ERR_TIMEOUT_EXPIRED; 
 }
 
+/* Take a frame that is already waiting, without blocking, for callers with their own
+   event loop. The frames this socket sent are skipped, like the ones of other protocols.
+   RETURN:
+    - VALID_PACKET if a frame was received
+    - ERR_TIMEOUT_EXPIRED if there is none waiting
+    - ERR_LISTEN if the socket failed
+*/
+int receive_packet(packet_t *buffer, int socket)
+{
+    uint8_t wire[CODEC_FRAME_SIZE];
+    bool outgoing = false;
+    ssize_t bytes_received;
+
+    while((bytes_received = receive_frame(socket, wire, MSG_DONTWAIT, &outgoing)) > 0)
+    {
+        if(outgoing)
+            continue;
+        int decoded = codec_decode(wire, bytes_received, buffer);
+        if(decoded == CODEC_OK)
+        {
+            latency_answer(socket, buffer);
+            return VALID_PACKET;
+        }
+        if(decoded == CODEC_ERR_CRC)
+            answer_damaged(buffer, socket);
+    }
+
+    return bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? ERR_TIMEOUT_EXPIRED : ERR_LISTEN;
+}
+
 /* Destory a packet, if exists */
 void destroy_packet(packet_t *p) 
 {
@@ -262,58 +399,50 @@ void response_reply(packet_t *p)
     }
 }
 
-/* *** Auxiliary Functions *** */
-
-/* Calculate the CRC8 */
-uint8_t crc8_calc(packet_t *packet) 
+/* Losses of a socket until now, with the drops of the kernel up to date */
+void get_socket_stats(int socket, socket_stats_t *stats)
 {
-    uint8_t data[3 + DATA_SIZE];
-
-    size_t length;  
-    length = DATA_SIZE + 3;
-    data[0] = packet->size;
-    data[1] = packet->sequence;
-    data[2] = packet->type;
-
-    memset(data+3, 0, DATA_SIZE);
-
-    if(packet->size > 0)   
-        memcpy(data+3, packet->data, packet->size);
-
-    uint8_t crc = 0x00;
-    const uint8_t generator = 0x07; // Polynomial   
-    for (size_t j = 0; j < length; j++) {
-      crc ^= data[j];   
-      // For each bit of the byte check for the MSB bit, if it is 1 then left
-      // shift the CRC and XOR with the polynomial otherwise just left shift the
-      // variable
-      for (int i = 0; i < 8; i++) {
-        if ((crc & 0x80) != 0) {
-          crc = (crc << 1)^ generator;
-        } else {
-          crc <<= 1;
-        }
-      }
-    }   
-    return crc;
-}
+    socket_stats_t *counters = stats_of(socket);
+    memset(stats, 0, sizeof(socket_stats_t));
+    if(counters == NULL)
+        return;
 
+    poll_kernel_drops(socket);
+    stats->frames = __atomic_load_n(&counters->frames, __ATOMIC_RELAXED);
+    stats->kernel_drops = __atomic_load_n(&counters->kernel_drops, __ATOMIC_RELAXED);
+    stats->crc_failures = __atomic_load_n(&counters->crc_failures, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&counters->timeouts, __ATOMIC_RELAXED);
+}
 
-/* Return the time passed between two clock_t */
-double diff_time(clock_t start, clock_t end)
+/* Send the DATA frames of a socket compact, only for a receiver that asked for them */
+void set_compact_frames(int socket, bool compact)
 {
-    return ((double)(end - start) / CLOCKS_PER_SEC);
+    if(socket >= 0 && socket < MAX_SOCKETS)
+        __atomic_store_n(&socket_compact[socket], compact, __ATOMIC_RELEASE);
 }
 
-/* Checks if the start marker of a packet is correct */
-int start_marker_verification(packet_t *p)
+/* Print the losses of a socket */
+void print_socket_stats(int socket)
 {
-    if(p->start_marker != (uint8_t)(START_MARKER))
-        return 0;
+    socket_stats_t stats;
+    get_socket_stats(socket, &stats);
+    if(stats_of(socket) == NULL)
+        return;
 
-    return 1;
+    printf("Socket %s: %llu frames, %llu dropped by the kernel, %llu CRC failures, %llu timeouts\n",
+           socket_names[socket], stats.frames, stats.kernel_drops, stats.crc_failures, stats.timeouts);
+    latency_report(socket, "the last frames");
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Calculate the CRC8 */
+uint8_t crc8_calc(packet_t *packet) 
+{
+    return codec_crc8(packet->size, packet->sequence, packet->type, packet->data); // Table of the codec
 }
 
+
 /* Verify packet parameters */
 int packet_verification(uint8_t size, uint8_t sequence, uint8_t type) 
 {
@@ -323,27 +452,168 @@ int packet_verification(uint8_t size, uint8_t sequence, uint8_t type)
     return 1;
 }
 
-/* Checks if the crc8 of a packet is correct */
-int crc8_verification(packet_t *p)
+/* Size the kernel buffers for SOCKET_WINDOWS windows of frames. SO_*BUFFORCE
+   passes over net.core.rmem_max and wmem_max when the process has CAP_NET_ADMIN. */
+void size_socket_buffers(int socket)
 {
-    if(p->crc8 != crc8_calc(p))
-        return 0;
+    long long windows = get_env_number(SOCKET_WINDOWS_ENV, SOCKET_WINDOWS);
+    if(windows <= 0)
+        return;
 
-    return 1;
+    long long size = windows * WINDOW_SIZE * (CODEC_FRAME_SIZE + SOCKET_FRAME_OVERHEAD);
+    if(size > INT32_MAX / 2)
+        size = INT32_MAX / 2;
+
+    int receive = set_buffer(socket, SO_RCVBUF, SO_RCVBUFFORCE, size);
+    int send = set_buffer(socket, SO_SNDBUF, SO_SNDBUFFORCE, size);
+    if(receive < size || send < size)
+        fprintf(stderr, "Socket buffers limited to %d KB receive and %d KB send, %lld KB wanted (raise net.core.rmem_max and wmem_max)\n",
+                receive / 1024, send / 1024, size / 1024);
 }
 
-/* Shift bits function */
-void shift_bits(packet_t* p) {
-    p->size = p->size << 2; // shift left 2 bits to use upper 6 bits
-    p->sequence = p->sequence << 3; // shift left 3 bits to use upper 5 bits
-    p->type = p->type << 3; // shift left 3 bits to use upper 5 bits
+/* Set a buffer of the socket, forcing it if possible
+   RETURN:
+    - The size the kernel gives to the frames, half of what it reports
+*/
+int set_buffer(int socket, int option, int force_option, int size)
+{
+    if(setsockopt(socket, SOL_SOCKET, force_option, &size, sizeof(size)) == -1)
+        setsockopt(socket, SOL_SOCKET, option, &size, sizeof(size));
+
+    int granted = 0;
+    socklen_t length = sizeof(granted);
+    getsockopt(socket, SOL_SOCKET, option, &granted, &length);
+
+    return granted / 2; // The kernel doubles it for its bookkeeping
 }
 
-/* Unshift bits function */
-void unshift_bits(packet_t* p) {
-    p->size = p->size >> 2; // shift right 2 bits to get back original 6 bits
-    p->sequence = p->sequence >> 3; // shift right 3 bits to get back original 5 bits
-    p->type = p->type >> 3; // shift right 3 bits to get back original 5 bits
+/* Add the frames and drops of the kernel since the last read, PACKET_STATISTICS resets them */
+void poll_kernel_drops(int socket)
+{
+    struct tpacket_stats kernel;
+    socklen_t length = sizeof(kernel);
+    socket_stats_t *stats = stats_of(socket);
+
+    if(stats == NULL || getsockopt(socket, SOL_PACKET, PACKET_STATISTICS, &kernel, &length) == -1)
+        return;
+
+    __atomic_add_fetch(&stats->frames, kernel.tp_packets, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->kernel_drops, kernel.tp_drops, __ATOMIC_RELAXED);
+    if(kernel.tp_drops > 0)
+        fprintf(stderr, "Kernel dropped %u frames of %s, its receive buffer was full\n", kernel.tp_drops, socket_names[socket]);
 }
 
+/* Losses of a socket, NULL if it isn't tracked */
+socket_stats_t *stats_of(int socket)
+{
+    if(socket < 0 || socket >= MAX_SOCKETS)
+        return NULL;
+
+    return &socket_stats[socket];
+}
+
+/* Ask the kernel to poll the driver too while the socket spins. Only a
+   budget is kept when the options aren't known, the spin still works. */
+void enable_busy_poll(int socket, long long busy_poll_us)
+{
+    if(busy_poll_us <= 0 || socket < 0 || socket >= MAX_SOCKETS)
+        return;
+
+    socket_busy_poll_ns[socket] = busy_poll_us * 1000;
 
+    int value = busy_poll_us;
+#ifdef SO_BUSY_POLL
+    setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+    value = 1;
+    setsockopt(socket, SOL_SOCKET, SO_PREFER_BUSY_POLL, &value, sizeof(value));
+#endif
+}
+
+/* Spin on the sockets without blocking for the busy poll budget
+   RETURN:
+    - The bytes of the frame received
+    - -1 if nothing came, the caller waits with select
+*/
+ssize_t spin_receive(int socket, uint8_t *wire, long long deadline_ms)
+{
+    if(socket < 0 || socket >= MAX_SOCKETS || socket_busy_poll_ns[socket] == 0)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long start = now.tv_sec * 1000000000LL + now.tv_nsec, current = start;
+    long long end = start + socket_busy_poll_ns[socket];
+    if(end > deadline_ms * 1000000LL)
+        end = deadline_ms * 1000000LL;
+
+    while(current < end)
+    {
+        ssize_t bytes_received = receive_frame(socket, wire, MSG_DONTWAIT, NULL);
+        if(bytes_received > 0)
+            return bytes_received;
+
+        sched_yield(); // Returns at once on a core of its own, lets the other end run on a shared one
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        current = now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+
+    return -1;
+}
+
+/* Take a frame from the AF_XDP ring or the raw socket. Frames of the protocol
+   coming from the link go to the capture, the copies of our own were already there.
+   RETURN:
+    - The bytes of the frame, -1 if nothing came or an error occurred
+*/
+ssize_t receive_frame(int socket, uint8_t *wire, int flags, bool *outgoing)
+{
+    ssize_t bytes_received = xdp_receive(socket, wire, CODEC_FRAME_SIZE);
+    if(outgoing != NULL)
+        *outgoing = false; // AF_XDP only has the frames that arrived
+    if(bytes_received > 0)
+    {
+        capture_frame(socket, wire, bytes_received, CAPTURE_INCOMING);
+        return bytes_received;
+    }
+
+    struct sockaddr_ll from;
+    socklen_t length = sizeof(from);
+    memset(&from, 0, sizeof(from));
+    if(latency_enabled(socket))
+        bytes_received = latency_receive(socket, wire, CODEC_FRAME_SIZE, flags, &from);
+    else
+        bytes_received = recvfrom(socket, wire, CODEC_FRAME_SIZE, flags, (struct sockaddr *) &from, &length);
+    if(bytes_received > 0 && wire[0] == START_MARKER && from.sll_pkttype != PACKET_OUTGOING)
+        capture_frame(socket, wire, bytes_received, CAPTURE_INCOMING);
+    if(outgoing != NULL && bytes_received > 0)
+        *outgoing = from.sll_pkttype == PACKET_OUTGOING;
+
+    return bytes_received;
+}
+
+/* A frame with a wrong CRC is counted and asked again */
+void answer_damaged(packet_t *buffer, int socket)
+{
+    socket_stats_t *stats = stats_of(socket);
+    if(stats != NULL)
+        __atomic_add_fetch(&stats->crc_failures, 1, __ATOMIC_RELAXED);
+
+    packet_t *nack = create_or_modify_packet(NULL, 0, buffer->sequence, NACK, NULL);
+    send_packet(nack, socket);
+    destroy_packet(nack);
+}
+
+/* Frame of a packet for the socket
+   RETURN:
+    - The bytes of the frame
+*/
+size_t encode_frame(packet_t *packet, uint8_t *wire, int socket)
+{
+    if(packet->type == DATA && socket >= 0 && socket < MAX_SOCKETS && __atomic_load_n(&socket_compact[socket], __ATOMIC_ACQUIRE))
+        return codec_encode_compact(packet, wire);
+
+    codec_encode(packet, wire);
+    return CODEC_FRAME_SIZE;
+}
@@ -0,0 +1,398 @@
+#include "../lib/delta.h"
+#include "../lib/utils.h"
+#include <sys/mman.h>
+
+/* Signature of the old copy with the block index, sorted by weak checksum */
+typedef struct signature_entry {
+    uint32_t weak;
+    uint64_t strong;
+    uint32_t index;
+} signature_entry_t;
+
+/* Auxiliary Functions */
+int compare_signature_entry(const void *a, const void *b);
+long long find_block(signature_entry_t *entries, size_t count, uint32_t weak, const uint8_t *block, uint32_t block_size);
+void write_copy(FILE *delta, uint32_t index, uint32_t count);
+void write_literal(FILE *delta, const uint8_t *buffer, size_t length);
+
+
+/* *** Main Functions *** */
+
+/* Block size near sqrt(file size), between DELTA_MIN_BLOCK and DELTA_MAX_BLOCK */
+uint32_t delta_block_size(size_t file_size)
+{
+    uint32_t block_size = (uint32_t) sqrt((double) file_size);
+
+    if(block_size < DELTA_MIN_BLOCK)
+        return DELTA_MIN_BLOCK;
+    if(block_size > DELTA_MAX_BLOCK)
+        return DELTA_MAX_BLOCK;
+
+    return block_size & ~(uint32_t)(DELTA_MIN_BLOCK - 1); // Multiple of the minimum block
+}
+
+/* Rolling checksum of rsync, a and b are 16 bits each */
+uint32_t delta_weak_checksum(const uint8_t *buffer, size_t length)
+{
+    uint32_t a = 0, b = 0;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        a += buffer[i];
+        b += (uint32_t)(length - i) * buffer[i];
+    }
+
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+/* FNV-1a of 64 bits */
+uint64_t delta_strong_checksum(const uint8_t *buffer, size_t length)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for(size_t i = 0; i < length; i++)
+    {
+        hash ^= buffer[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+/* Compute the signatures of the full blocks of a file
+   RETURN:
+    - An array with count signatures
+    - NULL if an error occurred
+*/
+block_signature_t *delta_signatures(char *file_name, uint32_t block_size, size_t *count)
+{
+    FILE *file = fopen(file_name, "rb");
+    if(file == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't open %s for signatures!\n", file_name);
+        return NULL;
+    }
+
+    long long int file_size = get_file_size(file_name);
+    *count = file_size > 0 ? (size_t)(file_size / block_size) : 0;
+
+    block_signature_t *signatures = calloc(*count + 1, sizeof(block_signature_t));
+    uint8_t *block = malloc(block_size);
+    if(signatures == NULL || block == NULL)
+    {
+        fprintf(stderr, "ERROR: memory allocation failed!\n");
+        free(signatures);
+        free(block);
+        fclose(file);
+        return NULL;
+    }
+
+    for(size_t i = 0; i < *count; i++)
+    {
+        if(fread(block, 1, block_size, file) != block_size)
+        {
+            *count = i;
+            break;
+        }
+        signatures[i].weak = delta_weak_checksum(block, block_size);
+        signatures[i].strong = delta_strong_checksum(block, block_size);
+    }
+
+    free(block);
+    fclose(file);
+
+    return signatures;
+}
+
+/* Write count signatures in the payload of a packet */
+void delta_pack_signatures(uint8_t *data, block_signature_t *signatures, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        memcpy(data + i * SIGNATURE_SIZE, &signatures[i].weak, sizeof(uint32_t));
+        memcpy(data + i * SIGNATURE_SIZE + 4, &signatures[i].strong, sizeof(uint64_t));
+    }
+}
+
+/* Read count signatures from the payload of a packet */
+void delta_unpack_signatures(uint8_t *data, block_signature_t *signatures, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        memcpy(&signatures[i].weak, data + i * SIGNATURE_SIZE, sizeof(uint32_t));
+        memcpy(&signatures[i].strong, data + i * SIGNATURE_SIZE + 4, sizeof(uint64_t));
+    }
+}
+
+/* Scan the file with the rolling checksum and write the delta:
+   blocks found in the old copy become COPY instructions, the rest LITERAL.
+   RETURN:
+    0 if the delta was written
+    ERR_DELTA if an error occurred
+*/
+int delta_generate(char *file_name, block_signature_t *signatures, size_t count, uint32_t block_size, FILE *delta)
+{
+    int fd = open(file_name, O_RDONLY);
+    if(fd == -1)
+    {
+        fprintf(stderr, "ERROR: couldn't open %s for delta!\n", file_name);
+        return ERR_DELTA;
+    }
+
+    struct stat file_stat;
+    if(fstat(fd, &file_stat) == -1)
+    {
+        close(fd);
+        return ERR_DELTA;
+    }
+    size_t file_size = file_stat.st_size;
+
+    /* Header: magic, block size and size of the new file */
+    uint64_t new_size = file_size;
+    fwrite(DELTA_MAGIC, 1, 4, delta);
+    fwrite(&block_size, sizeof(uint32_t), 1, delta);
+    fwrite(&new_size, sizeof(uint64_t), 1, delta);
+
+    if(file_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    uint8_t *buffer = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(buffer == MAP_FAILED)
+    {
+        fprintf(stderr, "ERROR: couldn't map %s!\n", file_name);
+        return ERR_DELTA;
+    }
+
+    signature_entry_t *entries = malloc((count + 1) * sizeof(signature_entry_t));
+    if(entries == NULL)
+    {
+        munmap(buffer, file_size);
+        return ERR_DELTA;
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        entries[i].weak = signatures[i].weak;
+        entries[i].strong = signatures[i].strong;
+        entries[i].index = i;
+    }
+    qsort(entries, count, sizeof(signature_entry_t), compare_signature_entry);
+
+    size_t pos = 0, literal_start = 0;
+    uint32_t copy_index = 0, copy_count = 0;
+    uint32_t a = 0, b = 0;
+    bool rolling = false;
+
+    while(count > 0 && pos + block_size <= file_size)
+    {
+        if(!rolling)
+        {
+            uint32_t weak = delta_weak_checksum(buffer + pos, block_size);
+            a = weak & 0xFFFF;
+            b = weak >> 16;
+            rolling = true;
+        }
+
+        long long found = find_block(entries, count, a | (b << 16), buffer + pos, block_size);
+        if(found >= 0)
+        {
+            if(pos > literal_start) // Bytes before this block go as literal
+            {
+                if(copy_count > 0)
+                    write_copy(delta, copy_index, copy_count);
+                copy_count = 0;
+                write_literal(delta, buffer + literal_start, pos - literal_start);
+            }
+            if(copy_count > 0 && copy_index + copy_count == (uint32_t) found)
+                copy_count++;
+            else
+            {
+                if(copy_count > 0)
+                    write_copy(delta, copy_index, copy_count);
+                copy_index = found;
+                copy_count = 1;
+            }
+            pos += block_size;
+            literal_start = pos;
+            rolling = false;
+            continue;
+        }
+
+        if(pos + block_size == file_size)
+            break;
+
+        /* Roll one byte: out buffer[pos], in buffer[pos + block_size] */
+        uint8_t out = buffer[pos], in = buffer[pos + block_size];
+        a = (a - out + in) & 0xFFFF;
+        b = (b - block_size * out + a) & 0xFFFF;
+        pos++;
+    }
+
+    if(copy_count > 0)
+        write_copy(delta, copy_index, copy_count);
+    write_literal(delta, buffer + literal_start, file_size - literal_start);
+
+    free(entries);
+    munmap(buffer, file_size);
+
+    return ferror(delta) ? ERR_DELTA : 0;
+}
+
+/* Rebuild a file from the old copy and the instructions of the delta
+   RETURN:
+    0 if the new file was written
+    ERR_DELTA if the delta is invalid or an error occurred
+*/
+int delta_apply(char *old_file_name, FILE *delta, char *new_file_name)
+{
+    char magic[4];
+    uint32_t block_size;
+    uint64_t new_size;
+
+    if(fread(magic, 1, 4, delta) != 4 || memcmp(magic, DELTA_MAGIC, 4) != 0 ||
+       fread(&block_size, sizeof(uint32_t), 1, delta) != 1 ||
+       fread(&new_size, sizeof(uint64_t), 1, delta) != 1)
+    {
+        fprintf(stderr, "ERROR: invalid delta!\n");
+        return ERR_DELTA;
+    }
+
+    FILE *old_file = fopen(old_file_name, "rb");
+    FILE *new_file = fopen(new_file_name, "wb");
+    uint8_t *buffer = malloc(block_size);
+    if(old_file == NULL || new_file == NULL || buffer == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't open files to apply delta!\n");
+        if(old_file) fclose(old_file);
+        if(new_file) fclose(new_file);
+        free(buffer);
+        return ERR_DELTA;
+    }
+
+    int result = 0;
+    uint64_t written = 0;
+    int op;
+    while(result == 0 && (op = fgetc(delta)) != EOF)
+    {
+        uint32_t first, length;
+        if(op == DELTA_COPY)
+        {
+            if(fread(&first, sizeof(uint32_t), 1, delta) != 1 || fread(&length, sizeof(uint32_t), 1, delta) != 1 ||
+               fseek(old_file, (long) first * block_size, SEEK_SET) != 0)
+            {
+                result = ERR_DELTA;
+                break;
+            }
+            for(uint32_t i = 0; i < length; i++)
+            {
+                if(fread(buffer, 1, block_size, old_file) != block_size)
+                {
+                    result = ERR_DELTA;
+                    break;
+                }
+                fwrite(buffer, 1, block_size, new_file);
+                written += block_size;
+            }
+        }
+        else if(op == DELTA_LITERAL)
+        {
+            if(fread(&length, sizeof(uint32_t), 1, delta) != 1)
+            {
+                result = ERR_DELTA;
+                break;
+            }
+            while(length > 0)
+            {
+                size_t chunk = length < block_size ? length : block_size;
+                if(fread(buffer, 1, chunk, delta) != chunk)
+                {
+                    result = ERR_DELTA;
+                    break;
+                }
+                fwrite(buffer, 1, chunk, new_file);
+                written += chunk;
+                length -= chunk;
+            }
+        }
+        else
+            result = ERR_DELTA;
+    }
+
+    if(result == 0 && written != new_size)
+        result = ERR_DELTA;
+    if(result != 0)
+        fprintf(stderr, "ERROR: delta doesn't match the local copy!\n");
+
+    free(buffer);
+    fclose(old_file);
+    if(fclose(new_file) != 0)
+        result = ERR_DELTA;
+
+    return result;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Order the signatures by weak checksum */
+int compare_signature_entry(const void *a, const void *b)
+{
+    const signature_entry_t *x = a, *y = b;
+
+    if(x->weak != y->weak)
+        return x->weak < y->weak ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+/* Look for a block of the old copy with the same checksums
+   RETURN:
+    - The index of the block
+    - -1 if there is no such block
+*/
+long long find_block(signature_entry_t *entries, size_t count, uint32_t weak, const uint8_t *block, uint32_t block_size)
+{
+    size_t low = 0, high = count;
+
+    while(low < high) // First entry with this weak checksum
+    {
+        size_t middle = low + (high - low) / 2;
+        if(entries[middle].weak < weak)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if(low == count || entries[low].weak != weak)
+        return -1;
+
+    uint64_t strong = delta_strong_checksum(block, block_size);
+    for(; low < count && entries[low].weak == weak; low++)
+        if(entries[low].strong == strong)
+            return entries[low].index;
+
+    return -1;
+}
+
+/* Write a COPY instruction */
+void write_copy(FILE *delta, uint32_t index, uint32_t count)
+{
+    fputc(DELTA_COPY, delta);
+    fwrite(&index, sizeof(uint32_t), 1, delta);
+    fwrite(&count, sizeof(uint32_t), 1, delta);
+}
+
+/* Write LITERAL instructions, at most 1 MB each */
+void write_literal(FILE *delta, const uint8_t *buffer, size_t length)
+{
+    while(length > 0)
+    {
+        uint32_t chunk = length < (1 << 20) ? length : (1 << 20);
+        fputc(DELTA_LITERAL, delta);
+        fwrite(&chunk, sizeof(uint32_t), 1, delta);
+        fwrite(buffer, 1, chunk, delta);
+        buffer += chunk;
+        length -= chunk;
+    }
+}
@@ -0,0 +1,252 @@
+#include "../lib/discovery.h"
+#include "../lib/codec.h"
+#include "../lib/capture.h"
+#include "../lib/utils.h"
+#include "../lib/xdp.h"
+#include "../lib/latency.h"
+#include <poll.h>
+
+/* Auxiliary Functions */
+int list_up_interfaces(char (*names)[IFNAMSIZ]);
+int read_probe_answer(int socket, server_info_t *info);
+int parse_probe_answer(uint8_t *wire, ssize_t bytes, server_info_t *info);
+void discard_probe_answers(int socket, double until_ms);
+void put_capabilities(uint8_t *data);
+double discovery_now_ms();
+
+
+/* *** Main Functions *** */
+
+/* The probes go out on every socket at once, so the time to find a server is about one
+   round trip. The sockets of the other interfaces are closed.
+   RETURN:
+    - The socket of the interface of the server
+    - ERR_INTERFACE if no interface could be opened
+    - ERR_TIMEOUT if no server answered in DISCOVERY_TIMEOUT_ENV
+*/
+int discover_server(char **interfaces, int quantity, server_info_t *info)
+{
+    char names[MAX_DISCOVERY_INTERFACES][IFNAMSIZ];
+    int sockets[MAX_DISCOVERY_INTERFACES], opened = 0, found = -1;
+
+    if(quantity == 0)
+        quantity = list_up_interfaces(names);
+    else
+    {
+        quantity = quantity < MAX_DISCOVERY_INTERFACES ? quantity : MAX_DISCOVERY_INTERFACES;
+        for(int i = 0; i < quantity; i++)
+            snprintf(names[i], IFNAMSIZ, "%s", interfaces[i]);
+    }
+
+    for(int i = 0; i < quantity; i++)
+    {
+        int socket = create_socket(names[i]);
+        if(socket < 0)
+            continue;
+        sockets[opened] = socket;
+        memmove(names[opened++], names[i], IFNAMSIZ);
+    }
+    if(opened == 0)
+    {
+        fprintf(stderr, "ERROR: no interface to look for the server!\n");
+        return ERR_INTERFACE;
+    }
+
+    uint8_t data[DATA_SIZE] = {0};
+    put_capabilities(data);
+    packet_t *probe = create_or_modify_packet(NULL, DISCOVERY_SIZE, 0, ONLINE, data);
+
+    /* With AF_XDP the answer can come in the other socket of the interface */
+    struct pollfd fds[2 * MAX_DISCOVERY_INTERFACES];
+    int owner[2 * MAX_DISCOVERY_INTERFACES], watched = 0;
+    for(int i = 0; i < opened; i++)
+    {
+        owner[watched] = i;
+        fds[watched++] = (struct pollfd) { sockets[i], POLLIN, 0 };
+        if(xdp_fd(sockets[i]) != -1)
+        {
+            owner[watched] = i;
+            fds[watched++] = (struct pollfd) { xdp_fd(sockets[i]), POLLIN, 0 };
+        }
+    }
+
+    /* The sequence of a probe is its round, the server answers with it */
+    double start = discovery_now_ms(), sent[MAX_SEQUENCE + 1] = {0};
+    long long now = get_time_ms(), wait = DISCOVERY_FIRST_WAIT_MS;
+    long long deadline = now + get_env_number(DISCOVERY_TIMEOUT_ENV, DISCOVERY_TIMEOUT_MS);
+    int round = 0, answered = -1;
+    for(; found == -1 && now < deadline; round = (round + 1) % (MAX_SEQUENCE + 1))
+    {
+        probe->sequence = round;
+        sent[round] = discovery_now_ms();
+        for(int i = 0; i < opened; i++)
+        {
+            send_packet(probe, sockets[i]);
+            xdp_flush(sockets[i]);
+        }
+
+        long long round_end = now + wait < deadline ? now + wait : deadline;
+        while(found == -1 && now < round_end)
+        {
+            if(poll(fds, watched, round_end - now) > 0)
+                for(int i = 0; i < watched && found == -1; i++)
+                    if((fds[i].revents & POLLIN) && (answered = read_probe_answer(sockets[owner[i]], info)) != -1 &&
+                       sent[answered] != 0) // A stray ACK of a round not sent isn't an answer
+                        found = owner[i];
+            now = get_time_ms();
+        }
+        wait = 2 * wait < DISCOVERY_MAX_WAIT_MS ? 2 * wait : DISCOVERY_MAX_WAIT_MS;
+    }
+    destroy_packet(probe);
+    double answer_ms = discovery_now_ms();
+    info->elapsed_ms = answer_ms - start;
+
+    for(int i = 0; i < opened; i++)
+        if(i != found)
+        {
+            xdp_detach(sockets[i]);
+            close(sockets[i]);
+        }
+    if(found == -1)
+        return ERR_TIMEOUT;
+
+    /* The answers to the last probes would be taken for the answer of the next request */
+    double round_trip = answer_ms - sent[answered];
+    discard_probe_answers(sockets[found], sent[(round + MAX_SEQUENCE) % (MAX_SEQUENCE + 1)] + 2 * round_trip + DISCOVERY_SETTLE_MS);
+
+    snprintf(info->interface, IFNAMSIZ, "%s", names[found]);
+    return sockets[found];
+}
+
+/* A probe has data, an ONLINE of an older client doesn't, and gets an ACK without it */
+void discovery_answer(packet_t *request, packet_t *answer)
+{
+    uint8_t data[DATA_SIZE] = {0};
+    put_capabilities(data);
+    create_or_modify_packet(answer, request->size >= DISCOVERY_SIZE ? DISCOVERY_SIZE : 0, request->sequence, ACK, data);
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Interfaces that are up, without the loopback
+   RETURN:
+    - The quantity of names
+*/
+int list_up_interfaces(char (*names)[IFNAMSIZ])
+{
+    struct if_nameindex *list = if_nameindex();
+    int control = socket(AF_INET, SOCK_DGRAM, 0), quantity = 0;
+
+    for(int i = 0; list != NULL && control != -1 && list[i].if_index != 0 && quantity < MAX_DISCOVERY_INTERFACES; i++)
+    {
+        struct ifreq ir;
+        memset(&ir, 0, sizeof(struct ifreq));
+        strncpy(ir.ifr_name, list[i].if_name, IFNAMSIZ - 1);
+        if(ioctl(control, SIOCGIFFLAGS, &ir) == -1 || !(ir.ifr_flags & IFF_UP) || (ir.ifr_flags & IFF_LOOPBACK))
+            continue;
+        snprintf(names[quantity++], IFNAMSIZ, "%s", list[i].if_name);
+    }
+
+    if(list != NULL)
+        if_freenameindex(list);
+    if(control != -1)
+        close(control);
+    return quantity;
+}
+
+/* Read the waiting frames of a socket looking for the answer of a probe. The frames
+   this host sent are skipped, a server on another interface of the host would look
+   like it answered on this one.
+   RETURN:
+    - The round of the probe the server answered, with info filled
+    - -1 if there is no answer
+*/
+int read_probe_answer(int socket, server_info_t *info)
+{
+    uint8_t wire[CODEC_FRAME_SIZE];
+    struct sockaddr_ll from;
+    socklen_t length = sizeof(from);
+    ssize_t bytes;
+    int round;
+
+    latency_poll(socket); // The timestamps of the probes make poll return
+    while((bytes = xdp_receive(socket, wire, sizeof(wire))) > 0)
+        if((round = parse_probe_answer(wire, bytes, info)) != -1)
+        {
+            capture_frame(socket, wire, bytes, CAPTURE_INCOMING);
+            return round;
+        }
+
+    while((bytes = recvfrom(socket, wire, sizeof(wire), MSG_DONTWAIT, (struct sockaddr *) &from, &length)) > 0)
+    {
+        length = sizeof(from);
+        if(from.sll_pkttype != PACKET_OUTGOING && (round = parse_probe_answer(wire, bytes, info)) != -1)
+        {
+            capture_frame(socket, wire, bytes, CAPTURE_INCOMING);
+            return round;
+        }
+    }
+
+    return -1;
+}
+
+/* An ACK without data or with the capabilities
+   RETURN:
+    - The round of the probe, with info filled
+    - -1 if the frame doesn't answer a probe
+*/
+int parse_probe_answer(uint8_t *wire, ssize_t bytes, server_info_t *info)
+{
+    packet_t answer;
+    if(codec_decode(wire, bytes, &answer) != CODEC_OK || answer.type != ACK ||
+       (answer.size != 0 && answer.size < DISCOVERY_SIZE))
+        return -1;
+
+    /* A server without capabilities has the ones of the protocol */
+    memset(info, 0, sizeof(server_info_t));
+    info->window = WINDOW_SIZE;
+    info->max_data_size = MAX_DATA_SIZE;
+    info->max_sequence = MAX_SEQUENCE;
+    if(answer.size >= DISCOVERY_SIZE && answer.data[DISCOVERY_VERSION_OFFSET] != 0)
+    {
+        info->version = answer.data[DISCOVERY_VERSION_OFFSET];
+        info->window = answer.data[DISCOVERY_WINDOW_OFFSET];
+        info->max_data_size = answer.data[DISCOVERY_DATA_SIZE_OFFSET];
+        info->max_sequence = answer.data[DISCOVERY_SEQUENCE_OFFSET];
+        for(int i = 0; i < 4; i++)
+            info->features |= (uint32_t) answer.data[DISCOVERY_FEATURES_OFFSET + i] << (i * 8);
+    }
+
+    return answer.sequence;
+}
+
+/* Throw away the answers that arrive until the time, a server answers every probe */
+void discard_probe_answers(int socket, double until_ms)
+{
+    struct pollfd fd = { socket, POLLIN, 0 };
+    server_info_t ignored;
+
+    while(read_probe_answer(socket, &ignored) != -1); // The ones that came while the other sockets closed
+    for(double now = discovery_now_ms(); now < until_ms; now = discovery_now_ms())
+        if(poll(&fd, 1, (int) (until_ms - now) + 1) > 0)
+            while(read_probe_answer(socket, &ignored) != -1);
+}
+
+/* Capabilities of this end */
+void put_capabilities(uint8_t *data)
+{
+    data[DISCOVERY_VERSION_OFFSET] = DISCOVERY_VERSION;
+    data[DISCOVERY_WINDOW_OFFSET] = WINDOW_SIZE;
+    data[DISCOVERY_DATA_SIZE_OFFSET] = MAX_DATA_SIZE;
+    data[DISCOVERY_SEQUENCE_OFFSET] = MAX_SEQUENCE;
+    for(int i = 0; i < 4; i++)
+        data[DISCOVERY_FEATURES_OFFSET + i] = (DISCOVERY_FEATURES >> (i * 8)) & 0xFF;
+}
+
+/* Monotonic time in milliseconds, with the fraction */
+double discovery_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
@@ -0,0 +1,145 @@
+#include "../lib/flow.h"
+#include "../lib/command.h"
+#include "../lib/utils.h"
+
+/* A buffer waiting to be written */
+typedef struct flow_block {
+    uint8_t *data;
+    size_t length;
+    off_t offset;
+} flow_block_t;
+
+/* Auxiliary Functions */
+void *writer_thread(void *arg);
+
+
+/* *** Main Functions *** */
+
+/* Start the writer thread of a file
+   RETURN:
+    0 if the thread is running
+    -1 if an error occurred
+*/
+int flow_writer_start(flow_writer_t *writer, int fd, media_layout_t *layout, decompress_writer_t *decompress)
+{
+    memset(writer, 0, sizeof(flow_writer_t));
+    writer->fd = fd;
+    writer->layout = layout;
+    writer->decompress = decompress;
+    writer->limit = get_env_number(RECEIVE_BACKLOG_ENV, RECEIVE_BACKLOG_KB) * 1024;
+    if(writer->limit < 2 * RECEIVE_BUFFER_SIZE) // The buffer being filled must not close the window alone
+        writer->limit = 2 * RECEIVE_BUFFER_SIZE;
+
+    if(spsc_ring_init(&writer->queue, writer->limit / RECEIVE_BUFFER_SIZE + 2) != 0 ||
+       pthread_create(&writer->thread, NULL, writer_thread, writer) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't start the writer!\n");
+        spsc_ring_destroy(&writer->queue);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Queue a buffer to be written at offset. It only waits when the queue is full,
+   which the window advertised in the ACKs should avoid.
+   RETURN:
+    0 if the buffer was queued
+    -1 if an earlier write failed
+*/
+int flow_writer_submit(flow_writer_t *writer, uint8_t *buffer, size_t length, off_t offset)
+{
+    flow_block_t *block = malloc(sizeof(flow_block_t));
+    if(block == NULL)
+    {
+        fprintf(stderr, "ERROR: memory allocation failed!\n");
+        exit(EXIT_FAILURE);
+    }
+    block->data = buffer;
+    block->length = length;
+    block->offset = offset;
+
+    __atomic_add_fetch(&writer->backlog, length, __ATOMIC_ACQ_REL);
+    while(!spsc_ring_push(&writer->queue, block))
+        nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+
+    return __atomic_load_n(&writer->error, __ATOMIC_ACQUIRE);
+}
+
+/* Wait every queued buffer to be written and stop the thread
+   RETURN:
+    0 if every buffer was written
+    -1 if a write failed
+*/
+int flow_writer_finish(flow_writer_t *writer)
+{
+    __atomic_store_n(&writer->finished, 1, __ATOMIC_RELEASE);
+    pthread_join(writer->thread, NULL);
+    spsc_ring_destroy(&writer->queue);
+
+    return writer->error;
+}
+
+size_t flow_written(flow_writer_t *writer)
+{
+    return __atomic_load_n(&writer->written, __ATOMIC_ACQUIRE);
+}
+
+/* Frames the receiver can take now: the free part of the backlog, up to the window */
+uint8_t flow_window(flow_writer_t *writer, size_t buffered)
+{
+    size_t used = __atomic_load_n(&writer->backlog, __ATOMIC_ACQUIRE) + buffered;
+    if(used >= writer->limit)
+        return 0;
+
+    size_t frames = (writer->limit - used) / MAX_DATA_SIZE;
+    return frames < WINDOW_SIZE ? frames : WINDOW_SIZE;
+}
+
+/* Window advertised in an ACK, the whole window if the receiver didn't send one */
+int flow_ack_window(packet_t *ack)
+{
+    if(ack->size < 1)
+        return WINDOW_SIZE;
+
+    return ack->data[0] < WINDOW_SIZE ? ack->data[0] : WINDOW_SIZE;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Write the queued buffers in order until the receiver finishes */
+void *writer_thread(void *arg)
+{
+    flow_writer_t *writer = arg;
+    flow_block_t *block;
+
+    while(1)
+    {
+        int finished = __atomic_load_n(&writer->finished, __ATOMIC_ACQUIRE);
+        block = spsc_ring_pop(&writer->queue);
+        if(block == NULL)
+        {
+            if(finished) // Nothing was queued after the last pop
+                break;
+            nanosleep(&(struct timespec){ 0, 200000 }, NULL);
+            continue;
+        }
+
+        if(writer->error == 0 && writer->decompress != NULL) // The buffers come in the order of the stream
+        {
+            if(decompress_write(writer->decompress, block->data, block->length) != 0)
+                __atomic_store_n(&writer->error, -1, __ATOMIC_RELEASE);
+        }
+        else if(writer->error == 0 && media_pwrite(writer->fd, writer->layout, block->data, block->length, block->offset) != (ssize_t) block->length)
+            __atomic_store_n(&writer->error, -1, __ATOMIC_RELEASE);
+
+        if(writer->error == 0)
+            __atomic_store_n(&writer->written, writer->decompress != NULL ? (size_t) writer->decompress->position :
+                             writer->written + block->length, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&writer->backlog, block->length, __ATOMIC_ACQ_REL);
+        free(block->data);
+        free(block);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,343 @@
+#include "../lib/frame_cache.h"
+#include "../lib/delta.h"
+#include "../lib/utils.h"
+#include <sys/mman.h>
+#include <errno.h>
+#include <pthread.h>
+
+/* One video in the cache directory, named <hash of path>-<mtime>.frames */
+typedef struct cache_entry {
+    char path[MAX_CACHE_PATH];
+    uint64_t key; // Hash of the video path
+    size_t size;
+    unsigned long long last_used;
+    bool ready; // False while the frames are written
+} cache_entry_t;
+
+/* Video packetized by a thread of its own */
+typedef struct cache_build {
+    char file_name[MAX_CACHE_PATH];
+    char path[MAX_CACHE_PATH];
+} cache_build_t;
+
+/* State of the cache, only the server uses it */
+bool cache_enabled = false;
+char cache_directory[MAX_CACHE_PATH / 2];
+cache_entry_t cache_entries[MAX_CACHE_ENTRIES];
+size_t cache_quantity = 0, cache_budget = 0, cache_used = 0;
+unsigned long long cache_clock = 0;
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+uint8_t sequence_crc[MAX_SEQUENCE + 1]; // CRC of a packet with only the sequence set
+
+/* Auxiliary Functions */
+int cache_lookup(char *file_name, cached_video_t *video);
+void add_entry(const char *path, uint64_t key, size_t size);
+void remove_entry(size_t index);
+void evict_entries(size_t needed);
+int packetize_video(char *file_name, const char *path);
+void *build_video(void *arg);
+int map_video(const char *path, cached_video_t *video);
+
+
+/* *** Main Functions *** */
+
+/* Start the cache, registering the frames left by a previous run
+   RETURN:
+    0 if the cache is ready or disabled
+    -1 if the directory can't be used
+*/
+int frame_cache_init(const char *directory, size_t budget)
+{
+    if(budget == 0)
+        return 0;
+
+    if(mkdir(directory, 0755) == -1 && errno != EEXIST)
+    {
+        fprintf(stderr, "ERROR: couldn't create cache directory %s!\n", directory);
+        return -1;
+    }
+
+    snprintf(cache_directory, sizeof(cache_directory), "%s", directory);
+    cache_budget = budget;
+
+    /* The CRC is linear, so the sequence of a frame can be changed with a XOR */
+    packet_t zero;
+    memset(&zero, 0, sizeof(packet_t));
+    for(int seq = 0; seq <= MAX_SEQUENCE; seq++)
+    {
+        zero.sequence = seq;
+        sequence_crc[seq] = crc8_calc(&zero);
+    }
+
+    DIR *d = opendir(directory);
+    struct dirent *dir;
+    while(d != NULL && (dir = readdir(d)) != NULL)
+    {
+        unsigned long long key;
+        long long mtime;
+        char path[MAX_CACHE_PATH * 2];
+        if(sscanf(dir->d_name, "%16llx-%lld.frames", &key, &mtime) != 2 || strstr(dir->d_name, ".tmp"))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", directory, dir->d_name);
+        long long size = get_file_size(path);
+        if(size > 0)
+            add_entry(path, key, size);
+    }
+    if(d != NULL)
+        closedir(d);
+
+    evict_entries(0);
+    cache_enabled = true;
+
+    printf("Send cache: %zu videos, %zu of %zu bytes\n", cache_quantity, cache_used, cache_budget);
+    return 0;
+}
+
+/* Map the frames of a video, a miss starts packetizing it in the background so the
+   first frame isn't kept waiting. The lock keeps the sessions of the interfaces of the server apart.
+   RETURN:
+    0 if the frames are mapped in video
+    -1 if the video isn't cached (disabled, too big, being packetized or error)
+*/
+int frame_cache_get(char *file_name, cached_video_t *video)
+{
+    if(!cache_enabled)
+        return -1;
+
+    pthread_mutex_lock(&cache_lock);
+    int result = cache_lookup(file_name, video);
+    pthread_mutex_unlock(&cache_lock);
+
+    return result;
+}
+
+/* Unmap the frames of a video */
+void frame_cache_release(cached_video_t *video)
+{
+    if(video->frames != NULL)
+        munmap(video->frames, video->map_size);
+    video->frames = NULL;
+}
+
+/* Copy a cached frame and fix its sequence and CRC
+   RETURN:
+    - A pointer to the new packet
+    - NULL if the index is past the frames cached, the file has the rest
+*/
+packet_t *frame_cache_packet(cached_video_t *video, long long index, uint8_t sequence)
+{
+    if(index < 0 || (size_t) index >= video->quantity)
+        return NULL;
+
+    packet_t *packet = malloc(sizeof(packet_t));
+    if(packet == NULL)
+    {
+        fprintf(stderr, "ERROR: packet allocation failure!");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(packet, &video->frames[index], sizeof(packet_t));
+    packet->sequence = sequence;
+    packet->crc8 ^= sequence_crc[sequence];
+
+    return packet;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Map the frames of a video, starting to packetize it if it isn't in the cache, with the lock held
+   RETURN:
+    0 if the frames are mapped in video
+    -1 if the video isn't cached (disabled, too big, being packetized or error)
+*/
+int cache_lookup(char *file_name, cached_video_t *video)
+{
+    struct stat file_stat;
+
+    if(stat(file_name, &file_stat) == -1 || file_stat.st_size == 0)
+        return -1;
+
+    uint64_t key = delta_strong_checksum((uint8_t *) file_name, strlen(file_name));
+    char path[MAX_CACHE_PATH];
+    snprintf(path, sizeof(path), "%s/%016llx-%lld.frames", cache_directory,
+             (unsigned long long) key, (long long) file_stat.st_mtime);
+
+    for(size_t i = 0; i < cache_quantity; i++)
+    {
+        if(strcmp(cache_entries[i].path, path) == 0) // Hit
+        {
+            if(!cache_entries[i].ready) // Another send started it
+                return -1;
+            cache_entries[i].last_used = ++cache_clock;
+            return map_video(path, video);
+        }
+    }
+
+    size_t frames = ceil((double) file_stat.st_size / (double)(MAX_DATA_SIZE));
+    size_t size = frames * sizeof(packet_t);
+    if(size > cache_budget)
+        return -1;
+
+    /* Older versions of the same video won't be used again */
+    for(size_t i = 0; i < cache_quantity; )
+    {
+        if(cache_entries[i].key == key)
+            remove_entry(i);
+        else
+            i++;
+    }
+    evict_entries(size);
+
+    /* The entry holds the budget while the frames are written, this send reads the file */
+    cache_build_t *build = malloc(sizeof(cache_build_t));
+    pthread_t thread;
+    if(build == NULL)
+        return -1;
+    snprintf(build->file_name, sizeof(build->file_name), "%s", file_name);
+    snprintf(build->path, sizeof(build->path), "%s", path);
+
+    add_entry(path, key, size);
+    cache_entries[cache_quantity - 1].last_used = ++cache_clock;
+    cache_entries[cache_quantity - 1].ready = false;
+    if(pthread_create(&thread, NULL, build_video, build) != 0)
+    {
+        remove_entry(cache_quantity - 1);
+        free(build);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return -1;
+}
+
+/* Register a cached video, evicting the oldest one if the table is full */
+void add_entry(const char *path, uint64_t key, size_t size)
+{
+    if(cache_quantity == MAX_CACHE_ENTRIES)
+    {
+        size_t oldest = 0;
+        for(size_t i = 1; i < cache_quantity; i++)
+            if(cache_entries[i].last_used < cache_entries[oldest].last_used)
+                oldest = i;
+        remove_entry(oldest);
+    }
+
+    cache_entry_t *entry = &cache_entries[cache_quantity++];
+    snprintf(entry->path, sizeof(entry->path), "%s", path);
+    entry->key = key;
+    entry->size = size;
+    entry->last_used = 0;
+    entry->ready = true;
+    cache_used += size;
+}
+
+/* Delete a cached video from the disk and the table */
+void remove_entry(size_t index)
+{
+    unlink(cache_entries[index].path);
+    cache_used -= cache_entries[index].size;
+    cache_entries[index] = cache_entries[--cache_quantity];
+}
+
+/* Evict the least recently used videos until needed bytes fit in the budget */
+void evict_entries(size_t needed)
+{
+    while(cache_quantity > 0 && cache_used + needed > cache_budget)
+    {
+        size_t oldest = 0;
+        for(size_t i = 1; i < cache_quantity; i++)
+            if(cache_entries[i].last_used < cache_entries[oldest].last_used)
+                oldest = i;
+        remove_entry(oldest);
+    }
+}
+
+/* Write the frames of a video as send_video would create them, with sequence 0 */
+int packetize_video(char *file_name, const char *path)
+{
+    char tmp_path[MAX_CACHE_PATH + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *file = fopen(file_name, "rb");
+    FILE *frames = fopen(tmp_path, "wb");
+    if(file == NULL || frames == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't create the cache of %s!\n", file_name);
+        if(file) fclose(file);
+        if(frames) fclose(frames);
+        return -1;
+    }
+
+    uint8_t data_buffer[DATA_SIZE] = {0};
+    packet_t frame;
+    size_t file_read_bytes;
+
+    while((file_read_bytes = fread(data_buffer, 1, MAX_DATA_SIZE, file)) > 0)
+    {
+        replace_bytes_server(data_buffer, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+        replace_bytes_server(data_buffer, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+        memset(&frame, 0, sizeof(packet_t));
+        create_or_modify_packet(&frame, file_read_bytes, 0, DATA, data_buffer);
+        fwrite(&frame, sizeof(packet_t), 1, frames);
+        memset(data_buffer, 0, DATA_SIZE);
+    }
+
+    fclose(file);
+    if(fclose(frames) != 0 || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Packetize a video and mark its entry ready. An entry evicted meanwhile takes its frames away. */
+void *build_video(void *arg)
+{
+    cache_build_t *build = arg;
+    int result = packetize_video(build->file_name, build->path);
+
+    pthread_mutex_lock(&cache_lock);
+    size_t i = 0;
+    while(i < cache_quantity && strcmp(cache_entries[i].path, build->path) != 0)
+        i++;
+    if(i < cache_quantity && result == 0)
+        cache_entries[i].ready = true;
+    else if(i < cache_quantity)
+        remove_entry(i);
+    else if(result == 0)
+        unlink(build->path);
+    pthread_mutex_unlock(&cache_lock);
+
+    free(build);
+    return NULL;
+}
+
+/* Map the frames file in memory */
+int map_video(const char *path, cached_video_t *video)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat file_stat;
+
+    if(fd == -1 || fstat(fd, &file_stat) == -1)
+    {
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    video->map_size = file_stat.st_size;
+    video->quantity = file_stat.st_size / sizeof(packet_t);
+    video->frames = mmap(NULL, video->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(video->frames == MAP_FAILED)
+    {
+        video->frames = NULL;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,145 @@
+#include "../lib/framing.h"
+#include "../lib/utils.h"
+
+/* Sizes of the transfer of a socket. The transmitter counts the frames and chooses
+   the size, the ACK stage counts the losses and the reader takes the size. */
+typedef struct frame_sizer {
+    bool active;
+    int min_size;
+    int size;
+    int smallest;
+    int largest;
+    long long frames; // Of the epoch
+    long long lost;
+    double rate; // Lost frames of each frame sent, smoothed
+} frame_sizer_t;
+
+frame_sizer_t frame_sizers[MAX_SOCKETS];
+
+/* Auxiliary Functions */
+frame_sizer_t *sizer_of(int socket);
+void choose_size(frame_sizer_t *sizer);
+int wire_size(int size);
+
+
+/* *** Main Functions *** */
+
+void frames_offer(uint8_t *descriptor)
+{
+    if(get_env_number(FRAMES_ENV, 1))
+        descriptor[FRAMES_OFFSET] = FRAMES_MIN_SIZE;
+}
+
+/* The whole data goes, so the CRC covers the byte */
+uint8_t frames_accept(uint8_t *data)
+{
+    data[FRAMES_ACCEPT_OFFSET] = FRAMES_MIN_SIZE;
+    return MAX_DATA_SIZE;
+}
+
+/* Older clients send the ACK without data */
+int frames_negotiate(packet_t *ack)
+{
+    if(!get_env_number(FRAMES_ENV, 1) || ack->type != ACK || ack->size < MAX_DATA_SIZE || ack->data[FRAMES_ACCEPT_OFFSET] == 0)
+        return 0;
+
+    int min_size = ack->data[FRAMES_ACCEPT_OFFSET] > FRAMES_MIN_SIZE ? ack->data[FRAMES_ACCEPT_OFFSET] : FRAMES_MIN_SIZE;
+    return min_size < MAX_DATA_SIZE ? min_size : MAX_DATA_SIZE;
+}
+
+void frames_start(int socket, int min_size)
+{
+    frame_sizer_t *sizer = sizer_of(socket);
+    if(sizer == NULL)
+        return;
+
+    memset(sizer, 0, sizeof(frame_sizer_t));
+    sizer->min_size = min_size;
+    sizer->size = sizer->smallest = sizer->largest = MAX_DATA_SIZE;
+    __atomic_store_n(&sizer->active, min_size > 0, __ATOMIC_RELEASE);
+    set_compact_frames(socket, min_size > 0);
+}
+
+int frames_size(int socket)
+{
+    frame_sizer_t *sizer = sizer_of(socket);
+    if(sizer == NULL || !__atomic_load_n(&sizer->active, __ATOMIC_ACQUIRE))
+        return MAX_DATA_SIZE;
+
+    return __atomic_load_n(&sizer->size, __ATOMIC_ACQUIRE);
+}
+
+void frames_sent(int socket, int quantity)
+{
+    frame_sizer_t *sizer = sizer_of(socket);
+    if(sizer == NULL || !__atomic_load_n(&sizer->active, __ATOMIC_ACQUIRE))
+        return;
+
+    sizer->frames += quantity;
+    if(sizer->frames >= FRAMES_EPOCH)
+        choose_size(sizer);
+}
+
+void frames_lost(int socket)
+{
+    frame_sizer_t *sizer = sizer_of(socket);
+    if(sizer != NULL && __atomic_load_n(&sizer->active, __ATOMIC_ACQUIRE))
+        __atomic_add_fetch(&sizer->lost, 1, __ATOMIC_RELAXED);
+}
+
+void frames_stop(int socket)
+{
+    frame_sizer_t *sizer = sizer_of(socket);
+    if(sizer == NULL || !__atomic_exchange_n(&sizer->active, false, __ATOMIC_ACQ_REL))
+        return;
+
+    set_compact_frames(socket, false);
+    printf("Frames of %d to %d bytes, %.2f%% lost\n", sizer->smallest, sizer->largest, sizer->rate * 100);
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Sizes of a socket, NULL if it isn't tracked */
+frame_sizer_t *sizer_of(int socket)
+{
+    if(socket < 0 || socket >= MAX_SOCKETS)
+        return NULL;
+
+    return &frame_sizers[socket];
+}
+
+/* A frame is lost if any of its bytes is damaged, so the rate of the frames of the
+   current size gives the one of a byte. The size chosen has the most payload arriving
+   for each byte on the wire: size / wire * (1 - byte rate)^wire. */
+void choose_size(frame_sizer_t *sizer)
+{
+    double epoch = (double) __atomic_exchange_n(&sizer->lost, 0, __ATOMIC_RELAXED) / sizer->frames;
+    sizer->frames = 0;
+    sizer->rate = (1 - FRAMES_SMOOTHING) * sizer->rate + FRAMES_SMOOTHING * (epoch < 1 ? epoch : 1);
+
+    double rate = sizer->rate < FRAMES_MAX_RATE ? sizer->rate : FRAMES_MAX_RATE;
+    double byte_kept = pow(1 - rate, 1.0 / wire_size(sizer->size));
+    double best = 0;
+    int best_size = MAX_DATA_SIZE;
+    for(int size = sizer->min_size; size <= MAX_DATA_SIZE; size++)
+    {
+        double goodput = (double) size / wire_size(size) * pow(byte_kept, wire_size(size));
+        if(goodput > best)
+        {
+            best = goodput;
+            best_size = size;
+        }
+    }
+
+    __atomic_store_n(&sizer->size, best_size, __ATOMIC_RELEASE);
+    if(best_size < sizer->smallest)
+        sizer->smallest = best_size;
+    if(best_size > sizer->largest)
+        sizer->largest = best_size;
+}
+
+/* Bytes of a compact frame on the wire, a smaller payload saves nothing under the padding */
+int wire_size(int size)
+{
+    return CODEC_COMPACT_SIZE(size) > CODEC_MIN_FRAME ? CODEC_COMPACT_SIZE(size) : CODEC_MIN_FRAME;
+}
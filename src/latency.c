@@ -0,0 +1,344 @@
+#include "../lib/latency.h"
+#include "../lib/codec.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+
+/* Frame sent and the times it has until its answer */
+typedef struct latency_frame {
+    bool pending;
+    bool sent_again;
+    uint8_t type;
+    long long user_ns;
+    long long scheduled_ns; // Entered the qdisc
+    long long driver_ns;
+    long long hardware_ns; // Left the NIC
+} latency_frame_t;
+
+/* Timestamps of a socket, the frames are kept by their sequence */
+typedef struct latency_socket {
+    bool enabled;
+    bool hardware;
+    char name[IFNAMSIZ];
+    pthread_mutex_t lock;
+    latency_frame_t frames[MAX_SEQUENCE + 1];
+    long long arrival_ns; // Of the last frame received, 0 if it was one of ours
+    long long arrival_hardware_ns;
+    latency_stats_t stats;
+} latency_socket_t;
+
+latency_socket_t latency_sockets[MAX_SOCKETS];
+FILE *latency_log = NULL;
+pthread_mutex_t latency_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Auxiliary Functions */
+latency_socket_t *latency_of(int socket);
+bool enable_hardware(int socket, char *device);
+void read_timestamps(struct msghdr *msg, long long *software_ns, long long *hardware_ns, int *stage);
+void write_stages(latency_socket_t *trace, uint8_t type, uint8_t sequence, long long *stages, bool hardware);
+long long timespec_ns(struct timespec *time);
+long long latency_now_ns();
+
+
+/* *** Main Functions *** */
+
+/* The NIC timestamps every frame only if its driver accepts SIOCSHWTSTAMP,
+   the software ones work on any interface */
+void latency_open(int socket, char *device)
+{
+    latency_socket_t *trace = latency_of(socket);
+    if(trace == NULL || !get_env_number(LATENCY_ENV, 0))
+        return;
+
+    bool hardware = enable_hardware(socket, device);
+    int flags = SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if(hardware)
+        flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    if(setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1)
+    {
+        fprintf(stderr, "Timestamps unavailable on %s, latency isn't measured\n", device);
+        return;
+    }
+
+    char *log_name = getenv(LATENCY_LOG_ENV);
+    pthread_mutex_lock(&latency_log_lock);
+    if(log_name != NULL && *log_name != '\0' && latency_log == NULL)
+    {
+        latency_log = fopen(log_name, "w");
+        if(latency_log == NULL)
+            fprintf(stderr, "ERROR: couldn't create the latency log %s!\n", log_name);
+        else
+            fprintf(latency_log, "interface,type,sequence,kernel_ns,queueing_ns,wire_ns,processing_ns,hardware\n");
+    }
+    pthread_mutex_unlock(&latency_log_lock);
+
+    pthread_mutex_init(&trace->lock, NULL);
+    memset(trace->frames, 0, sizeof(trace->frames));
+    memset(&trace->stats, 0, sizeof(latency_stats_t));
+    snprintf(trace->name, IFNAMSIZ, "%s", device);
+    trace->hardware = hardware;
+    trace->arrival_ns = trace->arrival_hardware_ns = 0;
+    __atomic_store_n(&trace->enabled, true, __ATOMIC_RELEASE);
+    printf("Latency of %s measured with %s timestamps\n", device, hardware ? "hardware" : "software");
+}
+
+bool latency_enabled(int socket)
+{
+    latency_socket_t *trace = latency_of(socket);
+    return trace != NULL && __atomic_load_n(&trace->enabled, __ATOMIC_ACQUIRE);
+}
+
+/* ACKs and NACKs aren't answered, they aren't kept */
+void latency_sent(int socket, packet_t *packet)
+{
+    if(!latency_enabled(socket) || packet->type == ACK || packet->type == NACK)
+        return;
+
+    latency_socket_t *trace = latency_of(socket);
+    latency_frame_t *frame = &trace->frames[packet->sequence & MAX_SEQUENCE];
+    long long now = latency_now_ns();
+
+    pthread_mutex_lock(&trace->lock);
+    bool again = frame->pending && frame->type == packet->type;
+    memset(frame, 0, sizeof(latency_frame_t));
+    frame->pending = true;
+    frame->sent_again = again;
+    frame->type = packet->type;
+    frame->user_ns = now;
+    pthread_mutex_unlock(&trace->lock);
+}
+
+/* The kernel gives back a copy of each frame with the timestamp, the frame says its sequence */
+void latency_poll(int socket)
+{
+    if(!latency_enabled(socket))
+        return;
+
+    latency_socket_t *trace = latency_of(socket);
+    uint8_t wire[CODEC_FRAME_SIZE];
+    char control[LATENCY_CONTROL_SIZE];
+    struct iovec iov = { wire, sizeof(wire) };
+    struct msghdr msg;
+    ssize_t bytes;
+
+    while(1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if((bytes = recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) < 0)
+            break;
+
+        long long software_ns = 0, hardware_ns = 0;
+        int stage = -1;
+        packet_t packet;
+        read_timestamps(&msg, &software_ns, &hardware_ns, &stage);
+        if(stage == -1 || codec_decode(wire, bytes, &packet) != CODEC_OK)
+            continue;
+
+        pthread_mutex_lock(&trace->lock);
+        latency_frame_t *frame = &trace->frames[packet.sequence];
+        if(frame->pending && frame->type == packet.type)
+        {
+            if(stage == SCM_TSTAMP_SCHED)
+                frame->scheduled_ns = software_ns;
+            else if(stage == SCM_TSTAMP_SND)
+            {
+                if(software_ns != 0)
+                    frame->driver_ns = software_ns;
+                if(hardware_ns != 0)
+                    frame->hardware_ns = hardware_ns;
+            }
+        }
+        pthread_mutex_unlock(&trace->lock);
+    }
+}
+
+ssize_t latency_receive(int socket, uint8_t *wire, size_t size, int flags, struct sockaddr_ll *from)
+{
+    latency_socket_t *trace = latency_of(socket);
+    char control[LATENCY_CONTROL_SIZE];
+    struct iovec iov = { wire, size };
+    struct msghdr msg;
+
+    latency_poll(socket);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = from;
+    msg.msg_namelen = sizeof(struct sockaddr_ll);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t bytes = recvmsg(socket, &msg, flags);
+    if(bytes <= 0)
+        return bytes;
+
+    /* The copies of the frames we sent answer nothing */
+    long long software_ns = 0, hardware_ns = 0;
+    int stage;
+    if(from->sll_pkttype != PACKET_OUTGOING)
+        read_timestamps(&msg, &software_ns, &hardware_ns, &stage);
+    __atomic_store_n(&trace->arrival_ns, software_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace->arrival_hardware_ns, hardware_ns, __ATOMIC_RELAXED);
+
+    return bytes;
+}
+
+void latency_answer(int socket, packet_t *packet)
+{
+    if(!latency_enabled(socket))
+        return;
+
+    latency_socket_t *trace = latency_of(socket);
+    long long now = latency_now_ns();
+    long long arrival = __atomic_exchange_n(&trace->arrival_ns, 0, __ATOMIC_RELAXED);
+    long long arrival_hardware = __atomic_exchange_n(&trace->arrival_hardware_ns, 0, __ATOMIC_RELAXED);
+    if(arrival == 0 || (packet->type != ACK && packet->type != NACK))
+        return;
+
+    pthread_mutex_lock(&trace->lock);
+    latency_frame_t *frame = &trace->frames[packet->sequence];
+    if(!frame->pending || frame->driver_ns == 0)
+    {
+        pthread_mutex_unlock(&trace->lock);
+        return;
+    }
+    frame->pending = false;
+    if(frame->sent_again)
+    {
+        pthread_mutex_unlock(&trace->lock);
+        return;
+    }
+
+    /* The clock of the NIC isn't the one of the system, only the wire uses it */
+    long long scheduled = frame->scheduled_ns != 0 ? frame->scheduled_ns : frame->user_ns;
+    bool hardware = frame->hardware_ns != 0 && arrival_hardware != 0;
+    long long stages[4];
+    stages[0] = scheduled - frame->user_ns;
+    stages[1] = frame->driver_ns - scheduled;
+    stages[2] = hardware ? arrival_hardware - frame->hardware_ns : arrival - frame->driver_ns;
+    stages[3] = now - arrival;
+
+    latency_stats_t *stats = &trace->stats;
+    stats->frames++;
+    stats->hardware = hardware;
+    stats->kernel_ns += stages[0];
+    stats->queueing_ns += stages[1];
+    stats->wire_ns += stages[2];
+    stats->processing_ns += stages[3];
+    if(stages[2] > stats->max_wire_ns)
+        stats->max_wire_ns = stages[2];
+    uint8_t type = frame->type;
+    pthread_mutex_unlock(&trace->lock);
+
+    write_stages(trace, type, packet->sequence, stages, hardware);
+}
+
+void latency_take(int socket, latency_stats_t *stats)
+{
+    memset(stats, 0, sizeof(latency_stats_t));
+    if(!latency_enabled(socket))
+        return;
+
+    latency_socket_t *trace = latency_of(socket);
+    latency_poll(socket);
+    pthread_mutex_lock(&trace->lock);
+    *stats = trace->stats;
+    memset(&trace->stats, 0, sizeof(latency_stats_t));
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void latency_report(int socket, char *label)
+{
+    latency_stats_t stats;
+    latency_take(socket, &stats);
+    if(stats.frames == 0)
+        return;
+
+    double frames = stats.frames;
+    printf("Latency of %s on %s, %llu frames answered (%s): kernel %.1f us, queueing %.1f us, wire %.1f us (max %.1f), processing %.1f us\n",
+           label, latency_of(socket)->name, stats.frames, stats.hardware ? "hardware" : "software",
+           stats.kernel_ns / frames / 1e3, stats.queueing_ns / frames / 1e3, stats.wire_ns / frames / 1e3,
+           stats.max_wire_ns / 1e3, stats.processing_ns / frames / 1e3);
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Timestamps of a socket, NULL if it isn't tracked */
+latency_socket_t *latency_of(int socket)
+{
+    if(socket < 0 || socket >= MAX_SOCKETS)
+        return NULL;
+
+    return &latency_sockets[socket];
+}
+
+/* Turn on the timestamps of the NIC for every frame, like ptp4l does
+   RETURN:
+    - If the driver accepted it
+*/
+bool enable_hardware(int socket, char *device)
+{
+    struct hwtstamp_config config;
+    struct ifreq ir;
+
+    memset(&config, 0, sizeof(config));
+    config.tx_type = HWTSTAMP_TX_ON;
+    config.rx_filter = HWTSTAMP_FILTER_ALL;
+    memset(&ir, 0, sizeof(ir));
+    strncpy(ir.ifr_name, device, IFNAMSIZ - 1);
+    ir.ifr_data = (void *) &config;
+
+    return ioctl(socket, SIOCSHWTSTAMP, &ir) == 0 && config.rx_filter != HWTSTAMP_FILTER_NONE;
+}
+
+/* Take the software and the raw hardware timestamp, and for the error queue the stage */
+void read_timestamps(struct msghdr *msg, long long *software_ns, long long *hardware_ns, int *stage)
+{
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+            struct timespec times[3];
+            memcpy(times, CMSG_DATA(cmsg), sizeof(times));
+            *software_ns = timespec_ns(&times[0]);
+            *hardware_ns = timespec_ns(&times[2]);
+        }
+        else if(cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP)
+        {
+            struct sock_extended_err error;
+            memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+            if(error.ee_errno == ENOMSG && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+                *stage = error.ee_info;
+        }
+    }
+}
+
+/* A line of LATENCY_LOG_ENV for the frame, with the type it was sent with */
+void write_stages(latency_socket_t *trace, uint8_t type, uint8_t sequence, long long *stages, bool hardware)
+{
+    pthread_mutex_lock(&latency_log_lock);
+    if(latency_log != NULL)
+        fprintf(latency_log, "%s,%u,%u,%lld,%lld,%lld,%lld,%d\n", trace->name, type, sequence,
+                stages[0], stages[1], stages[2], stages[3], hardware);
+    pthread_mutex_unlock(&latency_log_lock);
+}
+
+long long timespec_ns(struct timespec *time)
+{
+    return time->tv_sec * 1000000000LL + time->tv_nsec;
+}
+
+/* The timestamps of the kernel are of the real clock */
+long long latency_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return timespec_ns(&now);
+}
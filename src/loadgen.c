@@ -0,0 +1,414 @@
+#include "../lib/connection.h"
+#include "../lib/command.h"
+#include "../lib/utils.h"
+#include "../lib/session.h"
+#include <pthread.h>
+
+/* Load on the server from many simulated clients, with the protocol code of the client.
+   The frames carry no address, so each interface is one link: the clients of the same
+   interface take turns, and the server answers the interfaces at the same time.
+   With -a one thread drives every link with the sessions that don't block, one per
+   link, and the aborts are downloads.
+   Usage: loadgen [-a] [-n clients] [-d seconds] [-m list=40,download=50,abort=10] <interface>...
+*/
+#define LOAD_LIST 0
+#define LOAD_DOWNLOAD 1
+#define LOAD_ABORT 2
+#define LOAD_OPERATIONS 3
+#define LOAD_MAX_LINKS 16
+#define LOAD_ABORT_FRAMES 200 // An abort stops the download after at most this many frames
+#define LOAD_DRAIN_MS 200 // Quiet time after an abort before the next request
+
+const char *load_names[LOAD_OPERATIONS] = { "list", "download", "abort" };
+
+/* Interface shared by some of the clients */
+typedef struct load_link {
+    char *name;
+    int socket;
+    pthread_mutex_t lock;
+    char (*videos)[DATA_SIZE];
+    int video_quantity;
+} load_link_t;
+
+/* Latencies of one kind of request, in milliseconds */
+typedef struct load_samples {
+    double *latency;
+    long long quantity;
+    long long size;
+    long long errors;
+    long long bytes;
+    pthread_mutex_t lock;
+} load_samples_t;
+
+/* One simulated client */
+typedef struct load_client {
+    load_link_t *link;
+    unsigned int seed;
+    int null_fd;
+} load_client_t;
+
+/* Link of the mode with sessions, its requests follow each other in the callbacks */
+typedef struct load_session {
+    load_link_t *link;
+    unsigned int seed;
+    int operation;
+    double start;
+    int null_fd;
+    char (*videos)[DATA_SIZE];
+} load_session_t;
+
+load_samples_t samples[LOAD_OPERATIONS];
+int mix[LOAD_OPERATIONS] = { 40, 50, 10 };
+double load_end = 0, link_wait_ms = 0;
+long long link_waits = 0;
+pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Monotonic time in seconds */
+double load_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Keep the result of a request */
+void record(int operation, double latency_ms, bool failed, long long bytes)
+{
+    load_samples_t *sample = &samples[operation];
+    pthread_mutex_lock(&sample->lock);
+    if(!failed && sample->quantity == sample->size)
+    {
+        double *bigger = realloc(sample->latency, (2 * sample->size + 256) * sizeof(double));
+        if(bigger != NULL)
+        {
+            sample->latency = bigger;
+            sample->size = 2 * sample->size + 256;
+        }
+    }
+    if(failed)
+        sample->errors++;
+    else if(sample->quantity < sample->size)
+        sample->latency[sample->quantity++] = latency_ms;
+    sample->bytes += bytes;
+    pthread_mutex_unlock(&sample->lock);
+}
+
+/* Kind of the next request, with the mix. Without the names of the videos it is a list. */
+int pick_operation(unsigned int *seed, int video_quantity)
+{
+    int total = mix[LOAD_LIST] + mix[LOAD_DOWNLOAD] + mix[LOAD_ABORT];
+    int pick = rand_r(seed) % total, operation = LOAD_LIST;
+    while(pick >= mix[operation])
+        pick -= mix[operation++];
+    return video_quantity == 0 ? LOAD_LIST : operation;
+}
+
+/* DOWNLOAD handshake of the client up to the first DATA frame
+   RETURN:
+    - The size of the video
+    - -1 if the server refused it or stopped answering
+*/
+long long start_download(char *name, packet_t *p, int socket)
+{
+    create_or_modify_packet(p, strlen(name), 0, DOWNLOAD, name);
+    if(send_packet_stop_wait(p, p, TIMEOUT, socket) != 0 || p->type == ERROR)
+        return -1;
+    if(p->type != DESCRIPTOR && (listen_for_packet(p, TIMEOUT, socket) != 0 || p->type != DESCRIPTOR))
+        return -1;
+
+    long long size = 0;
+    for(int i = 0; i < 4; i++)
+        size |= ((long long) p->data[i]) << (i * 8);
+
+    create_or_modify_packet(p, 0, 0, ACK, NULL);
+    send_packet(p, socket);
+    return size;
+}
+
+/* Take some frames of the transfer, then give it up with an ERROR
+   RETURN:
+    - The bytes received
+    - -1 if the server stopped sending
+*/
+long long abort_download(int frames, packet_t *p, int socket)
+{
+    uint8_t ack_data[DATA_SIZE] = { WINDOW_SIZE };
+    packet_t response;
+    long long bytes = 0;
+
+    for(int received = 0; received < frames; )
+    {
+        if(listen_for_packet(p, TIMEOUT, socket) != 0)
+            return -1;
+        if(p->type == END_TRANSMISSION)
+            break;
+        if(p->type != DATA || p->sequence != received % (MAX_SEQUENCE + 1))
+            continue;
+        create_or_modify_packet(&response, 1, p->sequence, ACK, ack_data);
+        send_packet(&response, socket);
+        bytes += p->size;
+        received++;
+    }
+
+    create_or_modify_packet(&response, MAX_DATA_SIZE, 0, ERROR, "Aborted");
+    send_packet(&response, socket);
+    while(listen_for_packet_ms(p, LOAD_DRAIN_MS, socket) == 0); // Frames already in flight
+
+    return bytes;
+}
+
+/* Requests of a client, with the mix, until the end of the run */
+void *run_client(void *arg)
+{
+    load_client_t *client = arg;
+    load_link_t *link = client->link;
+    packet_t *p = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    char (*videos)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+
+    while(videos != NULL && load_now() < load_end)
+    {
+        int operation = pick_operation(&client->seed, link->video_quantity);
+
+        double asked = load_now();
+        pthread_mutex_lock(&link->lock);
+        double start = load_now();
+
+        long long bytes = 0;
+        bool failed = false;
+        if(operation == LOAD_LIST)
+        {
+            int quantity = list_remote_videos(videos, MAX_LIST_SIZE, link->socket);
+            failed = quantity < 0;
+            if(quantity > 0 && link->video_quantity == 0)
+            {
+                memcpy(link->videos, videos, quantity * DATA_SIZE);
+                link->video_quantity = quantity;
+            }
+        }
+        else
+        {
+            char *name = link->videos[rand_r(&client->seed) % link->video_quantity];
+            long long size = start_download(name, p, link->socket);
+            failed = size < 0;
+            if(!failed && operation == LOAD_DOWNLOAD)
+            {
+                failed = receive_stream(client->null_fd, 0, NULL, size, NULL, NULL, NULL, link->socket) != 0;
+                bytes = failed ? 0 : size;
+            }
+            else if(!failed)
+            {
+                bytes = abort_download(1 + rand_r(&client->seed) % LOAD_ABORT_FRAMES, p, link->socket);
+                failed = bytes < 0;
+                bytes = failed ? 0 : bytes;
+            }
+        }
+
+        double end = load_now();
+        pthread_mutex_unlock(&link->lock);
+        record(operation, (end - start) * 1000, failed, bytes);
+
+        pthread_mutex_lock(&wait_lock);
+        link_wait_ms += (start - asked) * 1000;
+        link_waits++;
+        pthread_mutex_unlock(&wait_lock);
+    }
+
+    free(videos);
+    destroy_packet(p);
+    return NULL;
+}
+
+/* Start the next request of a session */
+void next_request(load_session_t *load, session_t *session);
+
+/* Keep the result and start the next request, until the end of the run */
+void request_done(session_t *session, int result, void *context)
+{
+    load_session_t *load = context;
+    load_link_t *link = load->link;
+    double end = load_now();
+
+    if(load->operation == LOAD_LIST && result > 0 && link->video_quantity == 0)
+    {
+        memcpy(link->videos, load->videos, result * DATA_SIZE);
+        link->video_quantity = result;
+    }
+    long long bytes = load->operation == LOAD_DOWNLOAD && result == 0 ? (long long) session->file_size : 0;
+    record(load->operation, (end - load->start) * 1000, result < 0, bytes);
+
+    if(end < load_end)
+        next_request(load, session);
+}
+
+void next_request(load_session_t *load, session_t *session)
+{
+    load_link_t *link = load->link;
+    load->operation = pick_operation(&load->seed, link->video_quantity);
+    if(load->operation == LOAD_ABORT)
+        load->operation = LOAD_DOWNLOAD;
+
+    load->start = load_now();
+    if(load->operation == LOAD_LIST)
+        session_list(session, load->videos, MAX_LIST_SIZE, request_done, load);
+    else
+        session_download(session, link->videos[rand_r(&load->seed) % link->video_quantity], load->null_fd, request_done, load);
+}
+
+/* Every link in this thread, each with a session
+   RETURN:
+    - 0 if the run ended
+    - -1 if the loop couldn't start
+*/
+int run_sessions(load_link_t *link, int links, int null_fd)
+{
+    session_loop_t loop;
+    load_session_t load[LOAD_MAX_LINKS];
+    if(session_loop_init(&loop) != 0)
+        return -1;
+
+    for(int i = 0; i < links; i++)
+    {
+        load[i] = (load_session_t) { &link[i], 1234 + i, LOAD_LIST, 0, null_fd, calloc(MAX_LIST_SIZE, DATA_SIZE) };
+        session_t *session = session_open(&loop, link[i].socket);
+        if(session == NULL || load[i].videos == NULL)
+            return -1;
+        next_request(&load[i], session);
+    }
+    session_loop_run(&loop);
+
+    for(int i = 0; i < links; i++)
+        free(load[i].videos);
+    session_loop_destroy(&loop);
+    return 0;
+}
+
+int compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Mix of the requests, like "list=40,download=50,abort=10" */
+int parse_mix(char *text)
+{
+    int parsed[LOAD_OPERATIONS] = {0};
+    char *saveptr, *item = strtok_r(text, ",", &saveptr);
+
+    for(; item != NULL; item = strtok_r(NULL, ",", &saveptr))
+    {
+        char *value = strchr(item, '=');
+        int operation = 0;
+        if(value == NULL)
+            return -1;
+        *value++ = '\0';
+        while(operation < LOAD_OPERATIONS && strcmp(item, load_names[operation]) != 0)
+            operation++;
+        if(operation == LOAD_OPERATIONS || atoi(value) < 0)
+            return -1;
+        parsed[operation] = atoi(value);
+    }
+
+    if(parsed[LOAD_LIST] + parsed[LOAD_DOWNLOAD] + parsed[LOAD_ABORT] == 0)
+        return -1;
+    memcpy(mix, parsed, sizeof(mix));
+    return 0;
+}
+
+/* Latency percentiles of each kind of request, throughput and errors */
+void print_report(double elapsed, int clients, int links)
+{
+    long long requests = 0, errors = 0, bytes = 0;
+
+    printf("%d clients on %d links for %.1f s\n", clients, links, elapsed);
+    printf("%-9s %9s %7s %9s %9s %9s %9s\n", "request", "done", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for(int i = 0; i < LOAD_OPERATIONS; i++)
+    {
+        load_samples_t *sample = &samples[i];
+        requests += sample->quantity + sample->errors;
+        errors += sample->errors;
+        bytes += sample->bytes;
+        if(sample->quantity == 0)
+        {
+            printf("%-9s %9lld %7lld\n", load_names[i], sample->quantity, sample->errors);
+            continue;
+        }
+
+        qsort(sample->latency, sample->quantity, sizeof(double), compare_latency);
+        printf("%-9s %9lld %7lld %9.1f %9.1f %9.1f %9.1f\n", load_names[i], sample->quantity, sample->errors,
+               sample->latency[sample->quantity / 2], sample->latency[sample->quantity * 9 / 10],
+               sample->latency[sample->quantity * 99 / 100], sample->latency[sample->quantity - 1]);
+    }
+
+    printf("%.1f requests/s, %.2f MB/s of video, %.2f%% errors, %.1f ms average wait for the link\n",
+           requests / elapsed, bytes / elapsed / 1e6, requests > 0 ? 100.0 * errors / requests : 0,
+           link_waits > 0 ? link_wait_ms / link_waits : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    int clients = 0, seconds = 10, option;
+    bool asynchronous = false;
+    while((option = getopt(argc, argv, "an:d:m:")) != -1)
+    {
+        if(option == 'a')
+            asynchronous = true;
+        else if(option == 'n')
+            clients = atoi(optarg);
+        else if(option == 'd')
+            seconds = atoi(optarg);
+        else if(option != 'm' || parse_mix(optarg) != 0)
+            optind = argc + 1; // Usage
+    }
+    int links = argc - optind;
+    if(links <= 0 || links > LOAD_MAX_LINKS || seconds <= 0 || clients < 0)
+    {
+        fprintf(stderr, "Usage: %s [-a] [-n clients] [-d seconds] [-m list=40,download=50,abort=10] <interface>...\n", argv[0]);
+        return 1;
+    }
+    if(clients == 0 || asynchronous)
+        clients = links;
+
+    load_link_t link[LOAD_MAX_LINKS];
+    for(int i = 0; i < links; i++)
+    {
+        link[i].name = argv[optind + i];
+        link[i].socket = create_socket(link[i].name);
+        link[i].videos = calloc(MAX_LIST_SIZE, DATA_SIZE);
+        link[i].video_quantity = 0;
+        pthread_mutex_init(&link[i].lock, NULL);
+        if(link[i].socket < 0 || link[i].videos == NULL)
+            return 1;
+    }
+    for(int i = 0; i < LOAD_OPERATIONS; i++)
+        pthread_mutex_init(&samples[i].lock, NULL);
+
+    load_client_t *client = calloc(clients, sizeof(load_client_t));
+    pthread_t *thread = calloc(clients, sizeof(pthread_t));
+    int null_fd = open("/dev/null", O_WRONLY);
+    if(client == NULL || thread == NULL || null_fd == -1)
+        return 1;
+
+    /* The output of the receive path would hide the report */
+    fflush(stdout);
+    int report_fd = dup(STDOUT_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+
+    double start = load_now();
+    load_end = start + seconds;
+    if(asynchronous && run_sessions(link, links, null_fd) != 0)
+        return 1;
+    for(int i = 0; i < clients && !asynchronous; i++)
+    {
+        client[i] = (load_client_t) { &link[i % links], 1234 + i, null_fd };
+        pthread_create(&thread[i], NULL, run_client, &client[i]);
+    }
+    for(int i = 0; i < clients && !asynchronous; i++)
+        pthread_join(thread[i], NULL);
+    double elapsed = load_now() - start;
+
+    fflush(stdout);
+    dup2(report_fd, STDOUT_FILENO);
+    print_report(elapsed, clients, links);
+
+    return 0;
+}
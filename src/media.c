@@ -0,0 +1,373 @@
+#include "../lib/media.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+
+#define MAX_MEDIA_UNITS 4096
+
+/* Top level element of a container, media units go after the others */
+typedef struct media_unit {
+    long long offset;
+    long long length;
+    bool media;
+} media_unit_t;
+
+/* Layout of a version of a video, parsed once */
+typedef struct layout_entry {
+    char name[DATA_SIZE];
+    time_t mtime;
+    long long size;
+    media_layout_t layout;
+} layout_entry_t;
+
+/* Layouts parsed by the server, the interfaces share them */
+layout_entry_t layout_entries[MAX_LAYOUT_CACHE];
+int layout_quantity = 0, layout_next = 0;
+pthread_mutex_t layout_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Auxiliary Functions */
+void build_layout(media_unit_t *units, int quantity, long long file_size, media_layout_t *layout);
+int parse_mp4(FILE *file, long long file_size, media_unit_t *units);
+int parse_mkv(FILE *file, long long file_size, media_unit_t *units);
+int read_vint(FILE *file, long long *value, bool keep_marker);
+long long find_segment(media_layout_t *layout, long long position, long long *file_offset);
+
+
+/* *** Main Functions *** */
+
+/* Layout of a video with the index of the container first and the media data
+   after it in playback order. Files that already start with the index, or
+   that can't be parsed, keep the file order.
+*/
+void media_layout(char *file_name, media_layout_t *layout)
+{
+    memset(layout, 0, sizeof(media_layout_t));
+
+    struct stat file_stat;
+    if(stat(file_name, &file_stat) != 0 || file_stat.st_size > UINT32_MAX)
+        return;
+
+    pthread_mutex_lock(&layout_lock);
+    for(int i = 0; i < layout_quantity; i++)
+    {
+        if(strcmp(layout_entries[i].name, file_name) == 0 && layout_entries[i].mtime == file_stat.st_mtime &&
+           layout_entries[i].size == file_stat.st_size)
+        {
+            *layout = layout_entries[i].layout;
+            pthread_mutex_unlock(&layout_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&layout_lock);
+
+    FILE *file = fopen(file_name, "rb");
+    media_unit_t *units = malloc(MAX_MEDIA_UNITS * sizeof(media_unit_t));
+    if(file != NULL && units != NULL)
+    {
+        int quantity = parse_mp4(file, file_stat.st_size, units);
+        if(quantity < 0)
+            quantity = parse_mkv(file, file_stat.st_size, units);
+        if(quantity > 0)
+            build_layout(units, quantity, file_stat.st_size, layout);
+    }
+    if(file != NULL)
+        fclose(file);
+    free(units);
+
+    /* Remember it, replacing the oldest entry when the table is full */
+    pthread_mutex_lock(&layout_lock);
+    layout_entry_t *entry = &layout_entries[layout_next];
+    layout_next = (layout_next + 1) % MAX_LAYOUT_CACHE;
+    if(layout_quantity < MAX_LAYOUT_CACHE)
+        layout_quantity++;
+    strncpy(entry->name, file_name, MAX_FILE_NAME_SIZE);
+    entry->name[MAX_FILE_NAME_SIZE] = '\0';
+    entry->mtime = file_stat.st_mtime;
+    entry->size = file_stat.st_size;
+    entry->layout = *layout;
+    pthread_mutex_unlock(&layout_lock);
+
+    if(layout->quantity > 0)
+        printf("%s: index sent before the media data\n", file_name);
+}
+
+/* Put the layout in the data of a DESCRIPTOR, from LAYOUT_OFFSET */
+void media_pack_layout(uint8_t *data, media_layout_t *layout)
+{
+    data[LAYOUT_OFFSET] = layout->quantity;
+    for(int i = 0; i < layout->quantity; i++)
+    {
+        memcpy(data + LAYOUT_OFFSET + 1 + i * 8, &layout->offset[i], sizeof(uint32_t));
+        memcpy(data + LAYOUT_OFFSET + 5 + i * 8, &layout->length[i], sizeof(uint32_t));
+    }
+}
+
+/* Take the layout from the data of a DESCRIPTOR, servers without it send zeros */
+void media_unpack_layout(uint8_t *data, media_layout_t *layout)
+{
+    memset(layout, 0, sizeof(media_layout_t));
+    if(data[LAYOUT_OFFSET] > MAX_LAYOUT_SEGMENTS)
+        return;
+
+    layout->quantity = data[LAYOUT_OFFSET];
+    for(int i = 0; i < layout->quantity; i++)
+    {
+        memcpy(&layout->offset[i], data + LAYOUT_OFFSET + 1 + i * 8, sizeof(uint32_t));
+        memcpy(&layout->length[i], data + LAYOUT_OFFSET + 5 + i * 8, sizeof(uint32_t));
+    }
+}
+
+/* Read the bytes of the stream from position, seeking at the start of each segment
+   RETURN:
+    - The quantity of bytes read
+*/
+size_t media_read(FILE *file, media_layout_t *layout, long long position, uint8_t *buffer, size_t size)
+{
+    if(layout == NULL || layout->quantity == 0)
+        return fread(buffer, 1, size, file);
+
+    size_t done = 0;
+    long long file_offset;
+    while(done < size)
+    {
+        long long available = find_segment(layout, position, &file_offset);
+        if(available <= 0 || (ftell(file) != file_offset && fseek(file, file_offset, SEEK_SET) != 0))
+            break;
+
+        size_t length = size - done < (size_t) available ? size - done : (size_t) available;
+        size_t read_bytes = fread(buffer + done, 1, length, file);
+        done += read_bytes;
+        position += read_bytes;
+        if(read_bytes < length)
+            break;
+    }
+
+    return done;
+}
+
+/* Write the bytes of the stream from position at their offsets in the file
+   RETURN:
+    - size if every byte was written
+    - -1 if an error occurred
+*/
+ssize_t media_pwrite(int fd, media_layout_t *layout, uint8_t *buffer, size_t size, long long position)
+{
+    if(layout == NULL || layout->quantity == 0)
+        return pwrite(fd, buffer, size, position);
+
+    size_t done = 0;
+    long long file_offset;
+    while(done < size)
+    {
+        long long available = find_segment(layout, position, &file_offset);
+        if(available <= 0)
+            return -1;
+
+        size_t length = size - done < (size_t) available ? size - done : (size_t) available;
+        if(pwrite(fd, buffer + done, length, file_offset) != (ssize_t) length)
+            return -1;
+        done += length;
+        position += length;
+    }
+
+    return size;
+}
+
+/* The media data is the last segment, the ones before it have the index */
+size_t media_index_bytes(media_layout_t *layout)
+{
+    size_t bytes = 0;
+    for(int i = 0; layout != NULL && i < layout->quantity - 1; i++)
+        bytes += layout->length[i];
+
+    return bytes;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Order the units with the media last, merging the neighbours in the file */
+void build_layout(media_unit_t *units, int quantity, long long file_size, media_layout_t *layout)
+{
+    media_layout_t ordered;
+    long long covered = 0;
+    bool reordered = false, media_seen = false;
+    memset(&ordered, 0, sizeof(media_layout_t));
+
+    /* Only an index after the media data needs a new order */
+    for(int i = 0; i < quantity; i++)
+    {
+        if(units[i].media)
+            media_seen = true;
+        else if(media_seen)
+            reordered = true;
+    }
+    if(!reordered)
+        return;
+
+    for(int pass = 0; pass < 2; pass++) // Index first, then media
+    {
+        for(int i = 0; i < quantity; i++)
+        {
+            if(units[i].media != (pass == 1))
+                continue;
+            covered += units[i].length;
+
+            int last = ordered.quantity - 1;
+            if(last >= 0 && ordered.offset[last] + (long long) ordered.length[last] == units[i].offset)
+            {
+                ordered.length[last] += units[i].length;
+                continue;
+            }
+            if(ordered.quantity == MAX_LAYOUT_SEGMENTS)
+                return; // Too fragmented, the file order is kept
+            ordered.offset[ordered.quantity] = units[i].offset;
+            ordered.length[ordered.quantity] = units[i].length;
+            ordered.quantity++;
+        }
+    }
+
+    if(covered == file_size)
+        *layout = ordered;
+}
+
+/* Top level boxes of an MP4, mdat is media
+   RETURN:
+    - The quantity of units
+    - -1 if it isn't an MP4
+*/
+int parse_mp4(FILE *file, long long file_size, media_unit_t *units)
+{
+    uint8_t header[16];
+    long long offset = 0;
+    int quantity = 0;
+
+    while(offset < file_size)
+    {
+        if(quantity == MAX_MEDIA_UNITS || fseek(file, offset, SEEK_SET) != 0 || fread(header, 1, 8, file) != 8)
+            return -1;
+        if(offset == 0 && memcmp(header + 4, "ftyp", 4) != 0)
+            return -1;
+
+        long long size = ((long long) header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+        if(size == 1) // 64 bits size after the type
+        {
+            if(fread(header + 8, 1, 8, file) != 8)
+                return -1;
+            size = 0;
+            for(int i = 8; i < 16; i++)
+                size = (size << 8) | header[i];
+        }
+        else if(size == 0) // Until the end of the file
+            size = file_size - offset;
+
+        if(size < 8 || size > file_size - offset)
+            return -1;
+
+        units[quantity].offset = offset;
+        units[quantity].length = size;
+        units[quantity].media = memcmp(header + 4, "mdat", 4) == 0;
+        quantity++;
+        offset += size;
+    }
+
+    return quantity;
+}
+
+/* Top level elements of an MKV and the children of its Segment, clusters are media
+   RETURN:
+    - The quantity of units
+    - -1 if it isn't an MKV
+*/
+int parse_mkv(FILE *file, long long file_size, media_unit_t *units)
+{
+    long long id, size, offset = 0;
+    int quantity = 0;
+
+    while(offset < file_size)
+    {
+        if(quantity == MAX_MEDIA_UNITS || fseek(file, offset, SEEK_SET) != 0)
+            return -1;
+        int id_length = read_vint(file, &id, true);
+        int size_length = read_vint(file, &size, false);
+        if(id_length < 0 || size_length < 0 || (offset == 0 && id != 0x1A45DFA3))
+            return -1;
+        long long header = id_length + size_length;
+
+        if(id == 0x18538067) // Segment: its header, then its children
+        {
+            long long end = size < 0 ? file_size : offset + header + size;
+            units[quantity++] = (media_unit_t) { offset, header, false };
+            offset += header;
+            while(offset < end)
+            {
+                if(quantity == MAX_MEDIA_UNITS || fseek(file, offset, SEEK_SET) != 0)
+                    return -1;
+                id_length = read_vint(file, &id, true);
+                size_length = read_vint(file, &size, false);
+                if(id_length < 0 || size_length < 0 || size < 0 || offset + id_length + size_length + size > end)
+                    return -1; // Unknown sizes can't be skipped
+                long long length = id_length + size_length + size;
+                units[quantity++] = (media_unit_t) { offset, length, id == 0x1F43B675 };
+                offset += length;
+            }
+            continue;
+        }
+
+        if(size < 0 || offset + header + size > file_size)
+            return -1;
+        units[quantity++] = (media_unit_t) { offset, header + size, false };
+        offset += header + size;
+    }
+
+    return quantity;
+}
+
+/* Read an EBML variable length number, IDs keep the length marker
+   RETURN:
+    - The length in bytes, value is -1 for an unknown size
+    - -1 if it's invalid
+*/
+int read_vint(FILE *file, long long *value, bool keep_marker)
+{
+    int first = fgetc(file);
+    if(first == EOF || first == 0)
+        return -1;
+
+    int length = 1;
+    while(!(first & (0x80 >> (length - 1))))
+        length++;
+
+    long long result = keep_marker ? first : first & (0xFF >> length);
+    bool unknown = result == (0xFF >> length);
+    for(int i = 1; i < length; i++)
+    {
+        int byte = fgetc(file);
+        if(byte == EOF)
+            return -1;
+        result = (result << 8) | byte;
+        unknown &= byte == 0xFF;
+    }
+
+    *value = (!keep_marker && unknown) ? -1 : result;
+    return length;
+}
+
+/* Segment of the layout with the byte of the stream at position
+   RETURN:
+    - Bytes left in the segment from position, file_offset has its offset in the file
+    - 0 if position is after the end
+*/
+long long find_segment(media_layout_t *layout, long long position, long long *file_offset)
+{
+    long long start = 0;
+    for(int i = 0; i < layout->quantity; i++)
+    {
+        if(position < start + layout->length[i])
+        {
+            *file_offset = layout->offset[i] + (position - start);
+            return start + layout->length[i] - position;
+        }
+        start += layout->length[i];
+    }
+
+    return 0;
+}
@@ -0,0 +1,509 @@
+#include "../lib/multicast.h"
+#include "../lib/utils.h"
+#include "../lib/pacing.h"
+
+/* Multicast transfer in the server */
+typedef struct group {
+    char *file_name;
+    int fd;
+    long long file_size;
+    uint32_t frames_quantity;
+    uint32_t nonces[MAX_GROUP_MEMBERS]; // The index is the member id
+    bool done[MAX_GROUP_MEMBERS];
+    int members;
+    uint8_t *requested; // Frames asked again in the current round
+    long long frames_sent;
+    pacer_t pacer;
+} group_t;
+
+/* Multicast transfer in the client */
+typedef struct group_receiver {
+    int fd;
+    long long file_size;
+    uint32_t frames_quantity;
+    uint32_t frames_received;
+    uint8_t *received;
+    uint32_t nack_start[MAX_NACK_RANGES]; // NACK waiting its random backoff
+    uint32_t nack_quantity[MAX_NACK_RANGES];
+    int nack_ranges;
+    long long nack_time; // When the NACK goes, 0 if there is none
+    long long nacks_sent, nacks_suppressed;
+} group_receiver_t;
+
+/* Auxiliary Functions */
+void add_member(group_t *group, packet_t *join, packet_t *p, int socket);
+void send_group_frame(group_t *group, uint32_t index, packet_t *p);
+bool group_done(group_t *group);
+int request_join(char *file_name, uint32_t nonce, uint8_t *member, long long *file_size, int socket);
+int receive_group(group_receiver_t *receiver, char *file_name, uint8_t member, int socket);
+void store_group_frame(group_receiver_t *receiver, packet_t *buffer);
+void plan_nack(group_receiver_t *receiver);
+void suppress_nack(group_receiver_t *receiver, packet_t *nack);
+void send_nack(group_receiver_t *receiver, packet_t *p, int socket);
+void send_group_done(uint8_t member, packet_t *p, int socket);
+
+
+/* *** Main Functions *** */
+
+/* Gather the clients that want the same video, send every frame once to all of them
+   and then retransmit only the frames some client asked again, round by round.
+   RETURN:
+    0 if every client has the video
+    ERR_FILE if the video doesn't exist
+    ERR_GROUP if some client stopped answering
+*/
+int serve_group(packet_t *join, int socket)
+{
+    if(join->size <= GROUP_NONCE_SIZE)
+        return ERR_GROUP;
+
+    group_t group;
+    memset(&group, 0, sizeof(group_t));
+    group.file_name = convert_to_string(join->data + GROUP_NONCE_SIZE, join->size - GROUP_NONCE_SIZE);
+
+    packet_t *p = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    group.fd = open(group.file_name, O_RDONLY);
+    if(group.fd == -1)
+    {
+        print_log("Video doesn't exists!");
+        create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "Video doesn't exists");
+        send_packet(p, socket);
+        destroy_packet(p);
+        free(group.file_name);
+        return ERR_FILE;
+    }
+    group.file_size = get_file_size(group.file_name);
+    group.frames_quantity = ceil((double) group.file_size / (double) GROUP_PAYLOAD_SIZE);
+    group.requested = calloc(group.frames_quantity + 1, sizeof(uint8_t));
+
+    pacer_init(&group.pacer, socket);
+    add_member(&group, join, p, socket);
+
+    /* Other clients asking for the same video join before the first frame */
+    packet_t buffer;
+    long long deadline = get_time_ms() + get_env_number(GROUP_WAIT_ENV, GROUP_WAIT_MS);
+    while(get_time_ms() < deadline)
+        if(listen_for_packet_ms(&buffer, deadline - get_time_ms(), socket) == 0 && buffer.type == JOIN_GROUP)
+            add_member(&group, &buffer, p, socket);
+
+    printf("Sending %s to %d clients at once\n", group.file_name, group.members);
+    for(uint32_t i = 0; i < group.frames_quantity; i++)
+        send_group_frame(&group, i, p);
+
+    /* Repair rounds: GROUP_END, then the frames asked by the NACKs */
+    int quiet_rounds = 0;
+    while(quiet_rounds < MAX_QUIET_ROUNDS && !group_done(&group))
+    {
+        uint8_t end_data[DATA_SIZE] = {0};
+        memcpy(end_data, &group.frames_quantity, sizeof(uint32_t));
+        memcpy(end_data + sizeof(uint32_t), &group.file_size, sizeof(long long));
+        create_or_modify_packet(p, sizeof(uint32_t) + sizeof(long long), 0, GROUP_END, end_data);
+        send_packet(p, socket);
+
+        bool answered = false;
+        deadline = get_time_ms() + GROUP_ROUND_MS;
+        while(get_time_ms() < deadline && !group_done(&group))
+        {
+            if(listen_for_packet_ms(&buffer, deadline - get_time_ms(), socket) != 0)
+                continue;
+
+            if(buffer.type == GROUP_NACK)
+            {
+                replace_bytes_client(buffer.data, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+                replace_bytes_client(buffer.data, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+                for(int r = 0; r + 1 <= buffer.size / NACK_RANGE_SIZE; r++)
+                {
+                    uint32_t start, quantity;
+                    memcpy(&start, buffer.data + r * NACK_RANGE_SIZE, sizeof(uint32_t));
+                    memcpy(&quantity, buffer.data + r * NACK_RANGE_SIZE + 4, sizeof(uint32_t));
+                    for(uint32_t i = start; i < group.frames_quantity && i - start < quantity; i++)
+                        group.requested[i] = 1;
+                }
+                answered = true;
+            }
+            else if(buffer.type == GROUP_DONE && buffer.size >= 1 && buffer.data[0] < group.members)
+            {
+                uint8_t done_data[DATA_SIZE] = {0};
+                done_data[0] = buffer.data[0]; // The member finds its ACK, a repeated GROUP_DONE gets it again
+                group.done[buffer.data[0]] = true;
+                answered = true;
+                create_or_modify_packet(p, 1, 0, ACK, done_data);
+                send_packet(p, socket);
+            }
+            else if(buffer.type == JOIN_GROUP) // Late clients ask the whole video in their NACK
+            {
+                add_member(&group, &buffer, p, socket);
+                answered = true;
+            }
+        }
+
+        quiet_rounds = answered ? 0 : quiet_rounds + 1;
+
+        for(uint32_t i = 0; i < group.frames_quantity; i++)
+        {
+            if(group.requested[i])
+            {
+                send_group_frame(&group, i, p);
+                group.requested[i] = 0;
+            }
+        }
+    }
+
+    int result = group_done(&group) ? 0 : ERR_GROUP;
+    printf("%s: %lld frames sent for %d clients, unicast would send %lld\n", group.file_name,
+           group.frames_sent, group.members, (long long) group.frames_quantity * group.members);
+    if(result != 0)
+        print_log("Some clients of the group stopped answering!");
+
+    close(group.fd);
+    free(group.requested);
+    free(group.file_name);
+    destroy_packet(p);
+
+    return result;
+}
+
+/* Join the multicast transfer of a video. Lost frames are asked in a NACK after a
+   random wait, and a client that hears another NACK with the same frames keeps quiet.
+   RETURN:
+    0 if the video was received
+    -1 if an error occurred
+*/
+int join_group(char *file_name, int socket)
+{
+    if(strlen(file_name) > MAX_GROUP_NAME_SIZE)
+    {
+        fprintf(stderr, "ERROR: names up to %d characters!\n", MAX_GROUP_NAME_SIZE);
+        return -1;
+    }
+
+    srand(time(NULL) ^ getpid());
+    uint32_t nonce = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+    uint8_t member;
+
+    group_receiver_t receiver;
+    memset(&receiver, 0, sizeof(group_receiver_t));
+
+    if(request_join(file_name, nonce, &member, &receiver.file_size, socket) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't join the transfer of %s!\n", file_name);
+        return -1;
+    }
+
+    if(can_download_file(receiver.file_size) == 0)
+    {
+        printf("The file couldn't be downloaded, size is greater than the free space in disk!\n");
+        return -1;
+    }
+
+    receiver.fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(receiver.fd == -1 || ftruncate(receiver.fd, receiver.file_size) != 0)
+    {
+        fprintf(stderr, "Error opening the file");
+        if(receiver.fd != -1)
+            close(receiver.fd);
+        return -1;
+    }
+
+    receiver.frames_quantity = ceil((double) receiver.file_size / (double) GROUP_PAYLOAD_SIZE);
+    receiver.received = calloc(receiver.frames_quantity + 1, sizeof(uint8_t));
+
+    int result = receive_group(&receiver, file_name, member, socket);
+
+    printf("\n%lld NACKs sent, %lld suppressed by other clients\n", receiver.nacks_sent, receiver.nacks_suppressed);
+    close(receiver.fd);
+    free(receiver.received);
+
+    return result;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Answer a JOIN_GROUP with the member id and the size of the video */
+void add_member(group_t *group, packet_t *join, packet_t *p, int socket)
+{
+    uint32_t nonce;
+    memcpy(&nonce, join->data, sizeof(uint32_t));
+
+    size_t name_size = join->size > GROUP_NONCE_SIZE ? join->size - GROUP_NONCE_SIZE : 0;
+    if(name_size != strlen(group->file_name) || memcmp(join->data + GROUP_NONCE_SIZE, group->file_name, name_size) != 0)
+        return; // Another video, it waits the next group
+
+    int member = 0;
+    while(member < group->members && group->nonces[member] != nonce) // A repeated JOIN gets the same id
+        member++;
+
+    if(member == group->members)
+    {
+        if(group->members == MAX_GROUP_MEMBERS)
+        {
+            create_or_modify_packet(p, MAX_DATA_SIZE, 0, ERROR, "Group is full");
+            send_packet(p, socket);
+            return;
+        }
+        group->nonces[group->members++] = nonce;
+        printf("Client %d joined the transfer of %s\n", member, group->file_name);
+    }
+
+    uint8_t data[DATA_SIZE] = {0};
+    memcpy(data, &nonce, sizeof(uint32_t));
+    data[GROUP_NONCE_SIZE] = member;
+    memcpy(data + GROUP_NONCE_SIZE + 1, &group->file_size, sizeof(long long));
+    replace_bytes_server(data, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+    replace_bytes_server(data, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+    create_or_modify_packet(p, GROUP_NONCE_SIZE + 1 + sizeof(long long), 0, ACK, data);
+    send_packet(p, socket);
+}
+
+/* Send one frame of the video with its index */
+void send_group_frame(group_t *group, uint32_t index, packet_t *p)
+{
+    uint8_t data[DATA_SIZE] = {0};
+    memcpy(data, &index, sizeof(uint32_t));
+
+    ssize_t read_bytes = pread(group->fd, data + GROUP_INDEX_SIZE, GROUP_PAYLOAD_SIZE, (off_t) index * GROUP_PAYLOAD_SIZE);
+    if(read_bytes < 0)
+        read_bytes = 0;
+
+    replace_bytes_server(data, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+    replace_bytes_server(data, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+    create_or_modify_packet(p, GROUP_INDEX_SIZE + read_bytes, 0, GROUP_DATA, data);
+    pacer_send(&group->pacer, p);
+    group->frames_sent++;
+}
+
+/* Every client of the group has the video */
+bool group_done(group_t *group)
+{
+    for(int i = 0; i < group->members; i++)
+        if(!group->done[i])
+            return false;
+    return true;
+}
+
+/* Send JOIN_GROUP until the ACK with the same nonce arrives
+   RETURN:
+    0 if the server accepted the client
+    -1 if an error occurred
+*/
+int request_join(char *file_name, uint32_t nonce, uint8_t *member, long long *file_size, int socket)
+{
+    uint8_t data[DATA_SIZE] = {0};
+    memcpy(data, &nonce, sizeof(uint32_t));
+    memcpy(data + GROUP_NONCE_SIZE, file_name, strlen(file_name));
+
+    packet_t *p = create_or_modify_packet(NULL, GROUP_NONCE_SIZE + strlen(file_name), 0, JOIN_GROUP, data);
+    packet_t buffer;
+    uint32_t answer;
+
+    for(int try = 0; try <= MAX_TRY; try++)
+    {
+        send_packet(p, socket);
+
+        long long deadline = get_time_ms() + TIMEOUT * 1000;
+        while(get_time_ms() < deadline)
+        {
+            if(listen_for_packet_ms(&buffer, deadline - get_time_ms(), socket) != 0)
+                continue;
+
+            if(buffer.type == ERROR)
+            {
+                response_reply(&buffer);
+                destroy_packet(p);
+                return -1;
+            }
+
+            replace_bytes_client(buffer.data, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+            replace_bytes_client(buffer.data, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+            memcpy(&answer, buffer.data, sizeof(uint32_t));
+            if(buffer.type == ACK && buffer.size >= GROUP_NONCE_SIZE + 1 + sizeof(long long) && answer == nonce)
+            {
+                *member = buffer.data[GROUP_NONCE_SIZE];
+                memcpy(file_size, buffer.data + GROUP_NONCE_SIZE + 1, sizeof(long long));
+                destroy_packet(p);
+                return 0;
+            }
+        }
+    }
+
+    destroy_packet(p);
+    return -1;
+}
+
+/* Receive the frames of the group until GROUP_END finds the video complete */
+int receive_group(group_receiver_t *receiver, char *file_name, uint8_t member, int socket)
+{
+    packet_t buffer;
+    packet_t *p = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
+    long long backoff = get_env_number(NACK_BACKOFF_ENV, NACK_BACKOFF_MS);
+    int try = 0;
+
+    while(1)
+    {
+        long long wait = TIMEOUT * 1000;
+        if(receiver->nack_time != 0)
+            wait = receiver->nack_time > get_time_ms() ? receiver->nack_time - get_time_ms() : 0;
+
+        if(listen_for_packet_ms(&buffer, wait, socket) == 0)
+        {
+            if(buffer.type == GROUP_DATA)
+            {
+                try = 0;
+                store_group_frame(receiver, &buffer);
+                printf("\r%s: ", file_name);
+                print_progress(receiver->file_size, receiver->frames_received, GROUP_PAYLOAD_SIZE);
+            }
+            else if(buffer.type == GROUP_END)
+            {
+                try = 0;
+                if(receiver->frames_received == receiver->frames_quantity)
+                    break;
+                if(receiver->nack_time == 0)
+                {
+                    plan_nack(receiver);
+                    receiver->nack_time = get_time_ms() + (backoff > 0 ? rand() % (backoff + 1) : 0);
+                }
+            }
+            else if(buffer.type == GROUP_NACK && receiver->nack_time != 0)
+                suppress_nack(receiver, &buffer);
+        }
+        else if(receiver->nack_time == 0 && ++try > MAX_TRY)
+        {
+            fprintf(stderr, "\nERROR: the server stopped sending %s!\n", file_name);
+            destroy_packet(p);
+            return -1;
+        }
+
+        if(receiver->nack_time != 0 && get_time_ms() >= receiver->nack_time)
+            send_nack(receiver, p, socket);
+    }
+
+    send_group_done(member, p, socket);
+    destroy_packet(p);
+
+    printf("\r%s: ", file_name);
+    print_progress(receiver->file_size, receiver->frames_received, GROUP_PAYLOAD_SIZE);
+    printf("\n%s downloaded!\n", file_name);
+
+    return 0;
+}
+
+/* Write a frame in its place of the file, once */
+void store_group_frame(group_receiver_t *receiver, packet_t *buffer)
+{
+    if(buffer->size < GROUP_INDEX_SIZE)
+        return;
+
+    replace_bytes_client(buffer->data, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+    replace_bytes_client(buffer->data, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+
+    uint32_t index;
+    memcpy(&index, buffer->data, sizeof(uint32_t));
+    if(index >= receiver->frames_quantity || receiver->received[index])
+        return;
+
+    size_t length = buffer->size - GROUP_INDEX_SIZE;
+    if(pwrite(receiver->fd, buffer->data + GROUP_INDEX_SIZE, length, (off_t) index * GROUP_PAYLOAD_SIZE) != (ssize_t) length)
+        return;
+
+    receiver->received[index] = 1;
+    receiver->frames_received++;
+}
+
+/* Gather the first ranges of missing frames */
+void plan_nack(group_receiver_t *receiver)
+{
+    receiver->nack_ranges = 0;
+
+    for(uint32_t i = 0; i < receiver->frames_quantity && receiver->nack_ranges < MAX_NACK_RANGES; i++)
+    {
+        if(receiver->received[i])
+            continue;
+
+        uint32_t start = i;
+        while(i < receiver->frames_quantity && !receiver->received[i])
+            i++;
+
+        receiver->nack_start[receiver->nack_ranges] = start;
+        receiver->nack_quantity[receiver->nack_ranges] = i - start;
+        receiver->nack_ranges++;
+    }
+}
+
+/* Drop the ranges another client already asked */
+void suppress_nack(group_receiver_t *receiver, packet_t *nack)
+{
+    replace_bytes_client(nack->data, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+    replace_bytes_client(nack->data, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+
+    for(int r = 0; r < receiver->nack_ranges; )
+    {
+        bool covered = false;
+        for(int n = 0; n + 1 <= nack->size / NACK_RANGE_SIZE && !covered; n++)
+        {
+            uint32_t start, quantity;
+            memcpy(&start, nack->data + n * NACK_RANGE_SIZE, sizeof(uint32_t));
+            memcpy(&quantity, nack->data + n * NACK_RANGE_SIZE + 4, sizeof(uint32_t));
+            covered = start <= receiver->nack_start[r] &&
+                      (long long) start + quantity >= (long long) receiver->nack_start[r] + receiver->nack_quantity[r];
+        }
+
+        if(covered)
+        {
+            receiver->nack_ranges--;
+            receiver->nack_start[r] = receiver->nack_start[receiver->nack_ranges];
+            receiver->nack_quantity[r] = receiver->nack_quantity[receiver->nack_ranges];
+        }
+        else
+            r++;
+    }
+
+    if(receiver->nack_ranges == 0)
+    {
+        receiver->nack_time = 0;
+        receiver->nacks_suppressed++;
+    }
+}
+
+/* Send the ranges that are still missing */
+void send_nack(group_receiver_t *receiver, packet_t *p, int socket)
+{
+    uint8_t data[DATA_SIZE] = {0};
+
+    for(int r = 0; r < receiver->nack_ranges; r++)
+    {
+        memcpy(data + r * NACK_RANGE_SIZE, &receiver->nack_start[r], sizeof(uint32_t));
+        memcpy(data + r * NACK_RANGE_SIZE + 4, &receiver->nack_quantity[r], sizeof(uint32_t));
+    }
+
+    replace_bytes_server(data, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+    replace_bytes_server(data, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+    create_or_modify_packet(p, receiver->nack_ranges * NACK_RANGE_SIZE, 0, GROUP_NACK, data);
+    send_packet(p, socket);
+
+    receiver->nack_time = 0;
+    receiver->nacks_sent++;
+}
+
+/* Tell the server this client is done. A lost GROUP_DONE brings another GROUP_END,
+   answered again until the ACK of the member arrives or the linger ends. */
+void send_group_done(uint8_t member, packet_t *p, int socket)
+{
+    uint8_t data[DATA_SIZE] = {0};
+    packet_t buffer;
+    data[0] = member;
+    create_or_modify_packet(p, 1, 0, GROUP_DONE, data);
+    send_packet(p, socket);
+
+    long long deadline = get_time_ms() + GROUP_LINGER_MS;
+    while(get_time_ms() < deadline)
+    {
+        if(listen_for_packet_ms(&buffer, deadline - get_time_ms(), socket) != 0)
+            continue;
+
+        if(buffer.type == ACK && buffer.size >= 1 && buffer.data[0] == member)
+            return;
+        if(buffer.type == GROUP_END)
+            send_packet(p, socket);
+    }
+}
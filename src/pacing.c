@@ -0,0 +1,168 @@
+#include "../lib/pacing.h"
+#include "../lib/utils.h"
+#include "../lib/xdp.h"
+#include "../lib/scheduler.h"
+#include <linux/net_tstamp.h>
+#include <pthread.h>
+
+/* Settings and bucket shared by every transfer of the server */
+long long session_rate_kb = 0, server_rate_kb = 0;
+token_bucket_t server_bucket;
+pthread_mutex_t server_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+time_t config_time = 0;
+
+/* Auxiliary Functions */
+void reload_settings();
+void bucket_init(token_bucket_t *bucket, long long rate_kb);
+double bucket_reserve(token_bucket_t *bucket, size_t bytes, long long now);
+long long now_ns();
+
+
+/* *** Main Functions *** */
+
+/* Start the pacing of a transfer with the current settings */
+void pacer_init(pacer_t *pacer, int socket)
+{
+    reload_settings();
+
+    memset(pacer, 0, sizeof(pacer_t));
+    pacer->socket = socket;
+    bucket_init(&pacer->session, session_rate_kb);
+
+    /* AF_XDP frames don't go through the qdisc, scheduled frames leave later */
+    if(get_env_number(PACE_TXTIME_ENV, 0) && xdp_fd(socket) == -1 && !sched_active(socket) && (session_rate_kb > 0 || server_rate_kb > 0))
+    {
+        struct sock_txtime config = { CLOCK_MONOTONIC, 0 };
+        pacer->txtime = setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == 0;
+        if(!pacer->txtime)
+            fprintf(stderr, "SO_TXTIME unavailable, pacing with sleeps\n");
+    }
+}
+
+/* Send a frame when both buckets have its bytes. With SO_TXTIME the frame is
+   given to the kernel with its departure time, otherwise the thread sleeps.
+   RETURN:
+    0 if the frame was sent
+*/
+int pacer_send(pacer_t *pacer, packet_t *packet)
+{
+    if(pacer->session.rate == 0 && server_bucket.rate == 0)
+        return send_packet(packet, pacer->socket);
+
+    long long now = now_ns();
+    double wait = bucket_reserve(&pacer->session, sizeof(packet_t), now);
+
+    /* The scheduler shares the rate of the server between the sessions itself */
+    double server_wait = sched_active(pacer->socket) ? 0 : pacing_server_wait(sizeof(packet_t));
+    if(server_wait > wait)
+        wait = server_wait;
+
+    long long departure = now + (long long)(wait * 1e9);
+
+    if(pacer->txtime)
+    {
+        long long early = departure - now - PACE_HORIZON_US * 1000LL; // The qdisc only holds a short future
+        if(early > 0)
+            nanosleep(&(struct timespec){ early / 1000000000LL, early % 1000000000LL }, NULL);
+        if(send_packet_at(packet, pacer->socket, departure) == 0)
+            return 0;
+        pacer->txtime = false;
+    }
+
+    long long sleep_ns = departure - now_ns();
+    if(sleep_ns > 0)
+        nanosleep(&(struct timespec){ sleep_ns / 1000000000LL, sleep_ns % 1000000000LL }, NULL);
+
+    return send_packet(packet, pacer->socket);
+}
+
+/* Take the bytes of a frame from the bucket of the server
+   RETURN:
+    - Seconds until the frame may leave, 0 without a cap
+*/
+double pacing_server_wait(size_t bytes)
+{
+    pthread_mutex_lock(&server_bucket_lock);
+    double wait = bucket_reserve(&server_bucket, bytes, now_ns());
+    pthread_mutex_unlock(&server_bucket_lock);
+
+    return wait;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Read the rates from the environment and the config file, if it changed */
+void reload_settings()
+{
+    long long session_rate = get_env_number(PACE_RATE_ENV, 0);
+    long long server_rate = get_env_number(SERVER_RATE_ENV, 0);
+
+    char *path = getenv(PACE_CONFIG_ENV);
+    struct stat file_stat;
+    if(path != NULL && stat(path, &file_stat) == 0)
+    {
+        FILE *file = fopen(path, "r");
+        char line[128];
+        while(file != NULL && fgets(line, sizeof(line), file) != NULL)
+        {
+            sscanf(line, "pace_rate_kb=%lld", &session_rate);
+            sscanf(line, "server_rate_kb=%lld", &server_rate);
+        }
+        if(file != NULL)
+            fclose(file);
+
+        if(file_stat.st_mtime != config_time && config_time != 0)
+            printf("Pacing: %lld KB/s per transfer, %lld KB/s for the server\n", session_rate, server_rate);
+        config_time = file_stat.st_mtime;
+    }
+
+    session_rate_kb = session_rate;
+    if(server_rate != server_rate_kb || server_bucket.last_ns == 0)
+    {
+        pthread_mutex_lock(&server_bucket_lock);
+        bucket_init(&server_bucket, server_rate);
+        pthread_mutex_unlock(&server_bucket_lock);
+        server_rate_kb = server_rate;
+    }
+}
+
+/* Fill a bucket for a rate in KB/s */
+void bucket_init(token_bucket_t *bucket, long long rate_kb)
+{
+    bucket->rate = rate_kb > 0 ? rate_kb * 1024.0 : 0;
+    bucket->burst = bucket->rate * PACE_BURST_US / 1e6;
+    if(bucket->burst < sizeof(packet_t))
+        bucket->burst = sizeof(packet_t);
+    bucket->tokens = bucket->burst;
+    bucket->last_ns = now_ns();
+}
+
+/* Take the bytes of a frame from the bucket
+   RETURN:
+    - Seconds until the frame may leave
+*/
+double bucket_reserve(token_bucket_t *bucket, size_t bytes, long long now)
+{
+    if(bucket->rate == 0)
+        return 0;
+
+    if(now > bucket->last_ns)
+    {
+        bucket->tokens += (now - bucket->last_ns) * bucket->rate / 1e9;
+        if(bucket->tokens > bucket->burst)
+            bucket->tokens = bucket->burst;
+        bucket->last_ns = now;
+    }
+
+    bucket->tokens -= bytes;
+
+    return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+/* Nanoseconds of CLOCK_MONOTONIC, the clock of SO_TXTIME */
+long long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE // CPU affinity of the stage threads
+#include "../lib/pipeline.h"
+#include "../lib/utils.h"
+#include "../lib/xdp.h"
+#include "../lib/flow.h"
+#include "../lib/pacing.h"
+#include "../lib/framing.h"
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+
+/* Bytes of one frame, from the reader to the framer */
+typedef struct pipeline_block {
+    size_t length;
+    uint8_t data[DATA_SIZE];
+} pipeline_block_t;
+
+/* Transfer shared by the stages. Each counter has only one writer. */
+typedef struct pipeline {
+    FILE *file;
+    size_t file_size;
+    char *file_name;
+    cached_video_t *cached;
+    media_layout_t *layout; // Order of the bytes read, NULL is the file order
+    compress_reader_t *compress; // Read by the reader stage only, NULL sends the file as it is
+    int socket;
+    long long packets_quantity; // Known when the reader reaches the end, the size of the frames adapts
+    spsc_ring_t blocks; // Reader to framer
+    spsc_ring_t frames; // Framer to transmitter
+    long long base; // First frame without ACK, written by the ACK stage
+    long long sent; // Frames sent at least once, written by the transmitter
+    long long sent_bytes; // Bytes of the file in them, the reader writes them when it compresses
+    int window; // Frames the receiver can take, written by the ACK stage
+    int resend; // Set by the ACK stage after a NACK or a timeout
+    int result; // Set when a stage fails, every stage stops
+    int cpus[PIPELINE_STAGES];
+} pipeline_t;
+
+/* Auxiliary Functions */
+void *reader_stage(void *arg);
+void *framer_stage(void *arg);
+void *transmitter_stage(void *arg);
+void *ack_stage(void *arg);
+bool push_wait(pipeline_t *pipeline, spsc_ring_t *ring, void *item);
+void *pop_wait(pipeline_t *pipeline, spsc_ring_t *ring, long long index);
+long long frames_of(pipeline_t *pipeline);
+bool stopped(pipeline_t *pipeline);
+void stage_wait(int *idle);
+void pin_stage(pipeline_t *pipeline, int stage);
+void read_cpus(int *cpus);
+
+
+/* *** Main Functions *** */
+
+/* Allocate a ring with at least capacity slots
+   RETURN:
+    0 if the ring was created
+    -1 if there is no memory
+*/
+int spsc_ring_init(spsc_ring_t *ring, size_t capacity)
+{
+    size_t size = 1;
+    while(size < capacity)
+        size <<= 1;
+
+    memset(ring, 0, sizeof(spsc_ring_t));
+    ring->slots = calloc(size, sizeof(void *));
+    if(ring->slots == NULL)
+        return -1;
+    ring->mask = size - 1;
+
+    return 0;
+}
+
+/* Release the slots of a ring */
+void spsc_ring_destroy(spsc_ring_t *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+/* Put an item in the ring, only the producer thread calls it */
+bool spsc_ring_push(spsc_ring_t *ring, void *item)
+{
+    size_t tail = ring->tail;
+    if(tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+        return false;
+
+    ring->slots[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/* Take an item from the ring, only the consumer thread calls it */
+void *spsc_ring_pop(spsc_ring_t *ring)
+{
+    size_t head = ring->head;
+    if(head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    void *item = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+/* Send a file with the sliding window split in four threads: the reader takes the
+   bytes from the file, the framer escapes them and builds the frames with their CRC,
+   the transmitter keeps the window on the wire and the ACK stage moves the window.
+   RETURN:
+    0 if every frame was acknowledged
+    ERR_TIMEOUT_EXPIRED if the client stopped answering
+    ERR_ABORTED if the client gave up the transfer
+    ERR_COMPRESS if the file couldn't be read to compress it
+    -1 if the pipeline couldn't start
+*/
+int pipeline_send(FILE *file, size_t file_size, char *file_name, cached_video_t *cached, media_layout_t *layout, compress_reader_t *compress, int socket)
+{
+    pipeline_t pipeline;
+    memset(&pipeline, 0, sizeof(pipeline_t));
+    pipeline.file = file;
+    pipeline.file_size = file_size;
+    pipeline.file_name = file_name;
+    pipeline.cached = cached;
+    if(cached != NULL && cached->quantity < (size_t) ceil((double) file_size / (double)(MAX_DATA_SIZE))) // The file has the frames missing
+        pipeline.cached = cached = NULL;
+    pipeline.layout = layout;
+    pipeline.compress = compress;
+    pipeline.socket = socket;
+    pipeline.packets_quantity = cached != NULL ? (long long) ceil((double) file_size / (double)(MAX_DATA_SIZE)) : LLONG_MAX;
+    pipeline.window = WINDOW_SIZE;
+    read_cpus(pipeline.cpus);
+
+    size_t ring_size = get_env_number(PIPELINE_RING_ENV, PIPELINE_RING_SIZE);
+    if(spsc_ring_init(&pipeline.blocks, ring_size) != 0 || spsc_ring_init(&pipeline.frames, ring_size) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't allocate the sender pipeline!\n");
+        spsc_ring_destroy(&pipeline.blocks);
+        return -1;
+    }
+
+    void *(*stages[PIPELINE_STAGES])(void *) = { reader_stage, framer_stage, transmitter_stage, ack_stage };
+    pthread_t threads[PIPELINE_STAGES];
+    for(int i = 0; i < PIPELINE_STAGES; i++)
+        pthread_create(&threads[i], NULL, stages[i], &pipeline);
+    for(int i = 0; i < PIPELINE_STAGES; i++)
+        pthread_join(threads[i], NULL);
+
+    /* Frames left by a stopped transfer */
+    void *item;
+    while((item = spsc_ring_pop(&pipeline.blocks)) != NULL)
+        free(item);
+    while((item = spsc_ring_pop(&pipeline.frames)) != NULL)
+        destroy_packet(item);
+    spsc_ring_destroy(&pipeline.blocks);
+    spsc_ring_destroy(&pipeline.frames);
+
+    return pipeline.result;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Read the file in blocks of one frame, compressing it on the way if the client asked */
+void *reader_stage(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    pin_stage(pipeline, 0);
+
+    if(pipeline->cached != NULL) // The frames are ready in the cache
+        return NULL;
+
+    compress_reader_t *compress = pipeline->compress;
+    long long i = 0;
+    for(long long position = 0; compress != NULL ? !compress_ended(compress) : position < (long long) pipeline->file_size; i++)
+    {
+        pipeline_block_t *block = calloc(1, sizeof(pipeline_block_t));
+        if(block == NULL)
+        {
+            fprintf(stderr, "ERROR: block allocation failure!");
+            exit(EXIT_FAILURE);
+        }
+
+        size_t remaining = pipeline->file_size - position, size = frames_size(pipeline->socket); // The file may be a range
+        if(compress != NULL)
+            block->length = compress_read(compress, block->data, size);
+        else
+            block->length = media_read(pipeline->file, pipeline->layout, position, block->data, remaining < size ? remaining : size);
+        position += compress != NULL ? block->length : (remaining < size ? remaining : size);
+        if(compress != NULL) // The frames carry fewer bytes than the file
+            __atomic_store_n(&pipeline->sent_bytes, compress->position, __ATOMIC_RELEASE);
+
+        if(compress != NULL && block->length == 0) // The file couldn't be read
+        {
+            free(block);
+            __atomic_store_n(&pipeline->result, ERR_COMPRESS, __ATOMIC_RELEASE);
+            return NULL;
+        }
+
+        if(!push_wait(pipeline, &pipeline->blocks, block))
+        {
+            free(block);
+            return NULL;
+        }
+    }
+    __atomic_store_n(&pipeline->packets_quantity, i, __ATOMIC_RELEASE); // After the last block
+
+    return NULL;
+}
+
+/* Escape the blocks and build the frames, or copy them from the cache */
+void *framer_stage(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    pin_stage(pipeline, 1);
+
+    for(long long i = 0; i < frames_of(pipeline); i++)
+    {
+        uint8_t seq = i % (MAX_SEQUENCE + 1);
+        packet_t *frame;
+
+        if(pipeline->cached != NULL)
+        {
+            frame = frame_cache_packet(pipeline->cached, i, seq);
+            if(frame == NULL) // The frames were counted when the pipeline started
+            {
+                __atomic_store_n(&pipeline->result, -1, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        else
+        {
+            pipeline_block_t *block = pop_wait(pipeline, &pipeline->blocks, i);
+            if(block == NULL)
+                break;
+
+            replace_bytes_server(block->data, DATA_SIZE, 0x88, 0xA8, 0xFF, 0xFF);
+            replace_bytes_server(block->data, DATA_SIZE, 0x81, 0x00, 0xEE, 0xEE);
+            frame = create_or_modify_packet(NULL, block->length, seq, DATA, block->data);
+            free(block);
+        }
+
+        if(!push_wait(pipeline, &pipeline->frames, frame))
+        {
+            destroy_packet(frame);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Keep the window full, resending it when the ACK stage asks */
+void *transmitter_stage(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    packet_t *window[WINDOW_SIZE] = {0};
+    long long next_seq = 0, released = 0;
+    int idle = 0;
+    pacer_t pacer;
+    pacer_init(&pacer, pipeline->socket);
+
+    pin_stage(pipeline, 2);
+
+    while(released < frames_of(pipeline) && !stopped(pipeline))
+    {
+        long long base = __atomic_load_n(&pipeline->base, __ATOMIC_ACQUIRE);
+        while(released < base)
+        {
+            destroy_packet(window[released % WINDOW_SIZE]);
+            window[released % WINDOW_SIZE] = NULL;
+            released++;
+        }
+
+        if(__atomic_exchange_n(&pipeline->resend, 0, __ATOMIC_ACQ_REL))
+        {
+            for(long long i = base; i < next_seq; i++)
+                pacer_send(&pacer, window[i % WINDOW_SIZE]);
+            frames_sent(pipeline->socket, next_seq - base);
+        }
+
+        packet_t *frame = NULL;
+        int advertised = __atomic_load_n(&pipeline->window, __ATOMIC_ACQUIRE);
+        if(next_seq < base + advertised && next_seq < frames_of(pipeline))
+            frame = spsc_ring_pop(&pipeline->frames);
+
+        if(frame == NULL)
+        {
+            xdp_flush(pipeline->socket);
+            stage_wait(&idle);
+            continue;
+        }
+
+        idle = 0;
+        window[next_seq % WINDOW_SIZE] = frame;
+        next_seq++;
+        __atomic_store_n(&pipeline->sent, next_seq, __ATOMIC_RELEASE); // Before the ACK can arrive
+        if(pipeline->compress == NULL)
+            __atomic_add_fetch(&pipeline->sent_bytes, frame->size, __ATOMIC_RELEASE);
+        pacer_send(&pacer, frame);
+        frames_sent(pipeline->socket, 1);
+    }
+
+    for(int i = 0; i < WINDOW_SIZE; i++)
+        if(window[i] != NULL)
+            destroy_packet(window[i]);
+
+    return NULL;
+}
+
+/* Wait the ACKs and move the window, a NACK or a timeout asks the window again */
+void *ack_stage(void *arg)
+{
+    pipeline_t *pipeline = arg;
+    packet_t p;
+    int try = 0;
+    long long probe_ms = WINDOW_PROBE_MS;
+
+    pin_stage(pipeline, 3);
+
+    while(pipeline->base < frames_of(pipeline) && !stopped(pipeline))
+    {
+        /* With a zero window and nothing in flight no ACK will come, the window is probed */
+        bool zero_window = pipeline->window == 0 && pipeline->base == __atomic_load_n(&pipeline->sent, __ATOMIC_ACQUIRE);
+        int listen = listen_for_packet_ms(&p, zero_window ? probe_ms : TIMEOUT * 1000, pipeline->socket);
+
+        if(listen != 0 && ++try > MAX_TRY)
+        {
+            __atomic_store_n(&pipeline->result, ERR_TIMEOUT_EXPIRED, __ATOMIC_RELEASE);
+            break;
+        }
+
+        if(listen == 0)
+        {
+            try = 0;
+            if(p.type == ACK)
+            {
+                __atomic_store_n(&pipeline->window, flow_ack_window(&p), __ATOMIC_RELEASE);
+                probe_ms = WINDOW_PROBE_MS;
+
+                /* The ACK is cumulative, it may only cover frames already sent */
+                long long base = pipeline->base;
+                long long acked = base + (p.sequence - base % (MAX_SEQUENCE + 1) + MAX_SEQUENCE + 1) % (MAX_SEQUENCE + 1);
+                if(acked < base + WINDOW_SIZE && acked < __atomic_load_n(&pipeline->sent, __ATOMIC_ACQUIRE))
+                    __atomic_store_n(&pipeline->base, acked + 1, __ATOMIC_RELEASE);
+            }
+            else if(p.type == NACK)
+            {
+                printf("Resend window\n");
+                frames_lost(pipeline->socket);
+                __atomic_store_n(&pipeline->resend, 1, __ATOMIC_RELEASE);
+            }
+            else if(p.type == ERROR) // The client gave up
+            {
+                __atomic_store_n(&pipeline->result, ERR_ABORTED, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+        else if(listen == ERR_TIMEOUT_EXPIRED && zero_window) // One frame goes as the probe
+        {
+            __atomic_store_n(&pipeline->window, 1, __ATOMIC_RELEASE);
+            probe_ms = probe_ms * 2 < TIMEOUT * 1000 ? probe_ms * 2 : TIMEOUT * 1000;
+        }
+        else if(listen == ERR_TIMEOUT_EXPIRED)
+        {
+            printf("Resend window\n");
+            frames_lost(pipeline->socket);
+            __atomic_store_n(&pipeline->resend, 1, __ATOMIC_RELEASE);
+        }
+
+        printf("\r%s: ", pipeline->file_name);
+        fflush(stdout);
+        print_progress(pipeline->file_size, __atomic_load_n(&pipeline->sent_bytes, __ATOMIC_ACQUIRE), 1);
+    }
+
+    return NULL;
+}
+
+/* Push an item, waiting while the next stage is behind
+   RETURN:
+    false if the transfer stopped
+*/
+bool push_wait(pipeline_t *pipeline, spsc_ring_t *ring, void *item)
+{
+    int idle = 0;
+
+    while(!spsc_ring_push(ring, item))
+    {
+        if(stopped(pipeline))
+            return false;
+        stage_wait(&idle);
+    }
+
+    return true;
+}
+
+/* Pop the item of index, waiting while the previous stage is behind
+   RETURN:
+    NULL if the transfer stopped or the reader ended before index
+*/
+void *pop_wait(pipeline_t *pipeline, spsc_ring_t *ring, long long index)
+{
+    int idle = 0;
+    void *item;
+
+    while((item = spsc_ring_pop(ring)) == NULL)
+    {
+        if(stopped(pipeline) || index >= frames_of(pipeline))
+            return NULL;
+        stage_wait(&idle);
+    }
+
+    return item;
+}
+
+/* Frames of the transfer, LLONG_MAX while the reader doesn't know them */
+long long frames_of(pipeline_t *pipeline)
+{
+    return __atomic_load_n(&pipeline->packets_quantity, __ATOMIC_ACQUIRE);
+}
+
+/* A stage failed */
+bool stopped(pipeline_t *pipeline)
+{
+    return __atomic_load_n(&pipeline->result, __ATOMIC_ACQUIRE) != 0;
+}
+
+/* Spin a little while the queue is empty or full, then sleep to free the core */
+void stage_wait(int *idle)
+{
+    if((*idle)++ < 64)
+        sched_yield();
+    else
+        nanosleep(&(struct timespec){ 0, 50000 }, NULL);
+}
+
+/* Pin the thread of a stage to its CPU, if one was configured */
+void pin_stage(pipeline_t *pipeline, int stage)
+{
+    if(pipeline->cpus[stage] < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pipeline->cpus[stage], &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) != 0)
+        fprintf(stderr, "ERROR: couldn't pin stage %d to CPU %d\n", stage, pipeline->cpus[stage]);
+}
+
+/* Read the CPU list of the stages, -1 leaves a stage free */
+void read_cpus(int *cpus)
+{
+    char *list = getenv(PIPELINE_CPUS_ENV);
+
+    for(int i = 0; i < PIPELINE_STAGES; i++)
+    {
+        cpus[i] = -1;
+        if(list == NULL || *list == '\0')
+            continue;
+
+        char *end;
+        long cpu = strtol(list, &end, 10);
+        if(end != list && cpu >= 0 && cpu < CPU_SETSIZE)
+            cpus[i] = cpu;
+        list = *end == ',' ? end + 1 : end;
+    }
+}
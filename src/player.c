@@ -0,0 +1,94 @@
+#include "../lib/player.h"
+#include "../lib/utils.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+/* State of the player, only the foreground of the client uses it */
+char armed_name[DATA_SIZE], playing_name[DATA_SIZE];
+bool player_armed = false;
+size_t player_early = 0; // Media bytes of the armed download before it plays
+pid_t player_pid = 0;
+
+/* Auxiliary Functions */
+pid_t start_player(const char *file_name);
+
+
+/* *** Main Functions *** */
+
+void player_arm(const char *file_name)
+{
+    snprintf(armed_name, sizeof(armed_name), "%s", file_name);
+    player_early = get_env_number(PLAYER_EARLY_ENV, PLAYER_EARLY_KB) * 1024;
+    player_armed = player_early > 0;
+}
+
+/* Only the download of the armed name counts, a delta or a prefetch writes another file */
+void player_progress(const char *file_name, media_layout_t *layout, size_t file_size, size_t written)
+{
+    if(!player_armed || file_name == NULL || strcmp(file_name, armed_name) != 0)
+        return;
+
+    size_t start = media_index_bytes(layout) + player_early;
+    if(written < (start < file_size ? start : file_size))
+        return;
+
+    player_armed = false;
+    player_pid = start_player(file_name);
+    snprintf(playing_name, sizeof(playing_name), "%s", file_name);
+    printf("\n--> Playing %s while it downloads\n", file_name);
+}
+
+void player_play(const char *file_name)
+{
+    player_armed = false;
+    if(player_pid <= 0 || strcmp(playing_name, file_name) != 0)
+    {
+        player_cancel();
+        player_pid = start_player(file_name);
+    }
+    if(player_pid <= 0)
+        return;
+
+    waitpid(player_pid, NULL, 0);
+    player_pid = 0;
+}
+
+void player_cancel()
+{
+    player_armed = false;
+    if(player_pid <= 0)
+        return;
+
+    kill(player_pid, SIGTERM);
+    waitpid(player_pid, NULL, 0);
+    player_pid = 0;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Run the player with its output hidden, like the shell did
+   RETURN:
+    - The pid of the player
+    - -1 if it couldn't start
+*/
+pid_t start_player(const char *file_name)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(null_fd != -1)
+        {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+        execlp(PLAYER_COMMAND, PLAYER_COMMAND, file_name, (char *) NULL);
+        _exit(127);
+    }
+    if(pid == -1)
+        fprintf(stderr, "Error trying to execute the video");
+
+    return pid;
+}
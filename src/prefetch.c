@@ -0,0 +1,297 @@
+#include "../lib/prefetch.h"
+#include "../lib/command.h"
+#include "../lib/stripe.h"
+#include "../lib/video_cache.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+
+/* State of the prefetch, shared by the client and its thread.
+   link_lock is held by whoever uses the socket: the foreground takes it
+   for each command and the prefetch only uses the link while it's idle. */
+pthread_t prefetch_thread;
+pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_work = PTHREAD_COND_INITIALIZER;
+bool prefetch_enabled = false, prefetch_pending = false;
+int preempt = 0, prefetch_socket;
+char last_watched[DATA_SIZE];
+watch_entry_t watch_entries[MAX_HISTORY_ENTRIES];
+int watch_quantity = 0;
+
+/* Auxiliary Functions */
+void *prefetch_worker(void *arg);
+int plan_candidates(const char *watched, char (*candidates)[DATA_SIZE], int max_quantity);
+int prefetch_video(char *name);
+void yield_link();
+void load_history();
+void save_history();
+int compare_video_names(const void *a, const void *b);
+
+
+/* *** Main Functions *** */
+
+/* Start the thread of the prefetch. The client holds the socket until its first prompt. */
+void prefetch_start(int socket)
+{
+    if(!get_env_number(PREFETCH_ENV, 1))
+        return;
+
+    load_history();
+    prefetch_socket = socket;
+    pthread_mutex_lock(&link_lock);
+    if(pthread_create(&prefetch_thread, NULL, prefetch_worker, NULL) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't start the prefetch!\n");
+        pthread_mutex_unlock(&link_lock);
+        return;
+    }
+    prefetch_enabled = true;
+}
+
+/* Take the socket for a foreground command. The prefetch sees the request
+   between two ranges, so the wait is at most one PREFETCH_CHUNK. */
+void prefetch_pause()
+{
+    if(!prefetch_enabled)
+        return;
+
+    __atomic_store_n(&preempt, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&link_lock);
+    __atomic_store_n(&preempt, 0, __ATOMIC_RELEASE);
+}
+
+/* Give the socket back to the prefetch while the client is idle */
+void prefetch_resume()
+{
+    if(!prefetch_enabled)
+        return;
+
+    pthread_mutex_unlock(&link_lock);
+}
+
+/* Count a watched video and wake the prefetch of the ones likely to come next */
+void prefetch_watched(const char *name)
+{
+    if(!prefetch_enabled)
+        return;
+
+    pthread_mutex_lock(&prefetch_lock);
+    int index = 0;
+    while(index < watch_quantity && strcmp(watch_entries[index].name, name) != 0)
+        index++;
+    if(index == watch_quantity && watch_quantity < MAX_HISTORY_ENTRIES)
+    {
+        memset(&watch_entries[index], 0, sizeof(watch_entry_t));
+        strncpy(watch_entries[index].name, name, MAX_FILE_NAME_SIZE);
+        watch_quantity++;
+    }
+    if(index < watch_quantity)
+    {
+        watch_entries[index].plays++;
+        watch_entries[index].last = time(NULL);
+    }
+    save_history();
+
+    strncpy(last_watched, name, MAX_FILE_NAME_SIZE);
+    prefetch_pending = true;
+    pthread_cond_signal(&prefetch_work);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* The download only brings the rest of the video as a delta of its prefetched start */
+bool prefetch_base(const char *name, char *base, size_t size)
+{
+    snprintf(base, size, "%s%s", name, PREFETCH_SUFFIX);
+
+    return access(name, F_OK) != 0 && access(base, F_OK) == 0;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Wait a watched video and prefetch its candidates while the client is idle */
+void *prefetch_worker(void *arg)
+{
+    (void) arg;
+    char watched[DATA_SIZE];
+    int max_quantity = get_env_number(PREFETCH_NEXT_ENV, PREFETCH_NEXT) + get_env_number(PREFETCH_POPULAR_ENV, PREFETCH_POPULAR);
+    char (*candidates)[DATA_SIZE] = calloc(max_quantity > 0 ? max_quantity : 1, DATA_SIZE);
+
+    while(candidates != NULL)
+    {
+        pthread_mutex_lock(&prefetch_lock);
+        while(!prefetch_pending)
+            pthread_cond_wait(&prefetch_work, &prefetch_lock);
+        prefetch_pending = false;
+        memcpy(watched, last_watched, DATA_SIZE);
+        pthread_mutex_unlock(&prefetch_lock);
+
+        pthread_mutex_lock(&link_lock);
+        int quantity = plan_candidates(watched, candidates, max_quantity);
+        for(int i = 0; i < quantity; i++)
+            prefetch_video(candidates[i]);
+        pthread_mutex_unlock(&link_lock);
+    }
+
+    return NULL;
+}
+
+/* Choose the videos to prefetch: the next ones by name in the list of the
+   server, then the most watched ones, newer plays counting more
+   RETURN:
+    - The quantity of candidates
+*/
+int plan_candidates(const char *watched, char (*candidates)[DATA_SIZE], int max_quantity)
+{
+    char (*server_videos)[DATA_SIZE] = calloc(MAX_LIST_SIZE, DATA_SIZE);
+    if(server_videos == NULL)
+        return 0;
+
+    yield_link();
+    int server_quantity = list_remote_videos(server_videos, MAX_LIST_SIZE, prefetch_socket);
+    if(server_quantity <= 0)
+    {
+        free(server_videos);
+        return 0;
+    }
+    qsort(server_videos, server_quantity, DATA_SIZE, compare_video_names);
+
+    int quantity = 0, next = get_env_number(PREFETCH_NEXT_ENV, PREFETCH_NEXT);
+    for(int i = 0; i < server_quantity && quantity < next; i++)
+        if(strcmp(server_videos[i], watched) > 0 && access(server_videos[i], F_OK) != 0)
+            memcpy(candidates[quantity++], server_videos[i], DATA_SIZE);
+
+    pthread_mutex_lock(&prefetch_lock);
+    time_t now = time(NULL);
+    while(quantity < max_quantity)
+    {
+        int best = -1;
+        double best_score = 0;
+        for(int i = 0; i < watch_quantity; i++)
+        {
+            bool listed = bsearch(watch_entries[i].name, server_videos, server_quantity, DATA_SIZE, compare_video_names) != NULL;
+            bool chosen = false;
+            for(int j = 0; j < quantity; j++)
+                chosen |= strcmp(candidates[j], watch_entries[i].name) == 0;
+
+            double score = watch_entries[i].plays / (1.0 + (now - watch_entries[i].last) / 86400.0);
+            if(listed && !chosen && access(watch_entries[i].name, F_OK) != 0 && score > best_score)
+            {
+                best = i;
+                best_score = score;
+            }
+        }
+        if(best < 0)
+            break;
+        memcpy(candidates[quantity++], watch_entries[best].name, DATA_SIZE);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    free(server_videos);
+    return quantity;
+}
+
+/* Receive the start of a video, or all of it if it's small, in ranges of
+   PREFETCH_CHUNK. A complete video goes to the cache with its name.
+   RETURN:
+    0 if the prefetch of the video finished
+    -1 if an error occurred
+*/
+int prefetch_video(char *name)
+{
+    long long file_size, limit = get_env_number(PREFETCH_SIZE_ENV, PREFETCH_SIZE_MB) * 1024 * 1024;
+    char part[DATA_SIZE + sizeof(PREFETCH_SUFFIX)];
+    snprintf(part, sizeof(part), "%s%s", name, PREFETCH_SUFFIX);
+
+    yield_link();
+    if(access(name, F_OK) == 0 || strlen(name) > MAX_RANGE_NAME_SIZE ||
+       request_range(name, 0, 0, &file_size, prefetch_socket) != 0)
+        return -1;
+
+    long long target = file_size < limit ? file_size : limit;
+    int fd = open(part, O_WRONLY | O_CREAT, 0644);
+    if(fd == -1)
+        return -1;
+    long long have = lseek(fd, 0, SEEK_END);
+    if(have < target && video_cache_reserve(target - have, name) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    while(have < target)
+    {
+        yield_link();
+        long long length = target - have < PREFETCH_CHUNK ? target - have : PREFETCH_CHUNK;
+        if(request_range(name, have, length, &file_size, prefetch_socket) != 0 ||
+           receive_stream(fd, have, NULL, length, NULL, NULL, NULL, prefetch_socket) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        have += length;
+    }
+    close(fd);
+
+    if(have == file_size && access(name, F_OK) != 0)
+    {
+        rename(part, name);
+        video_cache_add(name);
+    }
+
+    return 0;
+}
+
+/* Hand the socket to a foreground command that asked for it, and take it back after */
+void yield_link()
+{
+    if(!__atomic_load_n(&preempt, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_mutex_unlock(&link_lock);
+    while(__atomic_load_n(&preempt, __ATOMIC_ACQUIRE)) // Until the foreground holds the lock
+        nanosleep(&(struct timespec){ 0, 1000000 }, NULL);
+    pthread_mutex_lock(&link_lock);
+}
+
+/* Read the watched videos of the previous runs, the name goes last on each line
+   so it may have spaces, like the index of the cache */
+void load_history()
+{
+    FILE *file = fopen(PREFETCH_HISTORY, "r");
+    if(file == NULL)
+        return;
+
+    long long last;
+    char line[DATA_SIZE * 2];
+    int name_start;
+    while(watch_quantity < MAX_HISTORY_ENTRIES && fgets(line, sizeof(line), file) != NULL)
+    {
+        watch_entry_t *entry = &watch_entries[watch_quantity];
+        line[strcspn(line, "\n")] = '\0';
+        if(sscanf(line, "%d %lld%n", &entry->plays, &last, &name_start) != 2 ||
+           line[name_start] != ' ' || line[name_start + 1] == '\0' || strlen(line + name_start + 1) >= sizeof(entry->name))
+            continue;
+
+        strcpy(entry->name, line + name_start + 1);
+        entry->last = last;
+        watch_quantity++;
+    }
+    fclose(file);
+}
+
+/* Write the watched videos, prefetch_lock is held */
+void save_history()
+{
+    FILE *file = fopen(PREFETCH_HISTORY, "w");
+    if(file == NULL)
+        return;
+
+    for(int i = 0; i < watch_quantity; i++)
+        fprintf(file, "%d %lld %s\n", watch_entries[i].plays, (long long) watch_entries[i].last, watch_entries[i].name);
+    fclose(file);
+}
+
+int compare_video_names(const void *a, const void *b)
+{
+    return strcmp((const char *) a, (const char *) b);
+}
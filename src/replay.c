@@ -0,0 +1,201 @@
+#include "../lib/connection.h"
+#include "../lib/capture.h"
+#include "../lib/codec.h"
+#include "../lib/command.h"
+#include "../lib/media.h"
+#include <pthread.h>
+
+/* Feed the frames a client received in a capture back through its receive path,
+   as fast as the receiver takes them, to measure the decode and the ARQ offline.
+   The first transfer of the capture is replayed, from its DESCRIPTOR to its END.
+   Usage: replay <capture> [output file]
+*/
+#define REPLAY_MIN_SECONDS 0.2
+
+/* Frames of the replay and the answers of the receiver */
+typedef struct replay_feed {
+    int socket;
+    capture_frame_t *frames;
+    long long quantity;
+    bool add_end; // The capture stopped before END_TRANSMISSION
+    long long acks;
+    long long nacks;
+} replay_feed_t;
+
+/* Monotonic time in seconds */
+double replay_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Send the frames, the socket blocks while the receiver is behind. A receiver that
+   stopped closes its end, the send fails with EPIPE instead of raising SIGPIPE. */
+void *feed_frames(void *arg)
+{
+    replay_feed_t *feed = arg;
+    for(long long i = 0; i < feed->quantity; i++)
+        if(send(feed->socket, feed->frames[i].wire, feed->frames[i].length, MSG_NOSIGNAL) == -1)
+            return NULL;
+
+    if(feed->add_end)
+    {
+        uint8_t wire[CODEC_FRAME_SIZE];
+        packet_t *end = create_or_modify_packet(NULL, 0, 0, END_TRANSMISSION, NULL);
+        codec_encode(end, wire);
+        send(feed->socket, wire, sizeof(wire), MSG_NOSIGNAL);
+        destroy_packet(end);
+    }
+
+    return NULL;
+}
+
+/* Read the ACKs and NACKs of the receiver until it closes its end */
+void *drain_answers(void *arg)
+{
+    replay_feed_t *feed = arg;
+    uint8_t wire[CODEC_FRAME_SIZE];
+    packet_t answer;
+
+    while(recv(feed->socket, wire, sizeof(wire), 0) > 0)
+    {
+        if(codec_decode(wire, sizeof(wire), &answer) != CODEC_OK)
+            continue;
+        feed->acks += answer.type == ACK;
+        feed->nacks += answer.type == NACK;
+    }
+
+    return NULL;
+}
+
+/* Decode every received frame of the capture until REPLAY_MIN_SECONDS, like listen_for_packet */
+void replay_decode(capture_frame_t *frames, long long quantity)
+{
+    long long valid = 0, damaged = 0, other = 0, passes = 0, decoded = 0;
+    packet_t packet;
+
+    double start = replay_now(), elapsed = 0;
+    while(elapsed < REPLAY_MIN_SECONDS)
+    {
+        valid = damaged = other = 0;
+        for(long long i = 0; i < quantity; i++)
+        {
+            int result = codec_decode(frames[i].wire, frames[i].length, &packet);
+            valid += result == CODEC_OK;
+            damaged += result == CODEC_ERR_CRC;
+            other += result != CODEC_OK && result != CODEC_ERR_CRC;
+        }
+        decoded += quantity;
+        passes++;
+        elapsed = replay_now() - start;
+    }
+
+    printf("decode   %lld frames: %lld valid, %lld CRC failures, %lld not of the protocol   %.0f frames/s (%lld passes)\n",
+           quantity, valid, damaged, other, decoded / elapsed, passes);
+}
+
+/* Run the frames of the first transfer through receive_stream */
+int replay_transfer(capture_frame_t *frames, long long quantity, char *output)
+{
+    size_t file_size = 0;
+    media_layout_t layout;
+    packet_t packet;
+    long long first = -1, last = -1;
+    memset(&layout, 0, sizeof(media_layout_t));
+
+    /* From after the DESCRIPTOR, or the first DATA, to the END */
+    for(long long i = 0; i < quantity && last == -1; i++)
+    {
+        if(codec_decode(frames[i].wire, frames[i].length, &packet) != CODEC_OK)
+            continue;
+        if(first == -1 && packet.type == DESCRIPTOR)
+        {
+            for(size_t j = 0; j < 4; j++)
+                file_size |= ((size_t) packet.data[j]) << (j * 8);
+            media_unpack_layout(packet.data, &layout);
+            first = i + 1;
+        }
+        else if(first == -1 && packet.type == DATA)
+            first = i;
+        else if(first != -1 && packet.type == END_TRANSMISSION)
+            last = i;
+    }
+    if(first == -1)
+    {
+        fprintf(stderr, "ERROR: the capture has no transfer!\n");
+        return -1;
+    }
+    bool add_end = last == -1;
+    if(add_end) // The replay ends it
+    {
+        printf("The capture ends before END_TRANSMISSION\n");
+        last = quantity - 1;
+    }
+
+    int pair[2];
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1)
+    {
+        fprintf(stderr, "ERROR: couldn't create the sockets of the replay!\n");
+        return -1;
+    }
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1)
+    {
+        fprintf(stderr, "ERROR: couldn't open %s!\n", output);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    replay_feed_t feed = { pair[1], frames + first, last - first + 1, add_end, 0, 0 };
+    pthread_t feeder, drainer;
+    pthread_create(&feeder, NULL, feed_frames, &feed);
+    pthread_create(&drainer, NULL, drain_answers, &feed);
+
+    double start = replay_now();
+    int result = receive_stream(fd, 0, NULL, file_size, &layout, NULL, NULL, pair[0]);
+    double elapsed = replay_now() - start;
+
+    close(pair[0]); // The drain sees the end, the feeder stops on EPIPE
+    pthread_join(drainer, NULL);
+    pthread_join(feeder, NULL);
+    close(pair[1]);
+    close(fd);
+
+    printf("receive  %lld frames, %zu bytes in %.3f s   %.0f frames/s   %.2f MB/s   %lld ACKs, %lld NACKs%s\n",
+           feed.quantity, file_size, elapsed, feed.quantity / elapsed, file_size / elapsed / 1e6,
+           feed.acks, feed.nacks, result == 0 ? "" : "   (failed)");
+
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <capture> [output file]\n", argv[0]);
+        return 1;
+    }
+
+    capture_frame_t *frames;
+    long long quantity = capture_read(argv[1], &frames);
+    if(quantity <= 0)
+    {
+        free(frames);
+        return 1;
+    }
+
+    /* Only what the client received goes back through its receive path */
+    long long received = 0;
+    for(long long i = 0; i < quantity; i++)
+        if(frames[i].direction != CAPTURE_OUTGOING)
+            frames[received++] = frames[i];
+
+    printf("%s: %lld frames, %lld received\n", argv[1], quantity, received);
+    replay_decode(frames, received);
+    int result = replay_transfer(frames, received, argc > 2 ? argv[2] : "/dev/null");
+
+    free(frames);
+    return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,346 @@
+#include "../lib/scheduler.h"
+#include "../lib/pacing.h"
+#include "../lib/utils.h"
+
+/* Sessions indexed by the socket and in the order of the round-robin */
+sched_session_t *sched_sessions[SCHED_MAX_SOCKETS];
+int sched_order[SCHED_MAX_SOCKETS];
+int sched_quantity = 0;
+pthread_t dispatcher_thread;
+pthread_mutex_t sched_register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Auxiliary Functions */
+void *dispatcher(void *arg);
+bool send_control();
+bool send_bulk(sched_session_t *session);
+void wait_server_rate();
+void print_stats();
+int parse_weight(const char *name);
+int queue_init(sched_queue_t *queue, size_t size);
+bool queue_push(sched_queue_t *queue, packet_t *packet);
+bool queue_pop(sched_queue_t *queue, sched_item_t *item);
+size_t queue_depth(sched_queue_t *queue);
+long long sched_now_ns();
+
+
+/* *** Main Functions *** */
+
+/* Put the socket of an interface in the scheduler, the first call starts the dispatcher
+   RETURN:
+    0 if the frames of the socket go through the scheduler
+    -1 if an error occurred, the socket sends directly
+*/
+int sched_register(int socket, const char *name)
+{
+    if(socket < 0 || socket >= SCHED_MAX_SOCKETS)
+        return -1;
+
+    sched_session_t *session = calloc(1, sizeof(sched_session_t));
+    size_t size = get_env_number(SCHED_QUEUE_ENV, SCHED_QUEUE);
+    if(session == NULL || queue_init(&session->control, size) != 0 || queue_init(&session->bulk, size) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't create the session of %s!\n", name);
+        if(session != NULL)
+        {
+            free(session->control.items);
+            free(session);
+        }
+        return -1;
+    }
+    snprintf(session->name, sizeof(session->name), "%s", name);
+    session->socket = socket;
+    session->weight = parse_weight(name);
+    pthread_mutex_init(&session->lock, NULL);
+
+    /* The session is published before the dispatcher starts, it takes the rounds of sched_quantity */
+    pthread_mutex_lock(&sched_register_lock);
+    sched_order[sched_quantity] = socket;
+    __atomic_store_n(&sched_sessions[socket], session, __ATOMIC_RELEASE);
+    __atomic_store_n(&sched_quantity, sched_quantity + 1, __ATOMIC_RELEASE);
+    if(sched_quantity == 1 && pthread_create(&dispatcher_thread, NULL, dispatcher, NULL) != 0)
+    {
+        __atomic_store_n(&sched_quantity, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&sched_sessions[socket], NULL, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&sched_register_lock);
+        fprintf(stderr, "ERROR: couldn't start the dispatcher!\n");
+        free(session->control.items);
+        free(session->bulk.items);
+        free(session);
+        return -1;
+    }
+    pthread_mutex_unlock(&sched_register_lock);
+
+    printf("Scheduling %s with weight %d\n", session->name, session->weight);
+
+    return 0;
+}
+
+/* Queue a copy of a frame. Control frames skip the bulk of every session,
+   unless their own session still has bulk queued: a session keeps its order.
+   RETURN:
+    0 if the frame was queued
+    -1 if the socket isn't scheduled, the caller sends it
+*/
+int sched_enqueue(packet_t *packet, int socket)
+{
+    if(!sched_active(socket) || pthread_equal(pthread_self(), dispatcher_thread))
+        return -1;
+
+    sched_session_t *session = sched_sessions[socket];
+    bool bulk = packet->type == DATA || packet->type == GROUP_DATA;
+
+    pthread_mutex_lock(&session->lock);
+    while(1)
+    {
+        sched_queue_t *queue = bulk || queue_depth(&session->bulk) > 0 ? &session->bulk : &session->control;
+        if(queue_push(queue, packet))
+            break;
+
+        /* Full, the sender waits the dispatcher */
+        pthread_mutex_unlock(&session->lock);
+        nanosleep(&(struct timespec){ 0, 20000 }, NULL);
+        pthread_mutex_lock(&session->lock);
+    }
+    if(queue_depth(&session->bulk) > session->stats.max_depth)
+        session->stats.max_depth = queue_depth(&session->bulk);
+    pthread_mutex_unlock(&session->lock);
+
+    return 0;
+}
+
+/* If the frames of the socket go through the scheduler */
+bool sched_active(int socket)
+{
+    return socket >= 0 && socket < SCHED_MAX_SOCKETS &&
+           __atomic_load_n(&sched_sessions[socket], __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Send the queued frames: every control frame first, then the bulk in deficit
+   round-robin, checking the control frames again after each bulk frame */
+void *dispatcher(void *arg)
+{
+    (void) arg;
+    int current = 0, idle = 0;
+    long long stats_ns = get_env_number(SCHED_STATS_ENV, SCHED_STATS_S) * 1000000000LL;
+    long long next_stats = sched_now_ns() + stats_ns;
+
+    while(1)
+    {
+        int quantity = __atomic_load_n(&sched_quantity, __ATOMIC_ACQUIRE);
+        bool sent = send_control();
+
+        sched_session_t *session = sched_sessions[sched_order[current % quantity]];
+        if(send_bulk(session))
+            sent = true;
+        else
+            current = (current + 1) % quantity; // Deficit spent or queue empty
+
+        idle = sent ? 0 : idle + 1;
+        if(idle >= quantity) // A whole round without frames
+        {
+            nanosleep(&(struct timespec){ 0, 50000 }, NULL);
+            idle = 0;
+        }
+
+        if(stats_ns > 0 && sched_now_ns() >= next_stats)
+        {
+            print_stats();
+            next_stats = sched_now_ns() + stats_ns;
+        }
+    }
+
+    return NULL;
+}
+
+/* Send the control frames of every session
+   RETURN:
+    - If a frame was sent
+*/
+bool send_control()
+{
+    int quantity = __atomic_load_n(&sched_quantity, __ATOMIC_ACQUIRE);
+    sched_item_t item;
+    bool sent = false;
+
+    for(int i = 0; i < quantity; i++)
+    {
+        sched_session_t *session = sched_sessions[sched_order[i]];
+        while(1)
+        {
+            pthread_mutex_lock(&session->lock);
+            bool popped = queue_pop(&session->control, &item);
+            pthread_mutex_unlock(&session->lock);
+            if(!popped)
+                break;
+
+            send_packet(&item.packet, session->socket);
+
+            long long wait = sched_now_ns() - item.queued_ns;
+            pthread_mutex_lock(&session->lock);
+            session->stats.control++;
+            session->stats.control_wait_ns += wait;
+            if(wait > session->stats.max_control_wait_ns)
+                session->stats.max_control_wait_ns = wait;
+            pthread_mutex_unlock(&session->lock);
+            sent = true;
+        }
+    }
+
+    return sent;
+}
+
+/* Send one bulk frame of the session if its deficit covers it, a new
+   visit of the round-robin adds the quantum of its weight
+   RETURN:
+    - If the session may send again in this visit
+*/
+bool send_bulk(sched_session_t *session)
+{
+    sched_item_t item;
+
+    pthread_mutex_lock(&session->lock);
+    if(queue_depth(&session->bulk) == 0)
+    {
+        session->deficit = 0; // An idle session doesn't save credit
+        pthread_mutex_unlock(&session->lock);
+        return false;
+    }
+    if(session->deficit < sizeof(packet_t))
+        session->deficit += SCHED_QUANTUM * session->weight;
+    queue_pop(&session->bulk, &item);
+    session->deficit -= sizeof(packet_t);
+    session->stats.bulk++;
+    pthread_mutex_unlock(&session->lock);
+
+    wait_server_rate();
+    send_packet(&item.packet, session->socket);
+
+    return session->deficit >= sizeof(packet_t);
+}
+
+/* Wait the server rate for a bulk frame, the control frames still leave meanwhile */
+void wait_server_rate()
+{
+    long long departure = sched_now_ns() + (long long)(pacing_server_wait(sizeof(packet_t)) * 1e9);
+
+    long long remaining;
+    while((remaining = departure - sched_now_ns()) > 0)
+    {
+        send_control();
+        if(remaining > 50000)
+            remaining = 50000;
+        nanosleep(&(struct timespec){ 0, remaining }, NULL);
+    }
+}
+
+/* Print the metrics of the sessions with traffic and start them again */
+void print_stats()
+{
+    int quantity = __atomic_load_n(&sched_quantity, __ATOMIC_ACQUIRE);
+
+    for(int i = 0; i < quantity; i++)
+    {
+        sched_session_t *session = sched_sessions[sched_order[i]];
+        pthread_mutex_lock(&session->lock);
+        sched_stats_t stats = session->stats;
+        size_t depth = queue_depth(&session->bulk);
+        memset(&session->stats, 0, sizeof(sched_stats_t));
+        pthread_mutex_unlock(&session->lock);
+
+        if(stats.control == 0 && stats.bulk == 0)
+            continue;
+
+        printf("Scheduler %s (weight %d): %llu bulk and %llu control frames, bulk queue %zu (max %zu), "
+               "control wait %lld us (max %lld us)\n",
+               session->name, session->weight, stats.bulk, stats.control, depth, stats.max_depth,
+               stats.control > 0 ? stats.control_wait_ns / (long long) stats.control / 1000 : 0,
+               stats.max_control_wait_ns / 1000);
+    }
+}
+
+/* Weight of an interface in SCHED_WEIGHTS_ENV, like "eno1=3,eno2=1" */
+int parse_weight(const char *name)
+{
+    char *weights = getenv(SCHED_WEIGHTS_ENV);
+    size_t length = strlen(name);
+
+    for(char *entry = weights; entry != NULL && *entry != '\0'; )
+    {
+        if(strncmp(entry, name, length) == 0 && entry[length] == '=')
+        {
+            int weight = atoi(entry + length + 1);
+            return weight > 0 ? weight : 1;
+        }
+        entry = strchr(entry, ',');
+        if(entry != NULL)
+            entry++;
+    }
+
+    return 1;
+}
+
+/* Allocate a queue with at least size frames, rounded to a power of two
+   RETURN:
+    0 if the queue was allocated
+    -1 if an error occurred
+*/
+int queue_init(sched_queue_t *queue, size_t size)
+{
+    size_t capacity = 2;
+    while(capacity < size)
+        capacity <<= 1;
+
+    queue->items = malloc(capacity * sizeof(sched_item_t));
+    queue->mask = capacity - 1;
+    queue->head = queue->tail = 0;
+
+    return queue->items == NULL ? -1 : 0;
+}
+
+/* Copy a frame to the end of the queue, the lock of the session is held
+   RETURN:
+    - false if the queue is full
+*/
+bool queue_push(sched_queue_t *queue, packet_t *packet)
+{
+    if(queue->tail - queue->head > queue->mask)
+        return false;
+
+    sched_item_t *item = &queue->items[queue->tail & queue->mask];
+    memcpy(&item->packet, packet, sizeof(packet_t));
+    item->queued_ns = sched_now_ns();
+    queue->tail++;
+
+    return true;
+}
+
+/* Take the first frame of the queue, the lock of the session is held
+   RETURN:
+    - false if the queue is empty
+*/
+bool queue_pop(sched_queue_t *queue, sched_item_t *item)
+{
+    if(queue->head == queue->tail)
+        return false;
+
+    *item = queue->items[queue->head & queue->mask];
+    queue->head++;
+
+    return true;
+}
+
+/* Frames in the queue */
+size_t queue_depth(sched_queue_t *queue)
+{
+    return queue->tail - queue->head;
+}
+
+/* Nanoseconds of CLOCK_MONOTONIC */
+long long sched_now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
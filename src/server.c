@@ -1,22 +1,84 @@
 #include "../lib/command.h"
 #include "../lib/utils.h"
 #include "../lib/connection.h"
+#include "../lib/frame_cache.h"
+#include "../lib/multicast.h"
+#include "../lib/scheduler.h"
+#include "../lib/catalog.h"
+#include "../lib/discovery.h"
+#include <pthread.h>
 
-int main()
+#define MAX_INTERFACES 8
+
+/* Interface served by a thread */
+typedef struct interface {
+    char *name;
+    int socket;
+    pthread_t thread;
+} interface_t;
+
+char current_directory[100];
+
+/* Auxiliary Functions */
+void *serve_interface(void *arg);
+
+
+int main(int argc, char *argv[])
 {
     system("clear");
-    print_log("Creating socket...");
-    int socket = create_socket("eno1");
-    print_log("Socket created!");
+
+    /* One session per interface, the scheduler shares the server between them */
+    interface_t interfaces[MAX_INTERFACES];
+    int quantity = 0;
+    for(int i = 1; i < argc && quantity < MAX_INTERFACES; i++)
+        interfaces[quantity++].name = argv[i];
+    if(quantity == 0)
+        interfaces[quantity++].name = "eno1";
+
+    bool scheduled = quantity > 1 || get_env_number(SCHED_ENV, 0);
+    for(int i = 0; i < quantity; i++)
+    {
+        print_log("Creating socket...");
+        interfaces[i].socket = create_socket(interfaces[i].name);
+        print_log("Socket created!");
+        if(scheduled)
+            sched_register(interfaces[i].socket, interfaces[i].name);
+    }
     print_log("Server online and working");
-    char current_directory[100];
     get_directory(current_directory, sizeof(current_directory));
     printf("Server location %s\n", current_directory);
 
+    char *cache_directory = getenv(FRAME_CACHE_DIR_ENV);
+    frame_cache_init(cache_directory ? cache_directory : FRAME_CACHE_DEFAULT_DIR,
+                     get_env_number(FRAME_CACHE_SIZE_ENV, 0) * 1024 * 1024);
+
+    for(int i = 1; i < quantity; i++)
+        if(pthread_create(&interfaces[i].thread, NULL, serve_interface, &interfaces[i]) != 0)
+        {
+            fprintf(stderr, "ERROR: couldn't serve %s!\n", interfaces[i].name);
+            exit(EXIT_FAILURE);
+        }
+    serve_interface(&interfaces[0]);
+
+    for(int i = 1; i < quantity; i++)
+        pthread_join(interfaces[i].thread, NULL);
+
+    return 0;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Answer the requests of the clients of an interface until SERVER_OFF */
+void *serve_interface(void *arg)
+{
+    int socket = ((interface_t *) arg)->socket;
     packet_t buffer;
     packet_t *packet = create_or_modify_packet(NULL, 0, 0, ACK, NULL);
 
     char *file_name = NULL;
+    char next_file_name[DATA_SIZE];
+    uint8_t range_data[DATA_SIZE];
+    long long range_offset, range_length, range_size;
     while (1)
     {
         print_log("Waiting request from client...");
@@ -26,7 +88,7 @@ int main()
 
         case ONLINE:
             print_log("ONLINE received!");
-            create_or_modify_packet(packet, 0, 0, ACK, NULL);
+            discovery_answer(&buffer, packet);
             send_packet(packet, socket);
         break;
 
@@ -40,36 +102,75 @@ int main()
 
         case LIST:
             print_log("LIST received!");
-            create_or_modify_packet(packet, 0, 0, ACK, NULL);
-            send_packet(packet, socket);
-            list_video_files_in_directory(current_directory, socket);
+            catalog_serve(current_directory, &buffer, socket);
         break;
 
         case DOWNLOAD:
             print_log("DOWNLOAD received!");
 
             file_name = convert_to_string(buffer.data, buffer.size);
-            if (access(file_name, F_OK) != 0) // Check if the file exists
+            while(file_name != NULL) // The client can queue the next video in the ACK of END_TRANSMISSION
             {
-                print_log("Video doesn't exists!");
-                create_or_modify_packet(packet, MAX_DATA_SIZE, 0, ERROR, "Video doesn't exists");
-                send_packet(packet, socket);
+                if (access(file_name, F_OK) != 0) // Check if the file exists
+                {
+                    print_log("Video doesn't exists!");
+                    create_or_modify_packet(packet, MAX_DATA_SIZE, 0, ERROR, "Video doesn't exists");
+                    send_packet(packet, socket);
+                    free(file_name);
+                    break;
+                }
+                else // The file exists
+                {
+                    print_log("Requested video exists!");
+                    create_or_modify_packet(packet, 0, 0, ACK, NULL);
+                    send_packet(packet, socket);
+                }
+
+                printf("Sending ==> ");
+                printf("%s\n",file_name);
+                send_video(file_name, socket, next_file_name);
                 free(file_name);
-                break;
+                file_name = NULL;
+                if(next_file_name[0] != '\0')
+                    file_name = convert_to_string((uint8_t *) next_file_name, strlen(next_file_name));
             }
-            else // The file exists
+        break;
+
+        case DOWNLOAD_RANGE: // Offset, length and name of the video
+            print_log("DOWNLOAD_RANGE received!");
+            if(buffer.size <= 16)
+                break;
+            memcpy(&range_offset, buffer.data, sizeof(long long));
+            memcpy(&range_length, buffer.data + 8, sizeof(long long));
+            file_name = convert_to_string(buffer.data + 16, buffer.size - 16);
+            range_size = access(file_name, F_OK) == 0 ? get_file_size(file_name) : -1;
+            if(range_size < 0 || range_offset < 0 || range_length < 0 || range_offset > range_size)
             {
-                print_log("Requested video exists!");
-                create_or_modify_packet(packet, 0, 0, ACK, NULL);
+                print_log("Invalid range!");
+                create_or_modify_packet(packet, MAX_DATA_SIZE, 0, ERROR, "Invalid range");
                 send_packet(packet, socket);
+                free(file_name);
+                break;
             }
 
-            printf("Sending ==> ");
-            printf("%s\n",file_name);
-            send_video(file_name, socket);
+            /* The ACK brings the size of the file */
+            memset(range_data, 0, DATA_SIZE);
+            memcpy(range_data, &range_size, sizeof(long long));
+            create_or_modify_packet(packet, sizeof(long long), 0, ACK, range_data);
+            send_packet(packet, socket);
+
+            if(range_length > range_size - range_offset)
+                range_length = range_size - range_offset;
+            if(range_length > 0)
+                send_video_range(file_name, range_offset, range_length, socket);
             free(file_name);
         break;
 
+        case JOIN_GROUP: // Nonce of the client and name of the video
+            print_log("JOIN_GROUP received!");
+            serve_group(&buffer, socket);
+        break;
+
         case END_TRANSMISSION:
             create_or_modify_packet(packet, 0, 0, ACK, NULL);
             send_packet(packet, socket);
@@ -77,11 +178,12 @@ int main()
 
         case SERVER_OFF: // Just for tests
             print_log("EXIT received!");
+            print_socket_stats(socket);
             create_or_modify_packet(packet, 0, 0, ACK, NULL);
             send_packet(packet, socket);
             destroy_packet(packet);
             close(socket);
-            return 0;
+            return NULL;
             break;
 
         default:
@@ -94,5 +196,5 @@ int main()
     destroy_packet(packet);
     close(socket);
     
-    return 0;
+    return NULL;
 }
\ No newline at end of file
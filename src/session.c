@@ -0,0 +1,462 @@
+#include "../lib/session.h"
+#include "../lib/catalog.h"
+#include "../lib/command.h"
+#include "../lib/utils.h"
+#include "../lib/xdp.h"
+#include "../lib/framing.h"
+#include <sys/epoll.h>
+
+/* Auxiliary Functions */
+int start_request(session_t *session, int state, session_callback_t callback, void *context);
+void finish_request(session_t *session, int result);
+void send_request(session_t *session);
+void answer_frame(session_t *session, packet_t *p);
+void expire_session(session_t *session, long long now);
+void take_frames(session_t *session);
+void restart_list(session_t *session);
+void receive_names(session_t *session, packet_t *p);
+void receive_descriptor(session_t *session, packet_t *p);
+void receive_data(session_t *session, packet_t *p);
+int flush_data(session_t *session);
+void send_ack(session_t *session, uint8_t size, uint8_t sequence, uint8_t *data);
+void accept_descriptor(session_t *session);
+
+
+/* *** Main Functions *** */
+
+/* Start a loop without sessions
+   RETURN:
+    - 0 if the loop is ready
+    - -1 if epoll couldn't be created
+*/
+int session_loop_init(session_loop_t *loop)
+{
+    memset(loop, 0, sizeof(session_loop_t));
+    loop->epoll_fd = epoll_create1(0);
+    if(loop->epoll_fd == -1)
+    {
+        fprintf(stderr, "ERROR: couldn't create the loop of the sessions!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the sessions and the loop, the callbacks of busy sessions aren't called */
+void session_loop_destroy(session_loop_t *loop)
+{
+    for(int i = 0; i < loop->quantity; i++)
+    {
+        session_t *session = loop->sessions[i];
+        free(session->names);
+        free(session->changes);
+        free(session->buffer);
+        xdp_detach(session->socket);
+        close(session->socket);
+        free(session);
+    }
+    free(loop->sessions);
+    close(loop->epoll_fd);
+    memset(loop, 0, sizeof(session_loop_t));
+}
+
+/* Wait for frames until timeout_ms or the first deadline of a session, then move the
+   sessions with frames and the ones past their deadline. A negative timeout waits until
+   something happens.
+   RETURN:
+    - The quantity of sessions with a request
+*/
+int session_loop_poll(session_loop_t *loop, long long timeout_ms)
+{
+    struct epoll_event events[SESSION_EVENTS];
+    long long now = get_time_ms(), wait = timeout_ms;
+
+    for(int i = 0; i < loop->quantity; i++)
+    {
+        session_t *session = loop->sessions[i];
+        xdp_flush(session->socket); // Frames queued for AF_XDP go before waiting
+        if(session->state != SESSION_IDLE && (wait < 0 || session->deadline - now < wait))
+            wait = session->deadline > now ? session->deadline - now : 0;
+    }
+
+    int ready = epoll_wait(loop->epoll_fd, events, SESSION_EVENTS, (int) wait);
+    for(int i = 0; i < ready; i++)
+        take_frames(events[i].data.ptr);
+
+    now = get_time_ms();
+    for(int i = 0; i < loop->quantity; i++)
+        if(loop->sessions[i]->state != SESSION_IDLE && loop->sessions[i]->deadline <= now)
+            expire_session(loop->sessions[i], now);
+
+    return loop->busy;
+}
+
+/* Move the sessions until none has a request, the callbacks can start new ones */
+void session_loop_run(session_loop_t *loop)
+{
+    while(loop->busy > 0)
+        session_loop_poll(loop, -1);
+}
+
+/* Put a socket in the loop
+   RETURN:
+    - The session, idle
+    - NULL if it couldn't be watched
+*/
+session_t *session_open(session_loop_t *loop, int socket)
+{
+    if(loop->quantity == loop->size)
+    {
+        int size = loop->size > 0 ? 2 * loop->size : 64;
+        session_t **bigger = realloc(loop->sessions, size * sizeof(session_t *));
+        if(bigger == NULL)
+            return NULL;
+        loop->sessions = bigger;
+        loop->size = size;
+    }
+
+    session_t *session = calloc(1, sizeof(session_t));
+    if(session == NULL)
+        return NULL;
+    session->loop = loop;
+    session->socket = socket;
+    session->state = SESSION_IDLE;
+
+    /* With AF_XDP the frames of the protocol arrive in the other socket */
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = session };
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, socket, &event) == -1 ||
+       (xdp_fd(socket) != -1 && epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, xdp_fd(socket), &event) == -1))
+    {
+        fprintf(stderr, "ERROR: couldn't watch the socket of the session!\n");
+        free(session);
+        return NULL;
+    }
+
+    loop->sessions[loop->quantity++] = session;
+    return session;
+}
+
+/* Ask if the server is online
+   RETURN:
+    - 0 if the request started
+    - ERR_SESSION_BUSY if the session has another request
+*/
+int session_online(session_t *session, session_callback_t callback, void *context)
+{
+    if(start_request(session, SESSION_ONLINE, callback, context) != 0)
+        return ERR_SESSION_BUSY;
+
+    create_or_modify_packet(&session->request, 0, 0, ONLINE, NULL);
+    send_request(session);
+    return 0;
+}
+
+/* Ask for the list of videos, the callback gets the quantity of names in file_names
+   RETURN:
+    - 0 if the request started
+    - ERR_SESSION_BUSY if the session has another request
+*/
+int session_list(session_t *session, char (*file_names)[DATA_SIZE], int max_quantity, session_callback_t callback, void *context)
+{
+    if(start_request(session, SESSION_LIST, callback, context) != 0)
+        return ERR_SESSION_BUSY;
+
+    session->file_names = file_names;
+    session->max_quantity = max_quantity;
+    restart_list(session);
+    return 0;
+}
+
+/* Download a video in fd. There is no delta and no check of the cache, the caller
+   decides where the bytes go.
+   RETURN:
+    - 0 if the request started
+    - ERR_SESSION_BUSY if the session has another request
+*/
+int session_download(session_t *session, char *file_name, int fd, session_callback_t callback, void *context)
+{
+    if(start_request(session, SESSION_DOWNLOAD, callback, context) != 0)
+        return ERR_SESSION_BUSY;
+
+    char name[DATA_SIZE] = {0};
+    strncpy(name, file_name, MAX_FILE_NAME_SIZE);
+    session->fd = fd;
+    session->file_size = 0;
+    create_or_modify_packet(&session->request, strlen(name), 0, DOWNLOAD, name);
+    send_request(session);
+    return 0;
+}
+
+/* *** Auxiliary Functions *** */
+
+int start_request(session_t *session, int state, session_callback_t callback, void *context)
+{
+    if(session->state != SESSION_IDLE)
+        return -1;
+
+    session->state = state;
+    session->callback = callback;
+    session->context = context;
+    session->loop->busy++;
+    return 0;
+}
+
+/* Back to idle before the callback, that can start the next request */
+void finish_request(session_t *session, int result)
+{
+    free(session->names);
+    free(session->changes);
+    free(session->buffer);
+    session->names = NULL;
+    session->changes = NULL;
+    session->buffer = NULL;
+
+    session->state = SESSION_IDLE;
+    session->loop->busy--;
+    if(session->callback != NULL)
+        session->callback(session, result, session->context);
+}
+
+/* Send the request and wait its answer from now */
+void send_request(session_t *session)
+{
+    send_packet(&session->request, session->socket);
+    session->try = 0;
+    session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+}
+
+/* Move the state machine of a session with a frame */
+void answer_frame(session_t *session, packet_t *p)
+{
+    switch(session->state)
+    {
+    case SESSION_ONLINE:
+        if(p->type == ACK)
+            finish_request(session, 0);
+    break;
+
+    case SESSION_LIST:
+        if(p->type != ACK)
+            break;
+        session->answer = catalog_answer(p, &session->version);
+        if(session->answer == CATALOG_NOT_MODIFIED)
+        {
+            int quantity = catalog_load(session->version, session->file_names, session->max_quantity);
+            if(quantity >= 0)
+                finish_request(session, quantity);
+            else
+                restart_list(session); // The cache changed since the LIST
+            break;
+        }
+        session->names = calloc(MAX_LIST_SIZE, DATA_SIZE);
+        session->changes = calloc(MAX_LIST_SIZE, 1);
+        if(session->names == NULL || session->changes == NULL)
+        {
+            finish_request(session, -1);
+            break;
+        }
+        session->quantity = 0;
+        session->state = SESSION_NAMES;
+        session->try = 0;
+        session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+    break;
+
+    case SESSION_NAMES:
+        receive_names(session, p);
+    break;
+
+    case SESSION_DOWNLOAD:
+        if(p->type == ERROR) // The server doesn't have the video
+        {
+            send_ack(session, 0, 0, NULL);
+            finish_request(session, ERR_FILE);
+        }
+        else if(p->type == ACK)
+        {
+            session->state = SESSION_DESCRIPTOR;
+            session->try = 0;
+            session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+        }
+        else if(p->type == DESCRIPTOR) // In place of the ACK
+            receive_descriptor(session, p);
+    break;
+
+    case SESSION_DESCRIPTOR:
+        if(p->type == DESCRIPTOR)
+            receive_descriptor(session, p);
+    break;
+
+    case SESSION_DATA:
+        receive_data(session, p);
+    break;
+    }
+}
+
+/* The request goes again while nothing came back, the transfers only wait for the server
+   to send again, until MAX_TRY */
+void expire_session(session_t *session, long long now)
+{
+    session->try++;
+    if(session->try > MAX_TRY)
+    {
+        finish_request(session, ERR_TIMEOUT_EXPIRED);
+        return;
+    }
+
+    session->deadline = now + SESSION_TIMEOUT_MS;
+    if(session->state == SESSION_ONLINE || session->state == SESSION_LIST || session->state == SESSION_DOWNLOAD)
+        send_packet(&session->request, session->socket);
+}
+
+/* Every frame waiting in the socket moves the session, an idle one drops them */
+void take_frames(session_t *session)
+{
+    packet_t p;
+    int received;
+
+    while((received = receive_packet(&p, session->socket)) == VALID_PACKET)
+        answer_frame(session, &p);
+
+    if(received == ERR_LISTEN) // Nothing more will come from this socket
+    {
+        epoll_ctl(session->loop->epoll_fd, EPOLL_CTL_DEL, session->socket, NULL);
+        if(session->state != SESSION_IDLE)
+            finish_request(session, ERR_LISTEN);
+    }
+}
+
+/* LIST with the version of the cached listing */
+void restart_list(session_t *session)
+{
+    free(session->names);
+    free(session->changes);
+    session->names = NULL;
+    session->changes = NULL;
+
+    session->state = SESSION_LIST;
+    catalog_request(&session->request);
+    send_request(session);
+}
+
+/* Names of the list until END_TRANSMISSION, like list_remote_videos */
+void receive_names(session_t *session, packet_t *p)
+{
+    if(p->type == SHOW_IN_SCREEN)
+    {
+        char name[DATA_SIZE] = {0};
+        memcpy(name, p->data, p->size);
+        // The name is sent again when the ACK is lost
+        if(session->quantity < MAX_LIST_SIZE && (session->quantity == 0 || strcmp(session->names[session->quantity - 1], name) != 0))
+        {
+            session->changes[session->quantity] = p->sequence;
+            memcpy(session->names[session->quantity++], name, DATA_SIZE);
+        }
+        send_ack(session, 0, 0, NULL);
+        session->try = 0;
+        session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+    }
+    else if(p->type == END_TRANSMISSION)
+    {
+        send_ack(session, 0, 0, NULL);
+        int quantity = catalog_apply(session->answer, session->version, session->names, session->changes, session->quantity, MAX_LIST_SIZE);
+        if(quantity < 0) // The delta didn't fit the cache, that was dropped
+        {
+            restart_list(session);
+            return;
+        }
+        if(quantity > session->max_quantity)
+            quantity = session->max_quantity;
+        memcpy(session->file_names, session->names, quantity * DATA_SIZE);
+        finish_request(session, quantity);
+    }
+}
+
+/* Size and layout of the video, the ACK starts the frames */
+void receive_descriptor(session_t *session, packet_t *p)
+{
+    session->file_size = 0;
+    for(size_t i = 0; i < 4; i++)
+        session->file_size |= ((size_t) p->data[i]) << (i * 8);
+    media_unpack_layout(p->data, &session->layout);
+
+    session->buffer = malloc(RECEIVE_BUFFER_SIZE);
+    if(session->buffer == NULL)
+    {
+        finish_request(session, -1);
+        return;
+    }
+    session->buffered = 0;
+    session->offset = 0;
+    session->frames = 0;
+    session->state = SESSION_DATA;
+    session->try = 0;
+    session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+    accept_descriptor(session);
+}
+
+/* Frames of the video in order, like receive_stream. The bytes are written when the
+   buffer fills, so the window advertised is always the whole one. */
+void receive_data(session_t *session, packet_t *p)
+{
+    uint8_t ack_data[DATA_SIZE] = { WINDOW_SIZE };
+
+    if(p->type == DESCRIPTOR && session->frames == 0) // The ACK of the DESCRIPTOR was lost
+        accept_descriptor(session);
+    else if(p->type == END_TRANSMISSION)
+    {
+        int result = flush_data(session);
+        if(result == 0)
+            send_ack(session, 0, 0, NULL);
+        finish_request(session, result);
+    }
+    else if(p->type == DATA && p->sequence == session->frames % (MAX_SEQUENCE + 1))
+    {
+        replace_bytes_client(p->data, DATA_SIZE, 0xFF, 0xFF, 0x88, 0xA8);
+        replace_bytes_client(p->data, DATA_SIZE, 0xEE, 0xEE, 0x81, 0x00);
+        if(session->buffered + p->size > RECEIVE_BUFFER_SIZE && flush_data(session) != 0)
+        {
+            /* The server stops the transfer with an ERROR */
+            create_or_modify_packet(&session->request, MAX_DATA_SIZE, 0, ERROR, "Aborted");
+            send_packet(&session->request, session->socket);
+            finish_request(session, ERR_RECEIVE);
+            return;
+        }
+        memcpy(session->buffer + session->buffered, p->data, p->size);
+        session->buffered += p->size;
+        send_ack(session, 1, p->sequence, ack_data);
+        session->frames++;
+        session->try = 0;
+        session->deadline = get_time_ms() + SESSION_TIMEOUT_MS;
+    }
+}
+
+/* Write the buffered bytes at their offsets
+   RETURN:
+    - 0 if they were written
+    - ERR_RECEIVE if the file couldn't take them
+*/
+int flush_data(session_t *session)
+{
+    if(session->buffered > 0 &&
+       media_pwrite(session->fd, &session->layout, session->buffer, session->buffered, session->offset) != (ssize_t) session->buffered)
+    {
+        fprintf(stderr, "ERROR: couldn't write the video of the session!\n");
+        return ERR_RECEIVE;
+    }
+    session->offset += session->buffered;
+    session->buffered = 0;
+    return 0;
+}
+
+void send_ack(session_t *session, uint8_t size, uint8_t sequence, uint8_t *data)
+{
+    packet_t ack;
+    create_or_modify_packet(&ack, size, sequence, ACK, data);
+    send_packet(&ack, session->socket);
+}
+
+/* The ACK of the DESCRIPTOR takes the adaptive frames */
+void accept_descriptor(session_t *session)
+{
+    uint8_t data[DATA_SIZE] = {0};
+    send_ack(session, frames_accept(data), 0, data);
+}
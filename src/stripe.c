@@ -0,0 +1,293 @@
+#include "../lib/stripe.h"
+#include "../lib/command.h"
+#include "../lib/utils.h"
+#include <pthread.h>
+
+struct stripe_path;
+
+/* Download shared by the paths, ranges are taken in order */
+typedef struct stripe_job {
+    pthread_mutex_t lock;
+    pthread_cond_t range_ended; // A range was received or given back
+    char *file_name;
+    int fd;
+    long long file_size;
+    long long next_offset; // First byte not given to a path yet
+    long long retry_offset[MAX_STRIPE_PATHS]; // Ranges given back by failed paths
+    long long retry_length[MAX_STRIPE_PATHS];
+    int retry_quantity;
+    int in_flight; // Ranges taken by a path and not ended yet
+    long long done_bytes;
+    struct stripe_path *paths;
+    int paths_quantity;
+} stripe_job_t;
+
+/* One interface, with its own socket and thread */
+typedef struct stripe_path {
+    stripe_job_t *job;
+    char *interface;
+    int socket;
+    pthread_t thread;
+    long long bytes;
+    double seconds;
+    int failures;
+    bool retired;
+} stripe_path_t;
+
+/* Auxiliary Functions */
+int stripe_transfer(stripe_job_t *job);
+void *stripe_worker(void *arg);
+bool take_range(stripe_path_t *path, long long *offset, long long *length);
+void give_back_range(stripe_job_t *job, long long offset, long long length);
+double path_rate(stripe_path_t *path);
+double now_seconds();
+
+
+/* *** Main Functions *** */
+
+/* Download a video over many interfaces: each path asks for the next byte range
+   when it finishes the last one, so a faster path serves more of the file.
+   RETURN:
+    0 if the video was downloaded
+    -1 if an error occurred
+*/
+int download_striped(char *file_name, char **interfaces, int quantity)
+{
+    if(quantity <= 0 || quantity > MAX_STRIPE_PATHS || strlen(file_name) > MAX_RANGE_NAME_SIZE)
+    {
+        fprintf(stderr, "ERROR: use 1 to %d interfaces and names up to %d characters!\n", MAX_STRIPE_PATHS, MAX_RANGE_NAME_SIZE);
+        return -1;
+    }
+
+    stripe_path_t paths[MAX_STRIPE_PATHS];
+    stripe_job_t job;
+    memset(paths, 0, sizeof(paths));
+    memset(&job, 0, sizeof(job));
+    job.file_name = file_name;
+    job.paths = paths;
+    job.paths_quantity = quantity;
+
+    for(int i = 0; i < quantity; i++)
+    {
+        paths[i].job = &job;
+        paths[i].interface = interfaces[i];
+        paths[i].socket = create_socket(interfaces[i]);
+        if(paths[i].socket < 0)
+        {
+            for(int j = 0; j < i; j++)
+                close(paths[j].socket);
+            return -1;
+        }
+    }
+
+    int result = stripe_transfer(&job);
+
+    for(int i = 0; i < quantity; i++)
+        close(paths[i].socket);
+
+    return result;
+}
+
+/* Ask a range of the video, the ACK brings the size of the file
+   RETURN:
+    0 if the server accepted the range
+    -1 if an error occurred
+*/
+int request_range(char *file_name, long long offset, long long length, long long *file_size, int socket)
+{
+    uint8_t data_buffer[DATA_SIZE] = {0};
+    memcpy(data_buffer, &offset, sizeof(long long));
+    memcpy(data_buffer + 8, &length, sizeof(long long));
+    memcpy(data_buffer + 16, file_name, strlen(file_name));
+
+    packet_t *p = create_or_modify_packet(NULL, 16 + strlen(file_name), 0, DOWNLOAD_RANGE, data_buffer);
+    if(send_packet_stop_wait(p, p, TIMEOUT, socket) != 0 || p->type != ACK || p->size < sizeof(long long))
+    {
+        destroy_packet(p);
+        return -1;
+    }
+
+    memcpy(file_size, p->data, sizeof(long long));
+    destroy_packet(p);
+
+    return 0;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Preallocate the file and run one thread per path until every range is received */
+int stripe_transfer(stripe_job_t *job)
+{
+    stripe_path_t *paths = job->paths;
+    int quantity = job->paths_quantity;
+    char *file_name = job->file_name;
+
+    /* An empty range only returns the size of the file */
+    if(request_range(file_name, 0, 0, &job->file_size, paths[0].socket) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't get %s from the server!\n", file_name);
+        return -1;
+    }
+
+    if(can_download_file(job->file_size) == 0)
+    {
+        printf("The file couldn't be downloaded, size is greater than the free space in disk!\n");
+        return -1;
+    }
+
+    job->fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(job->fd == -1)
+    {
+        fprintf(stderr, "Error opening the file");
+        return -1;
+    }
+    if(posix_fallocate(job->fd, 0, job->file_size) != 0 && ftruncate(job->fd, job->file_size) != 0)
+        fprintf(stderr, "ERROR: couldn't preallocate %s\n", file_name);
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->range_ended, NULL);
+    double start = now_seconds();
+
+    for(int i = 0; i < quantity; i++)
+        pthread_create(&paths[i].thread, NULL, stripe_worker, &paths[i]);
+    for(int i = 0; i < quantity; i++)
+        pthread_join(paths[i].thread, NULL);
+
+    double seconds = now_seconds() - start;
+    pthread_cond_destroy(&job->range_ended);
+    pthread_mutex_destroy(&job->lock);
+    close(job->fd);
+
+    printf("\n");
+    for(int i = 0; i < quantity; i++)
+        printf("%s: %lld bytes, %.2f MB/s%s\n", paths[i].interface, paths[i].bytes,
+               path_rate(&paths[i]) / (1024 * 1024), paths[i].retired ? " (retired)" : "");
+
+    if(job->done_bytes != job->file_size)
+    {
+        fprintf(stderr, "ERROR: every path failed, %lld of %lld bytes received!\n", job->done_bytes, job->file_size);
+        return -1;
+    }
+
+    printf("%s downloaded in %.2f s!\n", file_name, seconds);
+    return 0;
+}
+
+/* Receive ranges in one path until the file is complete or the path fails too much */
+void *stripe_worker(void *arg)
+{
+    stripe_path_t *path = arg;
+    stripe_job_t *job = path->job;
+    long long offset, length, file_size;
+
+    while(take_range(path, &offset, &length))
+    {
+        double start = now_seconds();
+
+        if(request_range(job->file_name, offset, length, &file_size, path->socket) != 0 ||
+           receive_stream(job->fd, offset, NULL, length, NULL, NULL, NULL, path->socket) != 0)
+        {
+            give_back_range(job, offset, length);
+            path->failures++;
+            if(path->failures >= MAX_PATH_FAILURES)
+            {
+                fprintf(stderr, "\nPath %s is failing, moving its work to the others\n", path->interface);
+                pthread_mutex_lock(&job->lock);
+                path->retired = true;
+                pthread_mutex_unlock(&job->lock);
+                break;
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        path->failures = 0;
+        path->bytes += length;
+        path->seconds += now_seconds() - start;
+        job->done_bytes += length;
+        job->in_flight--;
+        pthread_cond_broadcast(&job->range_ended);
+        printf("\r%s: ", job->file_name);
+        print_progress(job->file_size, job->done_bytes, 1);
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    return NULL;
+}
+
+/* Give the next range to a path. The size of the range follows the rate of the
+   path against the fastest one, so a slow path doesn't hold the end of the file.
+   With every range taken the path waits the ones in flight, a failed path may give
+   its range back.
+   RETURN:
+    true if there is a range for the path
+    false if every range was received, or no other path can give one back
+*/
+bool take_range(stripe_path_t *path, long long *offset, long long *length)
+{
+    stripe_job_t *job = path->job;
+    bool found = true;
+
+    pthread_mutex_lock(&job->lock);
+
+    while(job->retry_quantity == 0 && job->next_offset >= job->file_size && job->in_flight > 0)
+        pthread_cond_wait(&job->range_ended, &job->lock);
+
+    if(job->retry_quantity > 0)
+    {
+        job->retry_quantity--;
+        *offset = job->retry_offset[job->retry_quantity];
+        *length = job->retry_length[job->retry_quantity];
+    }
+    else if(job->next_offset < job->file_size)
+    {
+        double rate = path_rate(path), best_rate = rate;
+        for(int i = 0; i < job->paths_quantity; i++)
+            if(!job->paths[i].retired && path_rate(&job->paths[i]) > best_rate)
+                best_rate = path_rate(&job->paths[i]);
+
+        long long chunk = STRIPE_CHUNK_SIZE;
+        if(rate > 0 && best_rate > 0)
+            chunk = (long long)(STRIPE_CHUNK_SIZE * (rate / best_rate));
+        if(chunk < STRIPE_MIN_CHUNK)
+            chunk = STRIPE_MIN_CHUNK;
+
+        *offset = job->next_offset;
+        *length = job->file_size - job->next_offset < chunk ? job->file_size - job->next_offset : chunk;
+        job->next_offset += *length;
+    }
+    else
+        found = false;
+
+    if(found)
+        job->in_flight++;
+    pthread_mutex_unlock(&job->lock);
+
+    return found;
+}
+
+/* Put back a range that failed, another path will take it */
+void give_back_range(stripe_job_t *job, long long offset, long long length)
+{
+    pthread_mutex_lock(&job->lock);
+    job->retry_offset[job->retry_quantity] = offset;
+    job->retry_length[job->retry_quantity] = length;
+    job->retry_quantity++;
+    job->in_flight--;
+    pthread_cond_broadcast(&job->range_ended);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Bytes per second of a path */
+double path_rate(stripe_path_t *path)
+{
+    return path->seconds > 0 ? path->bytes / path->seconds : 0;
+}
+
+/* Monotonic time in seconds */
+double now_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -12,8 +12,8 @@ long long int get_file_size(char *file_name)
     return file_stat.st_size;
 }
 
-/* Get the date of a file */
-struct tm *get_file_date(char *file_name)
+/* Get the date of a file in date, localtime_r keeps it apart from other threads */
+struct tm *get_file_date(char *file_name, struct tm *date)
 {
     struct stat file_stat;
     if(stat(file_name, &file_stat) == -1)
@@ -21,7 +21,7 @@ struct tm *get_file_date(char *file_name)
         fprintf(stderr, "ERROR: couldn't get file date!\n");
         return NULL;
     }
-    return localtime(&file_stat.st_mtime);
+    return localtime_r(&file_stat.st_mtime, date);
 }
 
 /* Set the date of a file */
@@ -123,10 +123,11 @@ void print_log(const char* msg)
    time_t now;
    time(&now);
 
-   struct tm* local_time = localtime(&now);
+   struct tm local_time;
+   localtime_r(&now, &local_time);
    
    char time_stamp[20];
-   strftime(time_stamp, sizeof(time_stamp), "%d-%m-%Y %H:%M:%S", local_time);
+   strftime(time_stamp, sizeof(time_stamp), "%d-%m-%Y %H:%M:%S", &local_time);
 
    printf("%s - %s\n", msg , time_stamp);
 }
@@ -201,6 +202,37 @@ int can_download_file(size_t video_size) {
     }
 }
 
+/* Read a numeric setting from the environment
+   RETURN:
+    - The value of the variable
+    - default_value if it doesn't exist or isn't a number
+*/
+long long get_env_number(const char *name, long long default_value)
+{
+    char *value = getenv(name);
+    char *end;
+
+    if(value == NULL || *value == '\0')
+        return default_value;
+
+    long long number = strtoll(value, &end, 10);
+    if(*end != '\0')
+    {
+        fprintf(stderr, "ERROR: invalid value for %s, using %lld\n", name, default_value);
+        return default_value;
+    }
+
+    return number;
+}
+
+/* Milliseconds of a monotonic clock, not changed by the date of the system */
+long long get_time_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
 void convert_to_tm_struct(char *date_str, struct tm *tm)
 {
     memset(tm, 0, sizeof(struct tm));
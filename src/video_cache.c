@@ -0,0 +1,276 @@
+#include "../lib/video_cache.h"
+#include "../lib/utils.h"
+#include "../lib/delta.h"
+#include <sys/mman.h>
+#include <errno.h>
+
+/* Index of the cache, only the client uses it */
+video_entry_t video_entries[MAX_VIDEO_CACHE_ENTRIES];
+size_t video_quantity = 0, video_quota = 0;
+long long video_ttl = VIDEO_CACHE_TTL_S;
+char pinned_name[DATA_SIZE]; // Playing, the prefetch must not evict it
+
+/* Auxiliary Functions */
+int find_entry(const char *name);
+void drop_entry(size_t index);
+int save_index();
+int hash_file(const char *name, uint64_t *hash);
+size_t cached_bytes();
+
+
+/* *** Main Functions *** */
+
+/* Move to the cache directory, so every download lands there, and read the index
+   RETURN:
+    0 if the cache is ready
+    -1 if the directory can't be used, the current one is kept
+*/
+int video_cache_init()
+{
+    video_quota = get_env_number(VIDEO_CACHE_SIZE_ENV, 0) * 1024 * 1024;
+    video_ttl = get_env_number(VIDEO_CACHE_TTL_ENV, VIDEO_CACHE_TTL_S);
+
+    char *directory = getenv(VIDEO_CACHE_DIR_ENV);
+    if(directory != NULL && ((mkdir(directory, 0755) != 0 && errno != EEXIST) || chdir(directory) != 0))
+    {
+        fprintf(stderr, "ERROR: couldn't use the cache directory %s!\n", directory);
+        return -1;
+    }
+
+    FILE *index = fopen(VIDEO_CACHE_INDEX, "r");
+    if(index == NULL)
+        return 0;
+
+    video_entry_t entry;
+    unsigned long long hash;
+    long long mtime, last_played, checked;
+    char line[DATA_SIZE * 2];
+    int name_start;
+    while(video_quantity < MAX_VIDEO_CACHE_ENTRIES && fgets(line, sizeof(line), index) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if(sscanf(line, "%zu %lld %llx %lld %lld%n", &entry.size, &mtime, &hash, &last_played, &checked, &name_start) != 5 ||
+           line[name_start] != ' ' || line[name_start + 1] == '\0' || strlen(line + name_start + 1) >= sizeof(entry.name))
+            continue;
+
+        strcpy(entry.name, line + name_start + 1);
+        entry.mtime = mtime;
+        entry.hash = hash;
+        entry.last_played = last_played;
+        entry.checked = checked;
+        video_entries[video_quantity++] = entry;
+    }
+    fclose(index);
+
+    return 0;
+}
+
+/* A hit is a copy confirmed by the server less than the TTL ago, with the
+   size and date of the index. Only a copy with another date is hashed, a copy
+   changed on disk leaves the index.
+   RETURN:
+    - If the video can be played without the network
+*/
+bool video_cache_hit(const char *name)
+{
+    int index = find_entry(name);
+    if(index < 0)
+        return false;
+
+    video_entry_t *entry = &video_entries[index];
+    struct stat file_stat;
+    uint64_t hash;
+    if(stat(name, &file_stat) != 0 || (size_t) file_stat.st_size != entry->size ||
+       (file_stat.st_mtime != entry->mtime && (hash_file(name, &hash) != 0 || hash != entry->hash)))
+    {
+        drop_entry(index);
+        save_index();
+        return false;
+    }
+    if(file_stat.st_mtime != entry->mtime) // Same bytes with a new date, the next hit won't hash it
+    {
+        entry->mtime = file_stat.st_mtime;
+        save_index();
+    }
+
+    return time(NULL) - entry->checked < video_ttl;
+}
+
+/* Evict the least recently played videos, except name and the pinned one, until size bytes fit
+   in the quota and in the disk
+   RETURN:
+    0 if the video fits
+    ERR_DISK_FULL if it doesn't fit even with the cache empty
+*/
+int video_cache_reserve(size_t size, const char *name)
+{
+    int current = find_entry(name);
+    size_t replaced = current < 0 ? 0 : video_entries[current].size; // An old copy is overwritten
+
+    while(1)
+    {
+        size_t used = cached_bytes() - replaced;
+        if((video_quota == 0 || used + size <= video_quota) && can_download_file(size))
+            return 0;
+
+        int oldest = -1;
+        for(size_t i = 0; i < video_quantity; i++)
+            if((int) i != current && strcmp(video_entries[i].name, pinned_name) != 0 &&
+               (oldest < 0 || video_entries[i].last_played < video_entries[oldest].last_played))
+                oldest = i;
+        if(oldest < 0)
+            return ERR_DISK_FULL;
+
+        printf("Removing %s from the cache\n", video_entries[oldest].name);
+        remove(video_entries[oldest].name);
+        drop_entry(oldest);
+        current = find_entry(name); // The entries moved
+        save_index();
+    }
+}
+
+/* Put a video in the index, or update it, as confirmed by the server now.
+   A copy with the size and date of its entry keeps the hash. */
+void video_cache_add(const char *name)
+{
+    struct stat file_stat;
+    if(stat(name, &file_stat) != 0 || strlen(name) > MAX_FILE_NAME_SIZE)
+        return;
+
+    int index = find_entry(name);
+    bool changed = index < 0 || (size_t) file_stat.st_size != video_entries[index].size ||
+                   file_stat.st_mtime != video_entries[index].mtime;
+    uint64_t hash = index < 0 ? 0 : video_entries[index].hash;
+    if(changed && hash_file(name, &hash) != 0)
+        return;
+
+    if(index < 0)
+    {
+        if(video_quantity == MAX_VIDEO_CACHE_ENTRIES)
+            return;
+        index = video_quantity++;
+        memset(&video_entries[index], 0, sizeof(video_entry_t));
+        strcpy(video_entries[index].name, name);
+        video_entries[index].last_played = time(NULL);
+    }
+
+    video_entries[index].size = file_stat.st_size;
+    video_entries[index].mtime = file_stat.st_mtime;
+    video_entries[index].hash = hash;
+    video_entries[index].checked = time(NULL);
+    save_index();
+}
+
+/* Mark a video as played now, the last ones to be evicted */
+void video_cache_played(const char *name)
+{
+    int index = find_entry(name);
+    if(index < 0)
+        return;
+
+    video_entries[index].last_played = time(NULL);
+    save_index();
+}
+
+/* The prefetch runs while a video plays, the pin is set and released with the link lock of the foreground */
+void video_cache_pin(const char *name)
+{
+    snprintf(pinned_name, sizeof(pinned_name), "%s", name != NULL ? name : "");
+}
+
+/* Delete a video and its entry */
+void video_cache_remove(const char *name)
+{
+    int index = find_entry(name);
+    if(index >= 0)
+    {
+        drop_entry(index);
+        save_index();
+    }
+    remove(name);
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Position of a video in the index, -1 if it isn't there */
+int find_entry(const char *name)
+{
+    for(size_t i = 0; i < video_quantity; i++)
+        if(strcmp(video_entries[i].name, name) == 0)
+            return i;
+
+    return -1;
+}
+
+/* Remove an entry, the last one takes its place */
+void drop_entry(size_t index)
+{
+    video_entries[index] = video_entries[--video_quantity];
+}
+
+/* Write the index in a new file and replace the old one
+   RETURN:
+    0 if the index was saved
+    -1 if an error occurred
+*/
+int save_index()
+{
+    FILE *index = fopen(VIDEO_CACHE_INDEX ".tmp", "w");
+    if(index == NULL)
+    {
+        fprintf(stderr, "ERROR: couldn't save the cache index!\n");
+        return -1;
+    }
+
+    for(size_t i = 0; i < video_quantity; i++)
+        fprintf(index, "%zu %lld %016llx %lld %lld %s\n", video_entries[i].size,
+                (long long) video_entries[i].mtime, (unsigned long long) video_entries[i].hash,
+                (long long) video_entries[i].last_played, (long long) video_entries[i].checked, video_entries[i].name);
+    fclose(index);
+
+    return rename(VIDEO_CACHE_INDEX ".tmp", VIDEO_CACHE_INDEX);
+}
+
+/* Hash of the whole file, with the strong checksum of the delta
+   RETURN:
+    0 if hash has the value
+    -1 if the file can't be read
+*/
+int hash_file(const char *name, uint64_t *hash)
+{
+    int fd = open(name, O_RDONLY);
+    struct stat file_stat;
+    if(fd == -1 || fstat(fd, &file_stat) != 0)
+    {
+        if(fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    if(file_stat.st_size == 0)
+    {
+        close(fd);
+        *hash = delta_strong_checksum(NULL, 0);
+        return 0;
+    }
+
+    uint8_t *map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return -1;
+
+    *hash = delta_strong_checksum(map, file_stat.st_size);
+    munmap(map, file_stat.st_size);
+
+    return 0;
+}
+
+/* Bytes of the videos in the index */
+size_t cached_bytes()
+{
+    size_t used = 0;
+    for(size_t i = 0; i < video_quantity; i++)
+        used += video_entries[i].size;
+
+    return used;
+}
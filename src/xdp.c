@@ -0,0 +1,382 @@
+#define _GNU_SOURCE // syscall() for bpf
+#include "../lib/xdp.h"
+#include "../lib/utils.h"
+#include <linux/if_xdp.h>
+#include <linux/if_link.h>
+#include <linux/bpf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <stddef.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+/* Ring shared with the kernel */
+typedef struct xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descriptors;
+    void *map;
+    size_t map_size;
+    uint32_t mask;
+} xdp_ring_t;
+
+/* AF_XDP socket with its UMEM and rings */
+typedef struct xdp_socket {
+    int fd;
+    uint8_t *umem;
+    xdp_ring_t fill, completion, rx, tx;
+    uint64_t tx_free[XDP_FRAMES / 2]; // Stack of free transmit frames
+    int tx_free_quantity;
+    int tx_pending; // Frames queued since the last wake up, the thread waiting the ACKs also flushes
+    int map_fd, prog_fd, link_fd;
+} xdp_socket_t;
+
+/* AF_XDP sockets, indexed by the raw socket */
+xdp_socket_t *xdp_sockets[XDP_MAX_SOCKETS];
+
+/* Auxiliary Functions */
+int map_ring(int fd, xdp_ring_t *ring, struct xdp_ring_offset *offset, size_t descriptor_size, off_t page_offset);
+int attach_program(xdp_socket_t *xsk, int ifindex, int queue);
+int sys_bpf(int command, union bpf_attr *attr);
+void reclaim_completions(xdp_socket_t *xsk);
+void close_xdp_socket(xdp_socket_t *xsk);
+
+
+/* *** Main Functions *** */
+
+/* Create an AF_XDP socket in the queue of the interface, register its UMEM and rings
+   and load the XDP program that redirects the frames of the protocol to it.
+   Zero copy is tried first, copy mode works in any interface (veth, lo).
+   RETURN:
+    0 if the socket is ready
+    ERR_XDP if an error occurred, the raw socket keeps working alone
+*/
+int xdp_attach(int raw_socket, char *device)
+{
+    if(raw_socket < 0 || raw_socket >= XDP_MAX_SOCKETS)
+        return ERR_XDP;
+
+    int ifindex = if_nametoindex(device);
+    int queue = get_env_number(XDP_QUEUE_ENV, 0);
+    xdp_socket_t *xsk = calloc(1, sizeof(xdp_socket_t));
+    if(ifindex == 0 || xsk == NULL)
+    {
+        free(xsk);
+        return ERR_XDP;
+    }
+    xsk->map_fd = xsk->prog_fd = xsk->link_fd = -1;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if(xsk->fd == -1 || posix_memalign((void **) &xsk->umem, getpagesize(), (size_t) XDP_FRAMES * XDP_FRAME_SIZE) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't create AF_XDP socket!\n");
+        close_xdp_socket(xsk);
+        return ERR_XDP;
+    }
+
+    struct xdp_umem_reg umem_reg;
+    memset(&umem_reg, 0, sizeof(umem_reg));
+    umem_reg.addr = (uintptr_t) xsk->umem;
+    umem_reg.len = (uint64_t) XDP_FRAMES * XDP_FRAME_SIZE;
+    umem_reg.chunk_size = XDP_FRAME_SIZE;
+
+    int ring_size = XDP_RING_SIZE;
+    struct xdp_mmap_offsets offsets;
+    socklen_t offsets_size = sizeof(offsets);
+
+    if(setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &umem_reg, sizeof(umem_reg)) == -1 ||
+       setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(int)) == -1 ||
+       setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(int)) == -1 ||
+       setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(int)) == -1 ||
+       setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(int)) == -1 ||
+       getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_size) == -1 ||
+       map_ring(xsk->fd, &xsk->fill, &offsets.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING) != 0 ||
+       map_ring(xsk->fd, &xsk->completion, &offsets.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) != 0 ||
+       map_ring(xsk->fd, &xsk->rx, &offsets.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING) != 0 ||
+       map_ring(xsk->fd, &xsk->tx, &offsets.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't set up the AF_XDP rings!\n");
+        close_xdp_socket(xsk);
+        return ERR_XDP;
+    }
+
+    /* Receive frames go to the fill ring, transmit frames to the free stack */
+    uint64_t *fill = xsk->fill.descriptors;
+    for(int i = 0; i < XDP_FRAMES / 2; i++)
+    {
+        fill[i & xsk->fill.mask] = (uint64_t) i * XDP_FRAME_SIZE;
+        xsk->tx_free[xsk->tx_free_quantity++] = (uint64_t)(XDP_FRAMES / 2 + i) * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(xsk->fill.producer, XDP_FRAMES / 2, __ATOMIC_RELEASE);
+
+    struct sockaddr_xdp address;
+    memset(&address, 0, sizeof(address));
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = ifindex;
+    address.sxdp_queue_id = queue;
+    address.sxdp_flags = XDP_ZEROCOPY;
+    if(bind(xsk->fd, (struct sockaddr *) &address, sizeof(address)) == -1)
+    {
+        address.sxdp_flags = XDP_COPY;
+        if(bind(xsk->fd, (struct sockaddr *) &address, sizeof(address)) == -1)
+        {
+            fprintf(stderr, "ERROR: couldn't bind AF_XDP socket to %s!\n", device);
+            close_xdp_socket(xsk);
+            return ERR_XDP;
+        }
+    }
+
+    if(attach_program(xsk, ifindex, queue) != 0)
+    {
+        fprintf(stderr, "ERROR: couldn't attach the XDP program to %s!\n", device);
+        close_xdp_socket(xsk);
+        return ERR_XDP;
+    }
+
+    xdp_sockets[raw_socket] = xsk;
+    printf("AF_XDP on %s queue %d (%s mode)\n", device, queue, address.sxdp_flags == XDP_COPY ? "copy" : "zero copy");
+
+    return 0;
+}
+
+/* Release the AF_XDP socket of a raw socket, detaching the program */
+void xdp_detach(int socket)
+{
+    if(xdp_fd(socket) == -1)
+        return;
+
+    close_xdp_socket(xdp_sockets[socket]);
+    xdp_sockets[socket] = NULL;
+}
+
+/* AF_XDP file descriptor of a raw socket, -1 if there is none */
+int xdp_fd(int socket)
+{
+    if(socket < 0 || socket >= XDP_MAX_SOCKETS || xdp_sockets[socket] == NULL)
+        return -1;
+
+    return xdp_sockets[socket]->fd;
+}
+
+/* Copy a frame to a free UMEM frame and queue it in the TX ring,
+   the kernel is woken up after XDP_TX_BATCH frames or by xdp_flush
+   RETURN:
+    0 if the frame was queued
+    ERR_XDP if there is no AF_XDP socket or the ring stayed full
+*/
+int xdp_send(int socket, const void *frame, size_t length)
+{
+    if(xdp_fd(socket) == -1 || length > XDP_FRAME_SIZE)
+        return ERR_XDP;
+
+    xdp_socket_t *xsk = xdp_sockets[socket];
+
+    reclaim_completions(xsk);
+    for(int try = 0; xsk->tx_free_quantity == 0 && try < MAX_TRY; try++)
+    {
+        xdp_flush(socket);
+        struct pollfd pfd = { .fd = xsk->fd, .events = POLLOUT };
+        poll(&pfd, 1, 1);
+        reclaim_completions(xsk);
+    }
+    if(xsk->tx_free_quantity == 0)
+        return ERR_XDP;
+
+    uint64_t address = xsk->tx_free[--xsk->tx_free_quantity];
+    memcpy(xsk->umem + address, frame, length);
+
+    uint32_t producer = *xsk->tx.producer;
+    struct xdp_desc *descriptors = xsk->tx.descriptors;
+    descriptors[producer & xsk->tx.mask].addr = address;
+    descriptors[producer & xsk->tx.mask].len = length;
+    descriptors[producer & xsk->tx.mask].options = 0;
+    __atomic_store_n(xsk->tx.producer, producer + 1, __ATOMIC_RELEASE);
+
+    if(__atomic_add_fetch(&xsk->tx_pending, 1, __ATOMIC_ACQ_REL) >= XDP_TX_BATCH)
+        xdp_flush(socket);
+
+    return 0;
+}
+
+/* Wake up the kernel to send the frames in the TX ring. The count is taken before the
+   wake up, a frame queued meanwhile is left for the next one. */
+void xdp_flush(int socket)
+{
+    if(xdp_fd(socket) == -1 || __atomic_exchange_n(&xdp_sockets[socket]->tx_pending, 0, __ATOMIC_ACQ_REL) == 0)
+        return;
+
+    sendto(xdp_sockets[socket]->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+}
+
+/* Copy a frame out of the RX ring and give its UMEM frame back to the fill ring
+   RETURN:
+    - The size of the frame
+    - 0 if the ring is empty
+    - ERR_XDP if there is no AF_XDP socket
+*/
+ssize_t xdp_receive(int socket, void *buffer, size_t length)
+{
+    if(xdp_fd(socket) == -1)
+        return ERR_XDP;
+
+    xdp_socket_t *xsk = xdp_sockets[socket];
+    uint32_t consumer = *xsk->rx.consumer;
+
+    if(consumer == __atomic_load_n(xsk->rx.producer, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct xdp_desc *descriptor = &((struct xdp_desc *) xsk->rx.descriptors)[consumer & xsk->rx.mask];
+    size_t copied = descriptor->len < length ? descriptor->len : length;
+    uint64_t address = descriptor->addr;
+    memcpy(buffer, xsk->umem + address, copied);
+    __atomic_store_n(xsk->rx.consumer, consumer + 1, __ATOMIC_RELEASE);
+
+    uint32_t producer = *xsk->fill.producer;
+    ((uint64_t *) xsk->fill.descriptors)[producer & xsk->fill.mask] = address & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+    __atomic_store_n(xsk->fill.producer, producer + 1, __ATOMIC_RELEASE);
+
+    return copied;
+}
+
+/* *** Auxiliary Functions *** */
+
+/* Map one of the rings of the socket */
+int map_ring(int fd, xdp_ring_t *ring, struct xdp_ring_offset *offset, size_t descriptor_size, off_t page_offset)
+{
+    ring->map_size = offset->desc + XDP_RING_SIZE * descriptor_size;
+    ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_offset);
+    if(ring->map == MAP_FAILED)
+    {
+        ring->map = NULL;
+        return ERR_XDP;
+    }
+
+    ring->producer = (uint32_t *)((uint8_t *) ring->map + offset->producer);
+    ring->consumer = (uint32_t *)((uint8_t *) ring->map + offset->consumer);
+    ring->flags = (uint32_t *)((uint8_t *) ring->map + offset->flags);
+    ring->descriptors = (uint8_t *) ring->map + offset->desc;
+    ring->mask = XDP_RING_SIZE - 1;
+
+    return 0;
+}
+
+/* Load the XDP program: frames starting with START_MARKER go to the socket of
+   their queue through a XSKMAP, anything else goes on to the kernel stack.
+   The driver mode is tried first, generic (SKB) mode works everywhere.
+*/
+int attach_program(xdp_socket_t *xsk, int ifindex, int queue)
+{
+    union bpf_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = XDP_MAX_SOCKETS;
+    xsk->map_fd = sys_bpf(BPF_MAP_CREATE, &attr);
+    if(xsk->map_fd < 0)
+        return ERR_XDP;
+
+    uint32_t key = queue, value = xsk->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xsk->map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) &value;
+    if(sys_bpf(BPF_MAP_UPDATE_ELEM, &attr) != 0)
+        return ERR_XDP;
+
+    struct bpf_insn program[] = {
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data), 0 },
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end), 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0 },
+        { BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, 1 },
+        { BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 8, 0 }, // Empty frame, pass
+        { BPF_LDX | BPF_MEM | BPF_B, BPF_REG_4, BPF_REG_2, 0, 0 },
+        { BPF_JMP | BPF_JNE | BPF_K, BPF_REG_4, 0, 6, START_MARKER }, // Not our protocol, pass
+        { BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, rx_queue_index), 0 },
+        { BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xsk->map_fd },
+        { 0, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+        { BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS },
+        { BPF_JMP | BPF_EXIT, 0, 0, 0, 0 },
+    };
+    char license[] = "GPL";
+    char log[4096] = {0};
+
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) program;
+    attr.insn_cnt = sizeof(program) / sizeof(program[0]);
+    attr.license = (uintptr_t) license;
+    attr.log_buf = (uintptr_t) log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    xsk->prog_fd = sys_bpf(BPF_PROG_LOAD, &attr);
+    if(xsk->prog_fd < 0)
+    {
+        fprintf(stderr, "%s\n", log);
+        return ERR_XDP;
+    }
+
+    uint32_t modes[] = { XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE };
+    for(int i = 0; i < 2 && xsk->link_fd < 0; i++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.link_create.prog_fd = xsk->prog_fd;
+        attr.link_create.target_ifindex = ifindex;
+        attr.link_create.attach_type = BPF_XDP;
+        attr.link_create.flags = modes[i];
+        xsk->link_fd = sys_bpf(BPF_LINK_CREATE, &attr);
+    }
+
+    return xsk->link_fd < 0 ? ERR_XDP : 0;
+}
+
+/* The bpf system call, there is no wrapper in libc */
+int sys_bpf(int command, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, command, attr, sizeof(union bpf_attr));
+}
+
+/* Put the frames the kernel already sent back in the free stack */
+void reclaim_completions(xdp_socket_t *xsk)
+{
+    uint32_t consumer = *xsk->completion.consumer;
+    uint32_t producer = __atomic_load_n(xsk->completion.producer, __ATOMIC_ACQUIRE);
+    uint64_t *addresses = xsk->completion.descriptors;
+
+    for(; consumer != producer; consumer++)
+        xsk->tx_free[xsk->tx_free_quantity++] = addresses[consumer & xsk->completion.mask];
+
+    __atomic_store_n(xsk->completion.consumer, consumer, __ATOMIC_RELEASE);
+}
+
+/* Close the socket, the program and unmap everything */
+void close_xdp_socket(xdp_socket_t *xsk)
+{
+    xdp_ring_t *rings[] = { &xsk->fill, &xsk->completion, &xsk->rx, &xsk->tx };
+
+    if(xsk->link_fd >= 0)
+        close(xsk->link_fd); // Detaches the program
+    if(xsk->prog_fd >= 0)
+        close(xsk->prog_fd);
+    if(xsk->map_fd >= 0)
+        close(xsk->map_fd);
+    for(int i = 0; i < 4; i++)
+        if(rings[i]->map != NULL)
+            munmap(rings[i]->map, rings[i]->map_size);
+    if(xsk->fd >= 0)
+        close(xsk->fd);
+
+    free(xsk->umem);
+    free(xsk);
+}
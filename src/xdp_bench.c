@@ -0,0 +1,110 @@
+#include "../lib/connection.h"
+#include "../lib/xdp.h"
+#include <pthread.h>
+
+/* Frames per second of the raw socket against AF_XDP, between the two ends of a veth pair
+   Usage: xdp_bench <tx interface> <rx interface> [frames]
+*/
+
+/* Receiver side of one run */
+typedef struct bench_receiver {
+    int socket;
+    long long expected;
+    long long received;
+    double last_frame; // Time of the last DATA frame
+} bench_receiver_t;
+
+/* Monotonic time in seconds */
+double bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Count DATA frames until all arrived or the link is quiet for a second or two */
+void *receive_frames(void *arg)
+{
+    bench_receiver_t *receiver = arg;
+    packet_t buffer;
+
+    while(receiver->received < receiver->expected)
+    {
+        if(listen_for_packet(&buffer, 2, receiver->socket) != 0)
+            break;
+        if(buffer.type == DATA)
+        {
+            receiver->received++;
+            receiver->last_frame = bench_now();
+        }
+    }
+
+    return NULL;
+}
+
+/* Send the frames from tx to rx with one of the transports and print the rates */
+void run_bench(char *tx_device, char *rx_device, long long frames, bool use_xdp)
+{
+    int tx = create_socket(tx_device);
+    int rx = create_socket(rx_device);
+    if(tx < 0 || rx < 0)
+        return;
+
+    if(use_xdp && (xdp_attach(tx, tx_device) != 0 || xdp_attach(rx, rx_device) != 0))
+    {
+        printf("af_xdp: not available\n");
+        xdp_detach(tx);
+        close(tx);
+        close(rx);
+        return;
+    }
+
+    uint8_t data[DATA_SIZE];
+    memset(data, 0x5A, DATA_SIZE);
+    data[DATA_SIZE - 1] = 0;
+    packet_t *packet = create_or_modify_packet(NULL, MAX_DATA_SIZE, 0, DATA, data);
+
+    bench_receiver_t receiver = { rx, frames, 0, 0 };
+    pthread_t thread;
+    pthread_create(&thread, NULL, receive_frames, &receiver);
+    nanosleep(&(struct timespec){ 0, 100000000 }, NULL); // The receiver is waiting
+
+    double start = bench_now();
+    for(long long i = 0; i < frames; i++)
+    {
+        create_or_modify_packet(packet, MAX_DATA_SIZE, i % (MAX_SEQUENCE + 1), DATA, data);
+        send_packet(packet, tx);
+    }
+    xdp_flush(tx);
+    double sent = bench_now();
+
+    pthread_join(thread, NULL);
+
+    double rx_time = receiver.last_frame > start ? receiver.last_frame - start : 0;
+    printf("%-7s tx %10.0f frames/s   rx %10.0f frames/s   received %lld/%lld (%.2f%% lost)\n",
+           use_xdp ? "af_xdp" : "raw", frames / (sent - start),
+           rx_time > 0 ? receiver.received / rx_time : 0, receiver.received, frames,
+           100.0 * (frames - receiver.received) / frames);
+
+    destroy_packet(packet);
+    xdp_detach(tx);
+    xdp_detach(rx);
+    close(tx);
+    close(rx);
+}
+
+int main(int argc, char *argv[])
+{
+    if(argc < 3)
+    {
+        fprintf(stderr, "Usage: %s <tx interface> <rx interface> [frames]\n", argv[0]);
+        return 1;
+    }
+
+    long long frames = argc > 3 ? atoll(argv[3]) : 200000;
+
+    run_bench(argv[1], argv[2], frames, false);
+    run_bench(argv[1], argv[2], frames, true);
+
+    return 0;
+}